@@ -38,20 +38,68 @@
 #include <asm/io.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/debugfs.h>
 #include <linux/dma-mapping.h>
 #include <linux/iopoll.h>
 #include <linux/kfifo.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
 #include "datra-core.h"
 #include "datra-ioctl.h"
+#include "datra-memcpy.h"
 #include "datra.h"
 
+#define CREATE_TRACE_POINTS
+#include "datra-trace.h"
+
 #include <linux/version.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
 #include <linux/sched/signal.h>
 #endif
+/* splice helpers (add_to_pipe) as used here appeared in 4.9 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
+#include <linux/highmem.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#define DATRA_HAVE_SPLICE
+#endif
+/* dma-buf export, using the dma_map_sgtable API from 5.8 */
+#if IS_ENABLED(CONFIG_DMA_SHARED_BUFFER) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+#include <linux/dma-buf.h>
+#include <linux/scatterlist.h>
+#define DATRA_HAVE_DMABUF
+#endif
+
+/* User memory registration, using pin_user_pages and dma_map_sgtable */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#define DATRA_HAVE_USERPTR
+#endif
+
+/* Huge page mappings of DMA blocks, dev_is_dma_coherent appeared in 5.10 */
+#if IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+#include <linux/dma-map-ops.h>
+#include <linux/huge_mm.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>
+#endif
+#define DATRA_HAVE_HUGEPAGE
+#endif
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Topic Embedded Products <www.topic.nl>");
+#ifdef DATRA_HAVE_DMABUF
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
+#endif
 
 static const char DRIVER_CLASS_NAME[] = "datra";
 static const char DRIVER_CONTROL_NAME[] = "datractl";
@@ -70,6 +118,36 @@ static const char DRIVER_DMA_DEVICE_NAME[] = "datrad%d";
 static const unsigned int datra_dma_default_block_size = 64 * 1024;
 static const size_t datra_dma_memory_size = 256 * 1024;
 
+/* Freed DMA blocks are kept for re-use up to this amount per DMA node,
+ * can be changed per node through sysfs. */
+static unsigned long datra_dma_block_pool_limit = 8 * 1024 * 1024;
+module_param_named(dma_block_pool_limit, datra_dma_block_pool_limit, ulong, 0644);
+MODULE_PARM_DESC(dma_block_pool_limit, "Default number of bytes of freed DMA blocks kept for re-use per DMA node");
+
+/* Ring buffers are allocated on first use, and released on close unless
+ * this is set. */
+static bool datra_dma_ring_cache;
+module_param_named(dma_ring_cache, datra_dma_ring_cache, bool, 0644);
+MODULE_PARM_DESC(dma_ring_cache, "Keep DMA ring buffers allocated after the device is closed");
+
+/* Map the CPU FIFO write windows write-combining, so that consecutive
+ * writes leave the CPU as bursts. Only safe when the interconnect keeps
+ * the writes in order, so not enabled by default. */
+static bool datra_fifo_write_combine;
+module_param_named(fifo_write_combine, datra_fifo_write_combine, bool, 0444);
+MODULE_PARM_DESC(fifo_write_combine, "Map CPU FIFO write windows write-combining");
+
+/* Default size in bytes of the kernel buffer that extends each CPU read
+ * fifo, 0 means none. Can be changed per fifo using DATRA_IOCTRINGSIZE. */
+static unsigned int datra_fifo_ring_size;
+module_param_named(fifo_ring_size, datra_fifo_ring_size, uint, 0644);
+MODULE_PARM_DESC(fifo_ring_size, "Default size in bytes of the kernel buffer behind CPU read fifos");
+
+/* Same for CPU write fifos */
+static unsigned int datra_fifo_write_ring_size;
+module_param_named(fifo_write_ring_size, datra_fifo_write_ring_size, uint, 0644);
+MODULE_PARM_DESC(fifo_write_ring_size, "Default size in bytes of the kernel buffer in front of CPU write fifos");
+
 /* How to do IO. We rarely need any memory barriers, so add a "quick"
  * version that skips the memory barriers. */
 #define ioread32_quick	__raw_readl
@@ -100,22 +178,109 @@ static inline u32 datra_reg_read_quick_index(u32 __iomem *base, u32 reg, u32 ind
 	return ioread32_quick(base + (reg >> 2) + index);
 }
 
+/* 64-bit accesses for FIFO bursts. On 32-bit ARM, ldrd/strd turn into a
+ * single two-beat transaction. */
+#if defined(CONFIG_64BIT)
+#define DATRA_HAVE_IO64
+#define ioread64_quick	__raw_readq
+#define iowrite64_quick	__raw_writeq
+#elif defined(CONFIG_ARM)
+#define DATRA_HAVE_IO64
+static inline u64 ioread64_quick(const volatile void __iomem *addr)
+{
+	u64 val;
+	asm volatile("ldrd %0, %H0, %1"
+		: "=r" (val)
+		: "Q" (*(const volatile u64 __force *)addr));
+	return val;
+}
+static inline void iowrite64_quick(u64 val, volatile void __iomem *addr)
+{
+	asm volatile("strd %1, %H1, %0"
+		: "=Q" (*(volatile u64 __force *)addr)
+		: "r" (val));
+}
+#endif
+
+/* Upper limit for the fifo ring size */
+#define DATRA_FIFO_RING_MAX_SIZE	(16 * 1024 * 1024)
+/* Number of user signal changes the ring can hold */
+#define DATRA_FIFO_RING_MARKS	64
+
+/* Traffic counters of a fifo or DMA direction, shown in sysfs. These are
+ * 64-bit so they do not wrap, and atomic since the ISR updates them too. */
+struct datra_stats {
+	atomic64_t bytes;
+	atomic64_t blocks; /* DMA transfers */
+	atomic64_t short_transfers; /* DMA transfers smaller than the block size */
+	atomic64_t irqs;
+	atomic64_t wakeups; /* Interrupts that found someone waiting */
+	atomic64_t blocked; /* Times a caller had to wait */
+	atomic64_t eagain; /* Non-blocking calls that failed with EAGAIN */
+	atomic64_t stalls; /* Kernel ring was full */
+};
+
+/* Position in a fifo ring where the user signal changes */
+struct datra_fifo_ring_mark {
+	unsigned int pos;
+	u16 user_signal;
+};
+
 struct datra_fifo_dev
 {
 	struct datra_config_dev *config_parent;
 	wait_queue_head_t fifo_wait_queue; /* So the IRQ handler can notify waiting threads */
 	int index;
 	unsigned int words_transfered;
+	struct datra_stats stats;
 	unsigned int poll_treshold;
-	void* transfer_buffer;
 	u16 user_signal;
 	bool is_open;
+	bool is_mapped; /* Data window mapped into userspace */
+	/* Fifo whose mapped data page also holds this window. Busy then. */
+	struct datra_fifo_dev *mapped_by;
+	u8 read_format; /* DATRA_FIFO_READ_FORMAT_.. */
+	/* Byte mode, trailing bytes and EOF travel as user signals */
+	bool byte_mode;
+	bool byte_eof; /* EOF seen, report it on the next read */
+	u8 byte_residue[4]; /* Bytes of a word that did not fit the buffer */
+	u8 byte_residue_pos;
+	u8 byte_residue_len;
+	/* VMIN/VTIME-like behaviour of blocking reads */
+	unsigned int read_min_words;
+	unsigned int read_timeout_us;
+	/* Adaptive interrupt threshold: aim for one wakeup per
+	 * adapt_latency_us, based on the measured rate in words/s */
+	unsigned int adapt_latency_us; /* 0 when not adaptive */
+	unsigned int adapt_rate;
+	unsigned int adapt_threshold; /* Last threshold chosen */
+	unsigned int adapt_words; /* words_transfered at adapt_time */
+	ktime_t adapt_time;
+	spinlock_t adapt_lock; /* Protects the rate sampling */
+	/* Optional kernel buffer extending the hardware fifo. The indices
+	 * are free running word counts. The ISR side (producer for read
+	 * fifos, consumer for write fifos) holds ring_lock, the reader or
+	 * writer moves its own index without it. */
+	spinlock_t ring_lock;
+	u32 *ring;
+	unsigned int ring_size; /* In words, power of 2, 0 if not in use */
+	unsigned int ring_head;
+	unsigned int ring_tail;
+	struct datra_fifo_ring_mark ring_marks[DATRA_FIFO_RING_MARKS];
+	unsigned int ring_mark_head;
+	unsigned int ring_mark_tail;
+	u16 ring_user_signal; /* Of the last word put into the ring */
+	bool ring_stopped; /* Ring was full, interrupt not re-armed */
+	unsigned int ring_max_level;
+	unsigned int ring_overflows; /* Ring full while the hardware had data */
+	unsigned int ring_stalls; /* Read: hardware fifo was found full. Write: writer waited for room */
 };
 
 struct datra_fifo_control_dev
 {
 	struct datra_config_dev *config_parent;
 	struct datra_fifo_dev *fifo_devices;
+	u32 __iomem *write_base_wc; /* Write-combining alias of the write windows, if any */
 	struct cdev cdev_fifo_write;
 	struct cdev cdev_fifo_read;
 	dev_t devt_first_fifo_device;
@@ -128,6 +293,31 @@ struct datra_dma_to_logic_operation {
 	unsigned int size;
 };
 
+/* Log2 histogram, bucket i counts latencies of 2^i up to 2^(i+1) ns */
+#define DATRA_LATENCY_BUCKETS	32
+struct datra_latency_hist {
+	atomic64_t buckets[DATRA_LATENCY_BUCKETS];
+};
+
+/* Time of the interrupt that first reported a result. Results are
+ * numbered in the order they are taken. */
+struct datra_dma_completion {
+	u32 seq;
+	u64 ns;
+};
+
+/* Latency of one DMA direction. Commands complete in order, so their
+ * submit and completion times are kept in fifos. Both the command and
+ * result queues of the hardware hold up to 255 entries. */
+struct datra_dma_latency {
+	DECLARE_KFIFO(submit_ns, u64, 512);
+	DECLARE_KFIFO(complete, struct datra_dma_completion, 256);
+	atomic_t taken; /* Number of results taken */
+	u32 stamped; /* Number of results given a time, ISR only */
+	struct datra_latency_hist hardware; /* Submit until completion */
+	struct datra_latency_hist user; /* Interrupt until picked up */
+};
+
 struct datra_dma_from_logic_operation {
 	char* addr;
 	unsigned int size;
@@ -143,6 +333,14 @@ struct datra_dma_block {
 	struct datra_dma_dev* parent;
 	dma_addr_t phys_addr;
 	void* mem_addr;
+	/* Imported dma-buf, if any */
+	struct dma_buf_attachment *import_attach;
+	struct sg_table *import_sgt;
+	/* Mapping of registered user memory, if any */
+	struct sg_table userptr_sgt;
+	/* Monotonic times of the last enqueue and dequeue, in ns */
+	u64 submit_ns;
+	u64 complete_ns;
 	/* User part */
 	struct datra_buffer_block data;
 };
@@ -152,6 +350,11 @@ struct datra_dma_block_set {
 	u32 size;
 	u32 count;
 	u32 flags;
+	atomic_t exports; /* Number of dma-buf objects referring to the blocks */
+	struct list_head export_list; /* Protected by datra_dma_export_lock */
+	/* Pinned user memory, for DATRA_DMA_BLOCK_FLAG_USERPTR */
+	struct page **pages;
+	unsigned int nr_pages;
 };
 
 /* Use DMA coherent memory. Depending on hardware HP/ACP, this may yield
@@ -164,6 +367,20 @@ struct datra_dma_block_set {
 /* Indicates that the memory pointers point to a shared block and should
  * not be freed. */
 #define DATRA_DMA_BLOCK_FLAG_SHAREDMEM	4
+/* Blocks were imported from dma-buf objects owned by someone else. */
+#define DATRA_DMA_BLOCK_FLAG_IMPORTED	8
+/* Blocks are slices of a pinned user buffer. */
+#define DATRA_DMA_BLOCK_FLAG_USERPTR	16
+/* Map blocks into userspace with huge pages. */
+#define DATRA_DMA_BLOCK_FLAG_HUGEPAGE	32
+
+/* Coherent block that was freed, kept for re-use */
+struct datra_dma_pool_block {
+	struct list_head list;
+	void *mem_addr;
+	dma_addr_t phys_addr;
+	u32 size;
+};
 
 struct datra_dma_dev
 {
@@ -174,13 +391,25 @@ struct datra_dma_dev
 	struct datra_dma_block_set dma_to_logic_blocks;
 	struct datra_dma_block_set dma_from_logic_blocks;
 
-	/* big blocks of memory for read/write transfers */
+	/* Freed coherent blocks, most recent first. Allocating coherent
+	 * memory is slow and fragments CMA, so keep them around. */
+	struct mutex block_pool_lock;
+	struct list_head block_pool;
+	size_t block_pool_usage;
+	size_t block_pool_limit;
+
+	/* big blocks of memory for read/write transfers, NULL until used */
 	dma_addr_t dma_to_logic_handle;
 	void* dma_to_logic_memory;
 	unsigned int dma_to_logic_memory_size;
 	unsigned int dma_to_logic_head;
 	unsigned int dma_to_logic_tail;
 	unsigned int dma_to_logic_block_size;
+	bool dma_to_logic_streaming; /* Ring is cachable, not coherent */
+	bool dma_to_logic_byte_mode;
+	/* Bytes of a splice that did not make up a whole word yet */
+	u32 dma_to_logic_splice_residue;
+	u8 dma_to_logic_splice_residue_len;
 	DECLARE_KFIFO(dma_to_logic_wip, struct datra_dma_to_logic_operation, 16);
 	wait_queue_head_t wait_queue_to_logic;
 
@@ -190,10 +419,21 @@ struct datra_dma_dev
 	unsigned int dma_from_logic_head;
 	unsigned int dma_from_logic_tail;
 	unsigned int dma_from_logic_block_size;
+	bool dma_from_logic_streaming; /* Ring is cachable, not coherent */
 	wait_queue_head_t wait_queue_from_logic;
 	struct datra_dma_from_logic_operation dma_from_logic_current_op;
 	bool dma_from_logic_full;
+	bool dma_from_logic_byte_mode;
+	bool dma_from_logic_eof; /* EOF seen, report it on the next read */
 	bool dma_64bit;
+	bool dma_uncached; /* Coherent memory is not cached by the CPU */
+	/* Copying out of the ring, for bandwidth reporting */
+	u64 dma_from_logic_copy_bytes;
+	u64 dma_from_logic_copy_ns;
+	struct datra_stats stats_to_logic;
+	struct datra_stats stats_from_logic;
+	struct datra_dma_latency latency_to_logic;
+	struct datra_dma_latency latency_from_logic;
 };
 
 union datra_route_item_u {
@@ -828,6 +1068,11 @@ static int datra_cfg_mmap(struct file *filp, struct vm_area_struct *vma)
 			DATRA_CONFIG_SIZE);
 }
 
+static long datra_fifo_ctl_get_levels(struct datra_fifo_control_dev *fifo_ctl_dev,
+	struct datra_fifo_levels __user *arg);
+static long datra_fifo_ctl_batch(struct datra_fifo_control_dev *fifo_ctl_dev,
+	struct datra_fifo_batch __user *arg, bool is_write);
+
 static long datra_cfg_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct datra_config_dev *cfg_dev = filp->private_data;
@@ -878,6 +1123,22 @@ static long datra_cfg_ioctl(struct file *filp, unsigned int cmd, unsigned long a
 			datra_reg_write_quick(cfg_dev->control_base, DATRA_REG_FIFO_RESET_READ, arg);
 			status = 0;
 			break;
+		case DATRA_IOC_FIFO_LEVELS:
+		case DATRA_IOC_FIFO_BATCH_READ:
+		case DATRA_IOC_FIFO_BATCH_WRITE:
+			if (datra_cfg_get_node_type(cfg_dev) != DATRA_TYPE_ID_TOPIC_CPU ||
+			    !cfg_dev->private_data) {
+				status = -ENOTTY;
+				break;
+			}
+			if (_IOC_NR(cmd) == DATRA_IOC_FIFO_LEVELS)
+				status = datra_fifo_ctl_get_levels(cfg_dev->private_data,
+					(struct datra_fifo_levels __user *)arg);
+			else
+				status = datra_fifo_ctl_batch(cfg_dev->private_data,
+					(struct datra_fifo_batch __user *)arg,
+					_IOC_NR(cmd) == DATRA_IOC_FIFO_BATCH_WRITE);
+			break;
 		default:
 			printk(KERN_WARNING "DATRA ioctl unknown command: %d (arg=0x%lx).\n", _IOC_NR(cmd), arg);
 			status = -ENOTTY;
@@ -899,15 +1160,187 @@ static const struct file_operations datra_cfg_fops =
 	.release = datra_cfg_release,
 };
 
+/* Wake up anyone waiting on an interrupt */
+static void datra_wake_up(wait_queue_head_t *wq, struct datra_stats *stats)
+{
+	atomic64_inc(&stats->irqs);
+	if (waitqueue_active(wq))
+		atomic64_inc(&stats->wakeups);
+	wake_up_interruptible(wq);
+}
+
+static void datra_latency_add(struct datra_latency_hist *hist, s64 ns)
+{
+	unsigned int bucket = ns > 0 ? ilog2((u64)ns) : 0;
+
+	if (bucket >= DATRA_LATENCY_BUCKETS)
+		bucket = DATRA_LATENCY_BUCKETS - 1;
+	atomic64_inc(&hist->buckets[bucket]);
+}
+
+/* A command was written, returns the submit time */
+static u64 datra_dma_latency_submit(struct datra_dma_latency *latency)
+{
+	u64 now = ktime_get_ns();
+
+	/* When full, this and later samples are off, but not harmful */
+	kfifo_put(&latency->submit_ns, now);
+	return now;
+}
+
+/* Interrupt: give the current time to results in the hardware queue
+ * that did not get one yet. "taken" is read before the queue, so that a
+ * result taken in between is missed rather than counted twice. */
+static void datra_dma_latency_irq(struct datra_dma_latency *latency,
+	u32 __iomem *control_base, u32 status_reg)
+{
+	struct datra_dma_completion completion;
+	u32 seq = atomic_read(&latency->taken);
+	u32 end;
+
+	completion.ns = ktime_get_ns();
+	rmb();
+	end = seq + (datra_reg_read_quick(control_base, status_reg) >> 24);
+	if ((s32)(latency->stamped - seq) > 0)
+		seq = latency->stamped;
+	for (; (s32)(end - seq) > 0; ++seq) {
+		completion.seq = seq;
+		if (!kfifo_put(&latency->complete, completion))
+			break;
+	}
+	latency->stamped = seq;
+}
+
+/* A result was taken, after reading it from the hardware. If an
+ * interrupt reported it, it completed at that moment and the rest is
+ * wake-up latency. Otherwise, it was found by polling. Returns the time
+ * at which the transfer was seen to be complete. */
+static u64 datra_dma_latency_complete(struct datra_dma_latency *latency)
+{
+	u64 now = ktime_get_ns();
+	u32 seq = atomic_inc_return(&latency->taken) - 1;
+	struct datra_dma_completion completion;
+	u64 submitted;
+	u64 done = 0;
+
+	/* Skip times of results that were taken before the interrupt */
+	while (kfifo_peek(&latency->complete, &completion)) {
+		if ((s32)(completion.seq - seq) > 0)
+			break;
+		kfifo_skip(&latency->complete);
+		if (completion.seq == seq) {
+			done = completion.ns;
+			break;
+		}
+	}
+	if (!kfifo_get(&latency->submit_ns, &submitted))
+		return done ? done : now;
+	if (done) {
+		/* Can be slightly off when the command completed at once */
+		if (done < submitted)
+			done = submitted;
+		datra_latency_add(&latency->hardware, done - submitted);
+		datra_latency_add(&latency->user, now - done);
+		return done;
+	}
+	datra_latency_add(&latency->hardware, now - submitted);
+	return now;
+}
+
+/* Forget all commands and results, after a reset of the engine */
+static void datra_dma_latency_reset(struct datra_dma_latency *latency)
+{
+	kfifo_reset(&latency->submit_ns);
+	kfifo_reset(&latency->complete);
+	atomic_set(&latency->taken, 0);
+	latency->stamped = 0;
+}
+
+/* Account a DMA transfer */
+static void datra_dma_count(struct datra_stats *stats, u32 bytes, bool is_short)
+{
+	atomic64_add(bytes, &stats->bytes);
+	atomic64_inc(&stats->blocks);
+	if (is_short)
+		atomic64_inc(&stats->short_transfers);
+}
+
 /* Utilities for fifo functions */
 
-static int __iomem * datra_fifo_memory_location(struct datra_fifo_dev *fifo_dev)
+/* Account words that moved between userspace and the fifo */
+static void datra_fifo_count(struct datra_fifo_dev *fifo_dev, unsigned int words)
+{
+	fifo_dev->words_transfered += words;
+	atomic64_add((u64)words << 2, &fifo_dev->stats.bytes);
+}
+
+static u32 __iomem * datra_fifo_memory_location(struct datra_fifo_dev *fifo_dev)
 {
 	struct datra_config_dev *cfg_dev = fifo_dev->config_parent;
 	return
 		cfg_dev->base + (fifo_dev->index * (DATRA_FIFO_MEMORY_SIZE>>2));
 }
 
+/* The write window of this FIFO, write-combining if available */
+static u32 __iomem *datra_fifo_write_location(struct datra_fifo_dev *fifo_dev)
+{
+	struct datra_fifo_control_dev *fifo_ctl_dev =
+		fifo_dev->config_parent->private_data;
+
+	if (fifo_ctl_dev->write_base_wc)
+		return fifo_ctl_dev->write_base_wc +
+			(fifo_dev->index * (DATRA_FIFO_MEMORY_SIZE>>2));
+	return datra_fifo_memory_location(fifo_dev);
+}
+
+/* Move words from a read FIFO straight into the user's buffer. Every
+ * address in the window pops from the FIFO, so use incrementing wide
+ * accesses which the bus can merge into bursts. */
+static int datra_fifo_burst_to_user(char __user *buf, const u32 __iomem *src,
+	unsigned int words)
+{
+#ifdef DATRA_HAVE_IO64
+	for (; words >= 2; words -= 2) {
+		if (unlikely(__put_user(ioread64_quick(src), (u64 __user *)buf)))
+			return -EFAULT;
+		src += 2;
+		buf += 8;
+	}
+#endif
+	for (; words; --words) {
+		if (unlikely(__put_user(ioread32_quick(src), (u32 __user *)buf)))
+			return -EFAULT;
+		++src;
+		buf += 4;
+	}
+	return 0;
+}
+
+/* Move words from the user's buffer straight into a write FIFO */
+static int datra_fifo_burst_from_user(u32 __iomem *dst, const char __user *buf,
+	unsigned int words)
+{
+#ifdef DATRA_HAVE_IO64
+	for (; words >= 2; words -= 2) {
+		u64 val;
+		if (unlikely(__get_user(val, (const u64 __user *)buf)))
+			return -EFAULT;
+		iowrite64_quick(val, dst);
+		dst += 2;
+		buf += 8;
+	}
+#endif
+	for (; words; --words) {
+		u32 val;
+		if (unlikely(__get_user(val, (const u32 __user *)buf)))
+			return -EFAULT;
+		iowrite32_quick(val, dst);
+		++dst;
+		buf += 4;
+	}
+	return 0;
+}
+
 static bool datra_fifo_write_usersignal(struct datra_fifo_dev *fifo_dev, u16 user_signal)
 {
 	__iomem u32 *control_base_us =
@@ -942,296 +1375,664 @@ static void datra_fifo_read_enable_interrupt(struct datra_fifo_dev *fifo_dev, in
 	iowrite32(BIT(index + 16), control_base + (DATRA_REG_FIFO_IRQ_SET>>2));
 }
 
-static int datra_fifo_read_open(struct inode *inode, struct file *filp)
+/* Minimum time between rate samples for the adaptive threshold */
+#define DATRA_FIFO_ADAPT_INTERVAL_US	1000
+
+/* Update the rate and threshold for adaptive mode. The threshold is the
+ * number of words expected to pass within the target latency. The rate
+ * is an exponentially weighted moving average of the transfer rate,
+ * weight 1/8. Called with adapt_lock held. */
+static void datra_fifo_adaptive_sample(struct datra_fifo_dev *fifo_dev)
 {
-	int result = 0;
-	struct datra_fifo_control_dev *fifo_ctl_dev =
-		container_of(inode->i_cdev, struct datra_fifo_control_dev, cdev_fifo_read);
-	int index = inode->i_rdev - fifo_ctl_dev->devt_first_fifo_device;
-	struct datra_fifo_dev *fifo_dev = &fifo_ctl_dev->fifo_devices[index];
-	struct datra_dev* dev = fifo_ctl_dev->config_parent->parent;
+	ktime_t now = ktime_get();
+	s64 elapsed = ktime_us_delta(now, fifo_dev->adapt_time);
+	u64 words;
 
-	pr_debug("%s index=%d mode=%#x flags=%#x i-devt=%u d=%u f=%u\n", __func__,
-		index, filp->f_mode, filp->f_flags,
-		inode->i_rdev, inode->i_cdev->dev, fifo_ctl_dev->devt_first_fifo_device);
+	if (elapsed >= DATRA_FIFO_ADAPT_INTERVAL_US) {
+		u32 sample = div64_u64((u64)(fifo_dev->words_transfered -
+			fifo_dev->adapt_words) * USEC_PER_SEC, elapsed);
 
-	if (filp->f_mode & FMODE_WRITE) /* read-only device */
-		return -EINVAL;
-	if (down_interruptible(&dev->fop_sem))
-		return -ERESTARTSYS;
-	if (fifo_dev->is_open) {
-		result = -EBUSY;
-		goto error;
+		if (fifo_dev->adapt_rate)
+			fifo_dev->adapt_rate = fifo_dev->adapt_rate -
+				(fifo_dev->adapt_rate >> 3) + (sample >> 3);
+		else
+			fifo_dev->adapt_rate = sample;
+		fifo_dev->adapt_words = fifo_dev->words_transfered;
+		fifo_dev->adapt_time = now;
 	}
-	fifo_dev->transfer_buffer = kmalloc(DATRA_FIFO_READ_MAX_BURST_SIZE, GFP_KERNEL);
-	if (unlikely(fifo_dev->transfer_buffer == NULL)) {
-		result = -ENOMEM;
-		goto error;
+	words = div_u64((u64)fifo_dev->adapt_rate * fifo_dev->adapt_latency_us,
+		USEC_PER_SEC);
+	/* The enable_interrupt functions clamp to what the hardware allows */
+	WRITE_ONCE(fifo_dev->adapt_threshold,
+		clamp_t(u64, words, 1, DATRA_FIFO_MEMORY_SIZE / 4));
+}
+
+/* The interrupt threshold in adaptive mode. Only process context samples
+ * the rate, the ISR uses the threshold chosen last. */
+static int datra_fifo_adaptive_threshold(struct datra_fifo_dev *fifo_dev)
+{
+	if (!in_interrupt()) {
+		spin_lock(&fifo_dev->adapt_lock);
+		datra_fifo_adaptive_sample(fifo_dev);
+		spin_unlock(&fifo_dev->adapt_lock);
 	}
-	fifo_dev->user_signal = 0;
-	fifo_dev->is_open = true;
-	fifo_dev->poll_treshold = 1;
-	filp->private_data = fifo_dev;
-	nonseekable_open(inode, filp);
-error:
-	up(&dev->fop_sem);
-	return result;
+	return READ_ONCE(fifo_dev->adapt_threshold);
 }
 
-static int datra_fifo_read_release(struct inode *inode, struct file *filp)
+/* Threshold for someone waiting for "words" words of data or room */
+static int datra_fifo_wait_threshold(struct datra_fifo_dev *fifo_dev, int words)
 {
-	struct datra_fifo_dev *fifo_dev = filp->private_data;
-	struct datra_dev* dev = fifo_dev->config_parent->parent;
+	if (fifo_dev->adapt_latency_us) {
+		int thd = datra_fifo_adaptive_threshold(fifo_dev);
+		if (thd < words)
+			words = thd;
+	}
+	return words;
+}
 
-	pr_debug("%s index=%d\n", __func__, fifo_dev->index);
-	if (down_interruptible(&dev->fop_sem))
-		return -ERESTARTSYS;
-	kfree(fifo_dev->transfer_buffer);
-	fifo_dev->transfer_buffer = NULL;
-	fifo_dev->is_open = false;
-	up(&dev->fop_sem);
-	return 0;
+/* Threshold for poll(), the user-defined one unless adaptive */
+static int datra_fifo_poll_threshold(struct datra_fifo_dev *fifo_dev)
+{
+	if (fifo_dev->adapt_latency_us)
+		return datra_fifo_adaptive_threshold(fifo_dev);
+	return fifo_dev->poll_treshold;
 }
 
-static ssize_t datra_fifo_read_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/* Whether a blocking read that found no data should return now, given
+ * the VMIN/VTIME settings. "last" is the start of the read or the time
+ * data last arrived. Sets "deadline" for the wait, KTIME_MAX if none. */
+static bool datra_fifo_read_done(const struct datra_fifo_dev *fifo_dev,
+	size_t len, ktime_t last, ktime_t *deadline)
 {
-	struct datra_fifo_dev *fifo_dev = filp->private_data;
-	int __iomem *mapped_memory = datra_fifo_memory_location(fifo_dev);
-	int status = 0;
-	size_t len = 0;
-	pr_debug("%s(%u)\n", __func__, (unsigned int)count);
+	unsigned int min_words = fifo_dev->read_min_words;
+	unsigned int timeout_us = fifo_dev->read_timeout_us;
+
+	*deadline = KTIME_MAX;
+	if (!min_words && !timeout_us)
+		return false; /* Wait until the buffer is full */
+	if (min_words && (len >> 2) >= min_words)
+		return true;
+	if (!timeout_us)
+		return false;
+	if (!min_words && len)
+		return true;
+	if (min_words && !len)
+		return false; /* Timer starts at the first word */
+	*deadline = ktime_add_us(last, timeout_us);
+	return ktime_compare(ktime_get(), *deadline) >= 0;
+}
 
-	if (count < 4) /* Do not allow read or write below word size */
-		return -EINVAL;
+/* Interrupt threshold for a blocking read that needs "count" more bytes
+ * and has read "len" so far */
+static int datra_fifo_read_wait_words(struct datra_fifo_dev *fifo_dev,
+	size_t count, size_t len)
+{
+	unsigned int words = count >> 2;
+	unsigned int min_words = fifo_dev->read_min_words;
 
-	count &= ~0x03; /* Align to words */
+	if (min_words > (len >> 2) && min_words - (len >> 2) < words)
+		words = min_words - (len >> 2);
+	return datra_fifo_wait_threshold(fifo_dev, words);
+}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
-	if (!access_ok(buf, count))
-#else
-	if (!access_ok(VERIFY_WRITE, buf, count))
-#endif
-		return -EFAULT;
+/* Sleep until woken by the fifo interrupt, or until the deadline */
+static void datra_fifo_read_sleep(ktime_t deadline)
+{
+	if (ktime_to_ns(deadline) == KTIME_MAX)
+		schedule();
+	else
+		schedule_hrtimeout(&deadline, HRTIMER_MODE_ABS);
+}
 
-	while (count)
-	{
-		u32 words_available;
-		u16 user_signal;
-		size_t bytes;
-		if (filp->f_flags & O_NONBLOCK) {
-			words_available = datra_fifo_read_level(fifo_dev);
-			user_signal = words_available >> 16;
-			words_available &= 0xFFFF; /* Lower 16-bits only */
-			if (!words_available) {
-				/* Non-blocking IO, return what we have */
-				if (len)
-					break;
-				/* nothing copied yet, notify caller */
-				status = -EAGAIN;
-				goto error;
-			}
-			/* user_signal is valid because words_available is non-nul */
-			if (user_signal != fifo_dev->user_signal) {
-				fifo_dev->user_signal = user_signal;
-				goto exit_ok;
-			}
-		}
-		else {
-			DEFINE_WAIT(wait);
-			for (;;) {
-				prepare_to_wait(&fifo_dev->fifo_wait_queue, &wait, TASK_INTERRUPTIBLE);
-				words_available = datra_fifo_read_level(fifo_dev);
-				user_signal = words_available >> 16;
-				words_available &= 0xFFFF;
-				if (words_available) {
-					/* usersignal is only valid when there is data */
-					if (user_signal != fifo_dev->user_signal) {
-						fifo_dev->user_signal = user_signal;
-						finish_wait(&fifo_dev->fifo_wait_queue, &wait);
-						goto exit_ok;
-					}
-					break; /* Done waiting */
-				}
-				if (!signal_pending(current)) {
-					datra_fifo_read_enable_interrupt(fifo_dev, count >> 2);
-					schedule();
-					continue;
-				}
-				status = -ERESTARTSYS;
-				break;
-			}
-			finish_wait(&fifo_dev->fifo_wait_queue, &wait);
-			if (status)
-				goto error;
-		}
-		do {
-			unsigned int words;
-			bytes = words_available << 2;
-			if (bytes > DATRA_FIFO_READ_MAX_BURST_SIZE)
-				bytes = DATRA_FIFO_READ_MAX_BURST_SIZE;
-			if (count < bytes)
-				bytes = count;
-			words = bytes >> 2;
-			pr_debug("%s copy_to_user %p (%u)\n", __func__, mapped_memory, (unsigned int)bytes);
-			ioread32_rep(mapped_memory, fifo_dev->transfer_buffer, words);
-			if (unlikely(__copy_to_user(buf, fifo_dev->transfer_buffer, bytes))) {
-				status = -EFAULT;
-				goto error;
-			}
-			fifo_dev->words_transfered += words;
-			len += bytes;
-			buf += bytes;
-			count -= bytes;
-			if (!count)
-				break;
-			words_available -= words;
-		}
-		while (words_available);
+/* Read words from a fifo window into kernel memory */
+static void datra_fifo_burst_read(u32 *dst, const u32 __iomem *src,
+	unsigned int words)
+{
+#ifdef DATRA_HAVE_IO64
+	for (; words >= 2; words -= 2) {
+		put_unaligned(ioread64_quick(src), (u64 *)dst);
+		src += 2;
+		dst += 2;
 	}
-exit_ok:
-	status = len;
-	*f_pos += len;
-error:
-	pr_debug("%s -> %d pos=%u\n", __func__, status, (unsigned int)*f_pos);
-	return status;
+#endif
+	for (; words; --words)
+		*dst++ = ioread32_quick(src++);
 }
 
-static unsigned int datra_fifo_read_poll(struct file *filp, poll_table *wait)
+/* Number of times the ring functions below move a hardware fifo's worth
+ * of data while holding ring_lock. If logic and the application keep up,
+ * the re-armed interrupt fires again, instead of the ISR never exiting. */
+#define DATRA_FIFO_RING_BURSTS	4
+
+/* Move data from the hardware fifo into the ring. Called with ring_lock
+ * held, from the ISR or when the reader runs out of data. Stops after
+ * DATRA_FIFO_RING_BURSTS bursts and re-arms the interrupt at "thd"
+ * words, unless the ring filled up. The reader then
+ * calls this again once it made room. */
+static void datra_fifo_read_ring_fill(struct datra_fifo_dev *fifo_dev, int thd)
 {
-	struct datra_fifo_dev *fifo_dev = filp->private_data;
-	unsigned int mask;
-
-	poll_wait(filp, &fifo_dev->fifo_wait_queue, wait);
-	if (datra_fifo_read_level(fifo_dev) & 0xFFFF)
-		mask = (POLLIN | POLLRDNORM); /* Data available */
-	else {
-		/* Set IRQ to occur on user-defined treshold (default=1) */
-		datra_fifo_read_enable_interrupt(fifo_dev, fifo_dev->poll_treshold);
-		mask = 0;
+	u32 __iomem *mapped_memory = datra_fifo_memory_location(fifo_dev);
+	unsigned int head = fifo_dev->ring_head;
+	unsigned int mask = fifo_dev->ring_size - 1;
+	unsigned int bursts;
+
+	for (bursts = DATRA_FIFO_RING_BURSTS; bursts; --bursts) {
+		u32 level = datra_fifo_read_level(fifo_dev);
+		u16 user_signal = level >> 16;
+		unsigned int words = level & 0xFFFF;
+		unsigned int used = head - smp_load_acquire(&fifo_dev->ring_tail);
+		unsigned int room = fifo_dev->ring_size - used;
+		unsigned int offset;
+		unsigned int chunk;
+
+		if (!words)
+			break;
+		if (words >= DATRA_FIFO_READ_SIZE)
+			++fifo_dev->ring_stalls;
+		if (!room)
+			goto ring_full;
+		if (user_signal != fifo_dev->ring_user_signal) {
+			unsigned int mark_head = fifo_dev->ring_mark_head;
+			struct datra_fifo_ring_mark *mark =
+				&fifo_dev->ring_marks[mark_head % DATRA_FIFO_RING_MARKS];
+
+			if (mark_head - smp_load_acquire(&fifo_dev->ring_mark_tail) >=
+					DATRA_FIFO_RING_MARKS)
+				goto ring_full;
+			mark->pos = head;
+			mark->user_signal = user_signal;
+			smp_store_release(&fifo_dev->ring_mark_head, mark_head + 1);
+			fifo_dev->ring_user_signal = user_signal;
+		}
+		if (words > room)
+			words = room;
+		offset = head & mask;
+		chunk = min(words, fifo_dev->ring_size - offset);
+		datra_fifo_burst_read(fifo_dev->ring + offset, mapped_memory, chunk);
+		if (chunk < words)
+			datra_fifo_burst_read(fifo_dev->ring, mapped_memory, words - chunk);
+		head += words;
+		smp_store_release(&fifo_dev->ring_head, head);
+		if (used + words > fifo_dev->ring_max_level)
+			fifo_dev->ring_max_level = used + words;
 	}
+	fifo_dev->ring_stopped = false;
+	datra_fifo_read_enable_interrupt(fifo_dev, thd);
+	return;
+
+ring_full:
+	++fifo_dev->ring_overflows;
+	atomic64_inc(&fifo_dev->stats.stalls);
+	fifo_dev->ring_stopped = true;
+}
 
-	pr_debug("%s -> %#x\n", __func__, mask);
-
-	return mask;
+static void datra_fifo_ring_free(struct datra_fifo_dev *fifo_dev)
+{
+	unsigned long flags;
+	u32 *ring;
+
+	spin_lock_irqsave(&fifo_dev->ring_lock, flags);
+	ring = fifo_dev->ring;
+	fifo_dev->ring = NULL;
+	fifo_dev->ring_size = 0;
+	fifo_dev->ring_head = 0;
+	fifo_dev->ring_tail = 0;
+	fifo_dev->ring_mark_head = 0;
+	fifo_dev->ring_mark_tail = 0;
+	fifo_dev->ring_stopped = false;
+	spin_unlock_irqrestore(&fifo_dev->ring_lock, flags);
+	vfree(ring);
 }
 
-static int datra_fifo_rw_get_route_id(struct datra_fifo_dev *fifo_dev)
+/* Discard anything in the ring, e.g. after a fifo reset */
+static void datra_fifo_ring_clear(struct datra_fifo_dev *fifo_dev)
 {
-	return datra_get_config_index(fifo_dev->config_parent) |
-		(fifo_dev->index << 8);
+	unsigned long flags;
+
+	spin_lock_irqsave(&fifo_dev->ring_lock, flags);
+	fifo_dev->ring_tail = fifo_dev->ring_head;
+	fifo_dev->ring_mark_tail = fifo_dev->ring_mark_head;
+	spin_unlock_irqrestore(&fifo_dev->ring_lock, flags);
 }
 
-static int datra_fifo_rw_add_route(struct datra_fifo_dev *fifo_dev, int source, int dest)
+/* (Re)size the ring of a fifo, only allowed while it is empty */
+static int datra_fifo_ring_set_size(struct datra_fifo_dev *fifo_dev, unsigned int bytes,
+	bool is_write)
 {
-	struct datra_route_item_t route;
-	route.srcFifo = (source >> 8) & 0xFF;
-	route.srcNode = source & 0xFF;
-	route.dstFifo = (dest >> 8) & 0xFF;
-	route.dstNode = dest & 0xFF;
-	datra_ctl_route_add(fifo_dev->config_parent->parent, route);
+	struct device *device = fifo_dev->config_parent->parent->device;
+	unsigned long flags;
+	unsigned int words;
+	u32 *ring;
+	u32 *old;
+
+	if (bytes > DATRA_FIFO_RING_MAX_SIZE)
+		return -EINVAL;
+	if (bytes && bytes < DATRA_FIFO_MEMORY_SIZE)
+		bytes = DATRA_FIFO_MEMORY_SIZE;
+	words = bytes ? roundup_pow_of_two(bytes) >> 2 : 0;
+	if (words == fifo_dev->ring_size)
+		return 0;
+	if (!words) {
+		if (fifo_dev->ring_head != fifo_dev->ring_tail)
+			return -EBUSY;
+		datra_fifo_ring_free(fifo_dev);
+		return 0;
+	}
+
+	ring = vmalloc_node(words * sizeof(u32), dev_to_node(device));
+	if (!ring)
+		return -ENOMEM;
+	spin_lock_irqsave(&fifo_dev->ring_lock, flags);
+	if (fifo_dev->ring_head != fifo_dev->ring_tail) {
+		spin_unlock_irqrestore(&fifo_dev->ring_lock, flags);
+		vfree(ring);
+		return -EBUSY;
+	}
+	old = fifo_dev->ring;
+	fifo_dev->ring = ring;
+	fifo_dev->ring_size = words;
+	fifo_dev->ring_head = 0;
+	fifo_dev->ring_tail = 0;
+	fifo_dev->ring_mark_head = 0;
+	fifo_dev->ring_mark_tail = 0;
+	fifo_dev->ring_user_signal = fifo_dev->user_signal;
+	/* Start draining the hardware fifo in the background */
+	if (!is_write)
+		datra_fifo_read_ring_fill(fifo_dev,
+			datra_fifo_wait_threshold(fifo_dev, DATRA_FIFO_READ_SIZE / 2));
+	spin_unlock_irqrestore(&fifo_dev->ring_lock, flags);
+	vfree(old);
 	return 0;
 }
 
-static long datra_fifo_rw_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+/* read() on a fifo with a ring, the ISR keeps the ring filled. Same
+ * semantics as reading the hardware fifo directly. */
+static ssize_t datra_fifo_read_ring_read(struct datra_fifo_dev *fifo_dev,
+	char __user *buf, size_t count, bool is_blocking)
 {
-	struct datra_fifo_dev *fifo_dev = filp->private_data;
-	if (unlikely(fifo_dev == NULL))
-		return -ENODEV;
+	unsigned int mask = fifo_dev->ring_size - 1;
+	unsigned long flags;
+	size_t len = 0;
+	int status = 0;
+	ktime_t last = fifo_dev->read_timeout_us ? ktime_get() : 0;
+	ktime_t deadline;
 
-	pr_debug("%s cmd=%#x (%d) arg=%#lx\n", __func__, cmd, _IOC_NR(cmd), arg);
-	if (_IOC_TYPE(cmd) != DATRA_IOC_MAGIC)
-		return -ENOTTY;
+	while (count) {
+		unsigned int tail = fifo_dev->ring_tail;
+		unsigned int words = smp_load_acquire(&fifo_dev->ring_head) - tail;
+		unsigned int mark_tail;
+		unsigned int offset;
+		unsigned int chunk;
 
-	switch (_IOC_NR(cmd))
-	{
-		case DATRA_IOC_ROUTE_QUERY_ID:
-			return datra_fifo_rw_get_route_id(fifo_dev);
-		case DATRA_IOC_ROUTE_TELL_TO_LOGIC:
-			if ((filp->f_mode & FMODE_WRITE) == 0)
-				return -ENOTTY; /* Cannot route from this node */
-			return datra_fifo_rw_add_route(fifo_dev, datra_fifo_rw_get_route_id(fifo_dev), arg);
-		case DATRA_IOC_ROUTE_TELL_FROM_LOGIC:
-			if ((filp->f_mode & FMODE_READ) == 0)
-				return -ENOTTY; /* Cannot route to this node */
-			return datra_fifo_rw_add_route(fifo_dev, arg, datra_fifo_rw_get_route_id(fifo_dev));
-		case DATRA_IOC_TRESHOLD_QUERY:
-			return fifo_dev->poll_treshold;
-		case DATRA_IOC_TRESHOLD_TELL:
-			if (arg < 1)
-				arg = 1;
-			else if (arg > 192)
-				arg = 192;
-			fifo_dev->poll_treshold = arg;
-			return 0;
-		/* ioctl value or type does not matter, this always resets the
-		 * associated fifo in the hardware. */
-		case DATRA_IOC_RESET_FIFO_WRITE:
-		case DATRA_IOC_RESET_FIFO_READ:
-			if ((filp->f_mode & FMODE_WRITE) != 0)
-				datra_reg_write_quick(fifo_dev->config_parent->control_base,
-					DATRA_REG_FIFO_RESET_WRITE, 1 << fifo_dev->index);
-			else
-				datra_reg_write_quick(fifo_dev->config_parent->control_base,
-					DATRA_REG_FIFO_RESET_READ, 1 << fifo_dev->index);
-			return 0;
-		case DATRA_IOC_USERSIGNAL_QUERY:
-			/* TODO: Return LAST usersignal, not next */
-			return fifo_dev->user_signal;
-		case DATRA_IOC_USERSIGNAL_TELL:
-			if (!(filp->f_mode & FMODE_WRITE))
-				return -EINVAL;
-			arg &= 0xFFFF; /* Only lower bits */
-			if (!datra_fifo_write_usersignal(fifo_dev, arg)) {
-				printk(KERN_ERR "%s: Failed to set usersignal\n", __func__);
-				return -EIO;
+		if (!words) {
+			DEFINE_WAIT(wait);
+			for (;;) {
+				if (is_blocking)
+					prepare_to_wait(&fifo_dev->fifo_wait_queue, &wait, TASK_INTERRUPTIBLE);
+				spin_lock_irqsave(&fifo_dev->ring_lock, flags);
+				datra_fifo_read_ring_fill(fifo_dev,
+					datra_fifo_read_wait_words(fifo_dev, count, len));
+				spin_unlock_irqrestore(&fifo_dev->ring_lock, flags);
+				words = smp_load_acquire(&fifo_dev->ring_head) - tail;
+				if (words || !is_blocking)
+					break;
+				if (datra_fifo_read_done(fifo_dev, len, last, &deadline)) {
+					status = len ? 0 : -ETIMEDOUT;
+					break;
+				}
+				if (signal_pending(current)) {
+					status = -ERESTARTSYS;
+					break;
+				}
+				atomic64_inc(&fifo_dev->stats.blocked);
+				datra_fifo_read_sleep(deadline);
 			}
-			fifo_dev->user_signal = arg;
-			return 0;
-		default:
-			return -ENOTTY;
+			if (is_blocking)
+				finish_wait(&fifo_dev->fifo_wait_queue, &wait);
+			if (status)
+				return status;
+			if (!words) {
+				/* Non-blocking IO, or VMIN/VTIME satisfied */
+				if (len)
+					break;
+				atomic64_inc(&fifo_dev->stats.eagain);
+				return -EAGAIN;
+			}
+		}
+
+		mark_tail = fifo_dev->ring_mark_tail;
+		if (mark_tail != smp_load_acquire(&fifo_dev->ring_mark_head)) {
+			struct datra_fifo_ring_mark *mark =
+				&fifo_dev->ring_marks[mark_tail % DATRA_FIFO_RING_MARKS];
+			u16 user_signal = mark->user_signal;
+
+			if (mark->pos == tail) {
+				smp_store_release(&fifo_dev->ring_mark_tail, mark_tail + 1);
+				if (user_signal != fifo_dev->user_signal) {
+					fifo_dev->user_signal = user_signal;
+					break;
+				}
+				continue;
+			}
+			if (mark->pos - tail < words)
+				words = mark->pos - tail;
+		}
+
+		if (words > (count >> 2))
+			words = count >> 2;
+		offset = tail & mask;
+		chunk = min(words, fifo_dev->ring_size - offset);
+		if (unlikely(__copy_to_user(buf, fifo_dev->ring + offset, chunk << 2)))
+			return -EFAULT;
+		if (chunk < words &&
+		    unlikely(__copy_to_user(buf + (chunk << 2), fifo_dev->ring, (words - chunk) << 2)))
+			return -EFAULT;
+		smp_store_release(&fifo_dev->ring_tail, tail + words);
+		datra_fifo_count(fifo_dev, words);
+		len += words << 2;
+		buf += words << 2;
+		count -= words << 2;
+		if (fifo_dev->read_timeout_us)
+			last = ktime_get();
+
+		if (unlikely(READ_ONCE(fifo_dev->ring_stopped))) {
+			/* Room was made, resume draining the hardware */
+			spin_lock_irqsave(&fifo_dev->ring_lock, flags);
+			datra_fifo_read_ring_fill(fifo_dev,
+				datra_fifo_wait_threshold(fifo_dev, DATRA_FIFO_READ_SIZE / 2));
+			spin_unlock_irqrestore(&fifo_dev->ring_lock, flags);
+		}
 	}
+	return len;
 }
 
+/* Number of words at the head of a read fifo (or its ring) that share
+ * the same user signal, and that user signal. */
+static unsigned int datra_fifo_read_peek(struct datra_fifo_dev *fifo_dev,
+	u16 *user_signal)
+{
+	unsigned int tail;
+	unsigned int words;
+	unsigned int mark_tail;
+
+	if (!fifo_dev->ring_size) {
+		u32 level = datra_fifo_read_level(fifo_dev);
+		*user_signal = level >> 16;
+		return min_t(u32, level & 0xFFFF, DATRA_FIFO_READ_MAX_BURST_SIZE >> 2);
+	}
 
-static const struct file_operations datra_fifo_read_fops =
+	tail = fifo_dev->ring_tail;
+	words = smp_load_acquire(&fifo_dev->ring_head) - tail;
+	if (!words)
+		return 0;
+	/* Apply user signal changes at the tail, stop at the next one */
+	for (mark_tail = fifo_dev->ring_mark_tail;
+	     mark_tail != smp_load_acquire(&fifo_dev->ring_mark_head);
+	     ++mark_tail) {
+		struct datra_fifo_ring_mark *mark =
+			&fifo_dev->ring_marks[mark_tail % DATRA_FIFO_RING_MARKS];
+
+		if (mark->pos != tail) {
+			if (mark->pos - tail < words)
+				words = mark->pos - tail;
+			break;
+		}
+		fifo_dev->user_signal = mark->user_signal;
+		smp_store_release(&fifo_dev->ring_mark_tail, mark_tail + 1);
+	}
+	*user_signal = fifo_dev->user_signal;
+	return words;
+}
+
+/* Release words from the read ring, and resume draining the hardware if
+ * it was stopped for lack of room */
+static void datra_fifo_read_ring_consume(struct datra_fifo_dev *fifo_dev,
+	unsigned int words)
 {
-	.owner = THIS_MODULE,
-	.read = datra_fifo_read_read,
-	.llseek = no_llseek,
-	.poll = datra_fifo_read_poll,
-	.unlocked_ioctl = datra_fifo_rw_ioctl,
-	.open = datra_fifo_read_open,
-	.release = datra_fifo_read_release,
-};
+	unsigned long flags;
+
+	smp_store_release(&fifo_dev->ring_tail, fifo_dev->ring_tail + words);
+	if (unlikely(READ_ONCE(fifo_dev->ring_stopped))) {
+		spin_lock_irqsave(&fifo_dev->ring_lock, flags);
+		datra_fifo_read_ring_fill(fifo_dev,
+			datra_fifo_wait_threshold(fifo_dev, DATRA_FIFO_READ_SIZE / 2));
+		spin_unlock_irqrestore(&fifo_dev->ring_lock, flags);
+	}
+}
 
-static int datra_fifo_write_level(struct datra_fifo_dev *fifo_dev)
+/* Move words, as reported by datra_fifo_read_peek, to userspace */
+static int datra_fifo_read_take(struct datra_fifo_dev *fifo_dev,
+	char __user *buf, unsigned int words)
 {
-	return datra_reg_read_quick_index(
-		fifo_dev->config_parent->control_base,
-		DATRA_REG_FIFO_WRITE_LEVEL_BASE,
-		fifo_dev->index);
+	unsigned int tail;
+	unsigned int offset;
+	unsigned int chunk;
+
+	if (!fifo_dev->ring_size)
+		return datra_fifo_burst_to_user(buf,
+			datra_fifo_memory_location(fifo_dev), words);
+
+	tail = fifo_dev->ring_tail;
+	offset = tail & (fifo_dev->ring_size - 1);
+	chunk = min(words, fifo_dev->ring_size - offset);
+	if (unlikely(__copy_to_user(buf, fifo_dev->ring + offset, chunk << 2)))
+		return -EFAULT;
+	if (chunk < words &&
+	    unlikely(__copy_to_user(buf + (chunk << 2), fifo_dev->ring, (words - chunk) << 2)))
+		return -EFAULT;
+	datra_fifo_read_ring_consume(fifo_dev, words);
+	return 0;
 }
 
-static void datra_fifo_write_enable_interrupt(struct datra_fifo_dev *fifo_dev, int thd)
+/* Take a single word, as reported by datra_fifo_read_peek */
+static u32 datra_fifo_read_take_word(struct datra_fifo_dev *fifo_dev)
 {
-	int index = fifo_dev->index;
-	__iomem int *control_base =
-		fifo_dev->config_parent->control_base;
-	if (thd > (DATRA_FIFO_WRITE_SIZE*2)/3)
-		thd = (DATRA_FIFO_WRITE_SIZE*2)/3;
-	else if (thd)
-		--thd; /* IRQ will trigger when level is above thd */
-	pr_debug("%s index=%d thd=%d\n", __func__, index, thd);
-	iowrite32(thd, control_base + (DATRA_REG_FIFO_WRITE_THD_BASE>>2) + index);
-	iowrite32(BIT(index), control_base + (DATRA_REG_FIFO_IRQ_SET>>2));
+	u32 word;
+
+	if (!fifo_dev->ring_size)
+		return ioread32_quick(datra_fifo_memory_location(fifo_dev));
+
+	word = fifo_dev->ring[fifo_dev->ring_tail & (fifo_dev->ring_size - 1)];
+	datra_fifo_read_ring_consume(fifo_dev, 1);
+	return word;
 }
 
-static int datra_fifo_write_open(struct inode *inode, struct file *filp)
+/* Wait until a read fifo, or its ring, has data */
+static int datra_fifo_read_wait_data(struct datra_fifo_dev *fifo_dev)
+{
+	DEFINE_WAIT(wait);
+	unsigned long flags;
+	u16 user_signal;
+	int status = 0;
+
+	for (;;) {
+		prepare_to_wait(&fifo_dev->fifo_wait_queue, &wait, TASK_INTERRUPTIBLE);
+		if (fifo_dev->ring_size) {
+			spin_lock_irqsave(&fifo_dev->ring_lock, flags);
+			datra_fifo_read_ring_fill(fifo_dev, datra_fifo_wait_threshold(fifo_dev, 1));
+			spin_unlock_irqrestore(&fifo_dev->ring_lock, flags);
+		}
+		if (datra_fifo_read_peek(fifo_dev, &user_signal))
+			break;
+		if (signal_pending(current)) {
+			status = -ERESTARTSYS;
+			break;
+		}
+		if (!fifo_dev->ring_size)
+			datra_fifo_read_enable_interrupt(fifo_dev, 1);
+		atomic64_inc(&fifo_dev->stats.blocked);
+		schedule();
+	}
+	finish_wait(&fifo_dev->fifo_wait_queue, &wait);
+	return status;
+}
+
+/* read() in DATRA_FIFO_READ_FORMAT_RECORDS format */
+static ssize_t datra_fifo_read_records(struct datra_fifo_dev *fifo_dev,
+	char __user *buf, size_t count, bool is_blocking)
+{
+	struct datra_fifo_record record;
+	size_t len = 0;
+	u16 user_signal;
+	int status;
+
+	if (count < sizeof(record) + 4)
+		return -EINVAL;
+
+	if (is_blocking) {
+		/* Wait for the first record */
+		status = datra_fifo_read_wait_data(fifo_dev);
+		if (status)
+			return status;
+	}
+
+	while (count >= sizeof(record) + 4) {
+		unsigned int words = datra_fifo_read_peek(fifo_dev, &user_signal);
+
+		if (!words)
+			break;
+		if (words > (count - sizeof(record)) >> 2)
+			words = (count - sizeof(record)) >> 2;
+		if (words > 0xFFFF)
+			words = 0xFFFF;
+		record.user_signal = user_signal;
+		record.words = words;
+		if (unlikely(__copy_to_user(buf, &record, sizeof(record))))
+			return -EFAULT;
+		if (unlikely(datra_fifo_read_take(fifo_dev, buf + sizeof(record), words)))
+			return -EFAULT;
+		fifo_dev->user_signal = user_signal;
+		datra_fifo_count(fifo_dev, words);
+		len += sizeof(record) + (words << 2);
+		buf += sizeof(record) + (words << 2);
+		count -= sizeof(record) + (words << 2);
+	}
+	if (!len) {
+		atomic64_inc(&fifo_dev->stats.eagain);
+		return -EAGAIN;
+	}
+	return len;
+}
+
+/* read() in byte mode. Words with user signal DATRA_USERSIGNAL_BYTES1..3
+ * carry only that many bytes, and a word with DATRA_USERSIGNAL_EOF marks
+ * the end of the stream, which read() reports by returning 0. */
+static ssize_t datra_fifo_read_bytes(struct datra_fifo_dev *fifo_dev,
+	char __user *buf, size_t count, bool is_blocking)
+{
+	size_t len = 0;
+	u16 user_signal;
+	u32 word;
+	int status;
+
+	if (fifo_dev->byte_eof) {
+		fifo_dev->byte_eof = false;
+		return 0;
+	}
+	if (!count)
+		return 0;
+
+	if (is_blocking && !fifo_dev->byte_residue_len) {
+		status = datra_fifo_read_wait_data(fifo_dev);
+		if (status)
+			return status;
+	}
+
+	while (count) {
+		unsigned int words;
+
+		if (fifo_dev->byte_residue_len) {
+			unsigned int bytes = min_t(size_t, count, fifo_dev->byte_residue_len);
+
+			if (unlikely(__copy_to_user(buf,
+					fifo_dev->byte_residue + fifo_dev->byte_residue_pos, bytes)))
+				return -EFAULT;
+			fifo_dev->byte_residue_pos += bytes;
+			fifo_dev->byte_residue_len -= bytes;
+			len += bytes;
+			buf += bytes;
+			count -= bytes;
+			continue;
+		}
+		words = datra_fifo_read_peek(fifo_dev, &user_signal);
+		if (!words)
+			break;
+		if (user_signal >= DATRA_USERSIGNAL_BYTES1 &&
+		    user_signal <= DATRA_USERSIGNAL_EOF) {
+			word = datra_fifo_read_take_word(fifo_dev);
+			datra_fifo_count(fifo_dev, 1);
+			if (user_signal == DATRA_USERSIGNAL_EOF) {
+				if (!len)
+					return 0;
+				fifo_dev->byte_eof = true;
+				break;
+			}
+			memcpy(fifo_dev->byte_residue, &word, sizeof(word));
+			fifo_dev->byte_residue_pos = 0;
+			fifo_dev->byte_residue_len = user_signal;
+			continue;
+		}
+		if (count < 4) {
+			/* Keep what does not fit for the next call */
+			word = datra_fifo_read_take_word(fifo_dev);
+			datra_fifo_count(fifo_dev, 1);
+			memcpy(fifo_dev->byte_residue, &word, sizeof(word));
+			fifo_dev->byte_residue_pos = 0;
+			fifo_dev->byte_residue_len = sizeof(word);
+			continue;
+		}
+		if (words > (count >> 2))
+			words = count >> 2;
+		if (unlikely(datra_fifo_read_take(fifo_dev, buf, words)))
+			return -EFAULT;
+		datra_fifo_count(fifo_dev, words);
+		len += words << 2;
+		buf += words << 2;
+		count -= words << 2;
+	}
+	if (!len) {
+		atomic64_inc(&fifo_dev->stats.eagain);
+		return -EAGAIN;
+	}
+	return len;
+}
+
+/* Switch byte mode on or off. On a write fifo the driver then owns the
+ * user signal, so data written before goes out with the old signal. */
+static long datra_fifo_set_byte_mode(struct datra_fifo_dev *fifo_dev,
+	struct file *filp, unsigned long arg)
+{
+	const bool is_write = (filp->f_mode & FMODE_WRITE) != 0;
+
+	if (arg > 1)
+		return -EINVAL;
+	if (!is_write && arg &&
+	    fifo_dev->read_format == DATRA_FIFO_READ_FORMAT_RECORDS)
+		return -EBUSY;
+	if (is_write && arg && !fifo_dev->byte_mode) {
+		if (wait_event_interruptible(fifo_dev->fifo_wait_queue,
+				fifo_dev->ring_head == READ_ONCE(fifo_dev->ring_tail)))
+			return -ERESTARTSYS;
+		datra_fifo_write_usersignal(fifo_dev, DATRA_USERSIGNAL_ZERO);
+		fifo_dev->user_signal = DATRA_USERSIGNAL_ZERO;
+	}
+	fifo_dev->byte_mode = arg;
+	fifo_dev->byte_eof = false;
+	fifo_dev->byte_residue_len = 0;
+	return 0;
+}
+
+/* Open, or sharing a page that is mapped into userspace */
+static bool datra_fifo_is_busy(const struct datra_fifo_dev *fifo_dev)
+{
+	return fifo_dev->is_open || fifo_dev->mapped_by;
+}
+
+static int datra_fifo_read_open(struct inode *inode, struct file *filp)
 {
 	int result = 0;
 	struct datra_fifo_control_dev *fifo_ctl_dev =
-		container_of(inode->i_cdev, struct datra_fifo_control_dev, cdev_fifo_write);
+		container_of(inode->i_cdev, struct datra_fifo_control_dev, cdev_fifo_read);
 	int index = inode->i_rdev - fifo_ctl_dev->devt_first_fifo_device;
 	struct datra_fifo_dev *fifo_dev = &fifo_ctl_dev->fifo_devices[index];
 	struct datra_dev* dev = fifo_ctl_dev->config_parent->parent;
@@ -1240,99 +2041,158 @@ static int datra_fifo_write_open(struct inode *inode, struct file *filp)
 		index, filp->f_mode, filp->f_flags,
 		inode->i_rdev, inode->i_cdev->dev, fifo_ctl_dev->devt_first_fifo_device);
 
-	if (filp->f_mode & FMODE_READ) /* write-only device */
+	if (filp->f_mode & FMODE_WRITE) /* read-only device */
 		return -EINVAL;
-
 	if (down_interruptible(&dev->fop_sem))
 		return -ERESTARTSYS;
-	if (fifo_dev->is_open) {
+	if (datra_fifo_is_busy(fifo_dev)) {
 		result = -EBUSY;
 		goto error;
 	}
-	fifo_dev->poll_treshold = DATRA_FIFO_WRITE_SIZE / 2;
-	filp->private_data = fifo_dev;
-	fifo_dev->user_signal = DATRA_USERSIGNAL_ZERO;
-	fifo_dev->transfer_buffer = kmalloc(DATRA_FIFO_WRITE_MAX_BURST_SIZE, GFP_KERNEL);
-	if (unlikely(fifo_dev->transfer_buffer == NULL)) {
-		result = -ENOMEM;
-		goto error;
-	}
-	/* Set user signal register */
-	if (!datra_fifo_write_usersignal(fifo_dev, DATRA_USERSIGNAL_ZERO)) {
-		printk(KERN_ERR "%s: Failed to reset usersignals on w%d\n",
-			__func__, index);
-		result = -EIO;
-		goto error;
+	fifo_dev->user_signal = 0;
+	fifo_dev->read_format = DATRA_FIFO_READ_FORMAT_STREAM;
+	fifo_dev->byte_mode = false;
+	fifo_dev->byte_eof = false;
+	fifo_dev->byte_residue_len = 0;
+	fifo_dev->read_min_words = 0;
+	fifo_dev->read_timeout_us = 0;
+	fifo_dev->adapt_latency_us = 0;
+	if (datra_fifo_ring_size) {
+		result = datra_fifo_ring_set_size(fifo_dev, datra_fifo_ring_size, false);
+		if (result)
+			goto error;
 	}
 	fifo_dev->is_open = true;
+	fifo_dev->poll_treshold = 1;
+	filp->private_data = fifo_dev;
 	nonseekable_open(inode, filp);
 error:
 	up(&dev->fop_sem);
 	return result;
 }
 
-static int datra_fifo_write_release(struct inode *inode, struct file *filp)
+static int datra_fifo_read_release(struct inode *inode, struct file *filp)
 {
 	struct datra_fifo_dev *fifo_dev = filp->private_data;
 	struct datra_dev* dev = fifo_dev->config_parent->parent;
-	int status = 0;
 
 	pr_debug("%s index=%d\n", __func__, fifo_dev->index);
 	if (down_interruptible(&dev->fop_sem))
 		return -ERESTARTSYS;
-	kfree(fifo_dev->transfer_buffer);
-	fifo_dev->transfer_buffer = NULL;
+	datra_fifo_ring_free(fifo_dev);
 	fifo_dev->is_open = false;
+	if (fifo_dev->is_mapped)
+		datra_fifo_page_release(fifo_dev);
+	fifo_dev->is_mapped = false;
 	up(&dev->fop_sem);
-	return status;
+	return 0;
 }
 
-static ssize_t datra_fifo_write_write (struct file *filp, const char __user *buf, size_t count,
-	loff_t *f_pos)
+static ssize_t datra_fifo_read_user(struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
 {
-	int status = 0;
 	struct datra_fifo_dev *fifo_dev = filp->private_data;
-	int __iomem *mapped_memory = datra_fifo_memory_location(fifo_dev);
+	u32 __iomem *mapped_memory = datra_fifo_memory_location(fifo_dev);
+	int status = 0;
 	size_t len = 0;
-
+	ktime_t last = 0;
+	ktime_t deadline;
 	pr_debug("%s(%u)\n", __func__, (unsigned int)count);
 
-	if (count < 4) /* Do not allow read or write below word size */
-		return -EINVAL;
+	/* Byte mode takes any size */
+	if (!fifo_dev->byte_mode) {
+		if (count < 4) /* Do not allow read or write below word size */
+			return -EINVAL;
+
+		count &= ~0x03; /* Align to words */
+	}
 
-	count &= ~0x03; /* Align to words */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
 	if (!access_ok(buf, count))
 #else
-	if (!access_ok(VERIFY_READ, buf, count))
+	if (!access_ok(VERIFY_WRITE, buf, count))
 #endif
 		return -EFAULT;
 
-	while (count)
-	{
-		int words_available;
+	if (fifo_dev->byte_mode) {
+		status = datra_fifo_read_bytes(fifo_dev, buf, count,
+			!(filp->f_flags & O_NONBLOCK));
+		if (status > 0)
+			*f_pos += status;
+		return status;
+	}
+
+	if (fifo_dev->read_format == DATRA_FIFO_READ_FORMAT_RECORDS) {
+		status = datra_fifo_read_records(fifo_dev, buf, count,
+			!(filp->f_flags & O_NONBLOCK));
+		if (status > 0)
+			*f_pos += status;
+		return status;
+	}
+
+	if (fifo_dev->ring_size) {
+		status = datra_fifo_read_ring_read(fifo_dev, buf, count,
+			!(filp->f_flags & O_NONBLOCK));
+		if (status > 0)
+			*f_pos += status;
+		return status;
+	}
+
+	if (fifo_dev->read_timeout_us)
+		last = ktime_get();
+
+	while (count)
+	{
+		u32 words_available;
+		u16 user_signal;
 		size_t bytes;
 		if (filp->f_flags & O_NONBLOCK) {
-			words_available = datra_fifo_write_level(fifo_dev);
+			words_available = datra_fifo_read_level(fifo_dev);
+			user_signal = words_available >> 16;
+			words_available &= 0xFFFF; /* Lower 16-bits only */
 			if (!words_available) {
 				/* Non-blocking IO, return what we have */
 				if (len)
 					break;
 				/* nothing copied yet, notify caller */
+				atomic64_inc(&fifo_dev->stats.eagain);
 				status = -EAGAIN;
 				goto error;
 			}
+			/* user_signal is valid because words_available is non-nul */
+			if (user_signal != fifo_dev->user_signal) {
+				fifo_dev->user_signal = user_signal;
+				goto exit_ok;
+			}
 		}
 		else {
 			DEFINE_WAIT(wait);
 			for (;;) {
 				prepare_to_wait(&fifo_dev->fifo_wait_queue, &wait, TASK_INTERRUPTIBLE);
-				words_available = datra_fifo_write_level(fifo_dev);
-				if (words_available)
+				words_available = datra_fifo_read_level(fifo_dev);
+				user_signal = words_available >> 16;
+				words_available &= 0xFFFF;
+				if (words_available) {
+					/* usersignal is only valid when there is data */
+					if (user_signal != fifo_dev->user_signal) {
+						fifo_dev->user_signal = user_signal;
+						finish_wait(&fifo_dev->fifo_wait_queue, &wait);
+						goto exit_ok;
+					}
 					break; /* Done waiting */
+				}
+				if (datra_fifo_read_done(fifo_dev, len, last, &deadline)) {
+					finish_wait(&fifo_dev->fifo_wait_queue, &wait);
+					if (len)
+						goto exit_ok;
+					status = -ETIMEDOUT;
+					goto error;
+				}
 				if (!signal_pending(current)) {
-					datra_fifo_write_enable_interrupt(fifo_dev, count >> 2);
-					schedule();
+					datra_fifo_read_enable_interrupt(fifo_dev,
+						datra_fifo_read_wait_words(fifo_dev, count, len));
+					atomic64_inc(&fifo_dev->stats.blocked);
+					datra_fifo_read_sleep(deadline);
 					continue;
 				}
 				status = -ERESTARTSYS;
@@ -1345,18 +2205,17 @@ static ssize_t datra_fifo_write_write (struct file *filp, const char __user *buf
 		do {
 			unsigned int words;
 			bytes = words_available << 2;
-			if (bytes > DATRA_FIFO_WRITE_MAX_BURST_SIZE)
-				bytes = DATRA_FIFO_WRITE_MAX_BURST_SIZE;
+			if (bytes > DATRA_FIFO_READ_MAX_BURST_SIZE)
+				bytes = DATRA_FIFO_READ_MAX_BURST_SIZE;
 			if (count < bytes)
 				bytes = count;
 			words = bytes >> 2;
-			pr_debug("%s copy_from_user %p (%u)\n", __func__, mapped_memory, (unsigned int)bytes);
-			if (unlikely(__copy_from_user(fifo_dev->transfer_buffer, buf, bytes))) {
+			pr_debug("%s copy_to_user %p (%u)\n", __func__, mapped_memory, (unsigned int)bytes);
+			if (unlikely(datra_fifo_burst_to_user(buf, mapped_memory, words))) {
 				status = -EFAULT;
 				goto error;
 			}
-			iowrite32_rep(mapped_memory, fifo_dev->transfer_buffer, words);
-			fifo_dev->words_transfered += words;
+			datra_fifo_count(fifo_dev, words);
 			len += bytes;
 			buf += bytes;
 			count -= bytes;
@@ -1365,8 +2224,10 @@ static ssize_t datra_fifo_write_write (struct file *filp, const char __user *buf
 			words_available -= words;
 		}
 		while (words_available);
+		if (fifo_dev->read_timeout_us)
+			last = ktime_get();
 	}
-
+exit_ok:
 	status = len;
 	*f_pos += len;
 error:
@@ -1374,17 +2235,43 @@ error:
 	return status;
 }
 
-static unsigned int datra_fifo_write_poll(struct file *filp, poll_table *wait)
+static ssize_t datra_fifo_read_read(struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+	struct datra_fifo_dev *fifo_dev = filp->private_data;
+	ssize_t status;
+
+	status = datra_fifo_read_user(filp, buf, count, f_pos);
+	if (trace_datra_fifo_read_enabled())
+		trace_datra_fifo_read(datra_get_config_index(fifo_dev->config_parent),
+			fifo_dev->index, count, status,
+			fifo_dev->ring_size ?
+				fifo_dev->ring_head - fifo_dev->ring_tail :
+				datra_fifo_read_level(fifo_dev) & 0xFFFF);
+	return status;
+}
+
+static unsigned int datra_fifo_read_poll(struct file *filp, poll_table *wait)
 {
 	struct datra_fifo_dev *fifo_dev = filp->private_data;
 	unsigned int mask;
 
 	poll_wait(filp, &fifo_dev->fifo_wait_queue, wait);
-	if (datra_fifo_write_level(fifo_dev))
-		mask = (POLLOUT | POLLWRNORM);
+	if (fifo_dev->ring_size) {
+		unsigned long flags;
+
+		spin_lock_irqsave(&fifo_dev->ring_lock, flags);
+		if (fifo_dev->ring_head == READ_ONCE(fifo_dev->ring_tail))
+			datra_fifo_read_ring_fill(fifo_dev, datra_fifo_poll_threshold(fifo_dev));
+		mask = (fifo_dev->ring_head != READ_ONCE(fifo_dev->ring_tail)) ?
+			(POLLIN | POLLRDNORM) : 0;
+		spin_unlock_irqrestore(&fifo_dev->ring_lock, flags);
+	}
+	else if (datra_fifo_read_level(fifo_dev) & 0xFFFF)
+		mask = (POLLIN | POLLRDNORM); /* Data available */
 	else {
-		/* Wait for buffer crossing user-defined treshold */
-		datra_fifo_write_enable_interrupt(fifo_dev, fifo_dev->poll_treshold);
+		/* Set IRQ to occur on user-defined treshold (default=1) */
+		datra_fifo_read_enable_interrupt(fifo_dev, datra_fifo_poll_threshold(fifo_dev));
 		mask = 0;
 	}
 
@@ -1393,985 +2280,3279 @@ static unsigned int datra_fifo_write_poll(struct file *filp, poll_table *wait)
 	return mask;
 }
 
-static const struct file_operations datra_fifo_write_fops =
+static int datra_fifo_rw_get_route_id(struct datra_fifo_dev *fifo_dev)
 {
-	.write = datra_fifo_write_write,
-	.poll = datra_fifo_write_poll,
-	.llseek = no_llseek,
-	.unlocked_ioctl = datra_fifo_rw_ioctl,
-	.open = datra_fifo_write_open,
-	.release = datra_fifo_write_release,
-};
-
+	return datra_get_config_index(fifo_dev->config_parent) |
+		(fifo_dev->index << 8);
+}
 
-/* Interrupt service routine for CPU fifo node, version 2 */
-static irqreturn_t datra_fifo_isr(struct datra_dev *dev, struct datra_config_dev *cfg_dev)
+static int datra_fifo_rw_add_route(struct datra_fifo_dev *fifo_dev, int source, int dest)
 {
-	struct datra_fifo_control_dev *fifo_ctl_dev = cfg_dev->private_data;
-	u32 status_reg = datra_reg_read_quick(
-		cfg_dev->control_base, DATRA_REG_FIFO_IRQ_STATUS);
-	u16 read_status_reg;
-	u16 write_status_reg;
-	u8 index;
+	struct datra_route_item_t route;
+	route.srcFifo = (source >> 8) & 0xFF;
+	route.srcNode = source & 0xFF;
+	route.dstFifo = (dest >> 8) & 0xFF;
+	route.dstNode = dest & 0xFF;
+	datra_ctl_route_add(fifo_dev->config_parent->parent, route);
+	return 0;
+}
 
-	/* Allow IRQ sharing */
-	if (!status_reg)
-		return IRQ_NONE;
+static long datra_fifo_read_timing(struct datra_fifo_dev *fifo_dev,
+	struct file *filp, unsigned int cmd, void __user *arg)
+{
+	struct datra_fifo_read_timing timing;
 
-	/* Acknowledge interrupt to hardware */
-	iowrite32_quick(status_reg,
-			cfg_dev->control_base + (DATRA_REG_FIFO_IRQ_CLR>>2));
-	pr_debug("%s(status=0x%x)\n", __func__, status_reg);
-	/* Trigger the associated wait queues, "read" queues first. These
-	 * are in the upper 16 bits of the interrupt status word */
-	read_status_reg = status_reg >> 16;
-	for (index = 0; (read_status_reg != 0) && (index < fifo_ctl_dev->number_of_fifo_read_devices); ++index)
-	{
-		if (read_status_reg & 1)
-			wake_up_interruptible(&fifo_ctl_dev->fifo_devices[fifo_ctl_dev->number_of_fifo_write_devices + index].fifo_wait_queue);
-		read_status_reg >>= 1;
+	if (filp->f_mode & FMODE_WRITE)
+		return -ENOTTY;
+	if (_IOC_SIZE(cmd) != sizeof(timing))
+		return -EINVAL;
+	if (_IOC_DIR(cmd) & _IOC_WRITE) {
+		if (copy_from_user(&timing, arg, sizeof(timing)))
+			return -EFAULT;
+		fifo_dev->read_min_words = timing.min_words;
+		fifo_dev->read_timeout_us = timing.timeout_us;
 	}
-	write_status_reg = status_reg & 0xFFFF;
-	for (index = 0; (write_status_reg != 0) && (index < fifo_ctl_dev->number_of_fifo_write_devices); ++index)
-	{
-		if (write_status_reg & 1)
-			wake_up_interruptible(&fifo_ctl_dev->fifo_devices[index].fifo_wait_queue);
-		write_status_reg >>= 1;
+	if (_IOC_DIR(cmd) & _IOC_READ) {
+		timing.min_words = fifo_dev->read_min_words;
+		timing.timeout_us = fifo_dev->read_timeout_us;
+		if (copy_to_user(arg, &timing, sizeof(timing)))
+			return -EFAULT;
 	}
-	return IRQ_HANDLED;
+	return 0;
 }
 
-
-static unsigned int datra_dma_get_index(const struct datra_dma_dev *dma_dev)
+/* Physical address of a location in the device's register space */
+static phys_addr_t datra_phys_addr(struct datra_dev *dev, const u32 __iomem *addr)
 {
-	return datra_get_config_index(dma_dev->config_parent);
+	unsigned long offset = (const char __iomem *)addr - (const char __iomem *)dev->base;
+
+	if (dev->mem)
+		return dev->mem->start + offset;
+	return virt_to_phys(dev->base) + offset;
 }
 
-static void datra_dma_to_logic_irq_enable(u32 __iomem *control_base)
+/* Where things are in the pages that datra_fifo_mmap maps */
+static long datra_fifo_mmap_layout(struct datra_fifo_dev *fifo_dev,
+	struct file *filp, struct datra_fifo_mmap_layout __user *arg)
 {
-	pr_debug("%s\n", __func__);
-	iowrite32_quick(BIT(0), control_base + (DATRA_REG_FIFO_IRQ_SET>>2));
+	struct datra_dev *dev = fifo_dev->config_parent->parent;
+	struct datra_fifo_mmap_layout layout;
+	const u32 __iomem *level;
+
+	if (filp->f_mode & FMODE_WRITE)
+		level = fifo_dev->config_parent->control_base +
+			(DATRA_REG_FIFO_WRITE_LEVEL_BASE>>2) + fifo_dev->index;
+	else
+		level = fifo_dev->config_parent->control_base +
+			(DATRA_REG_FIFO_READ_LEVEL_BASE>>2) + fifo_dev->index;
+	memset(&layout, 0, sizeof(layout));
+	layout.page_size = PAGE_SIZE;
+	layout.data_offset = offset_in_page(datra_phys_addr(dev,
+		datra_fifo_memory_location(fifo_dev)));
+	layout.data_size = DATRA_FIFO_MEMORY_SIZE;
+	layout.level_offset = PAGE_SIZE + offset_in_page(datra_phys_addr(dev, level));
+	if (copy_to_user(arg, &layout, sizeof(layout)))
+		return -EFAULT;
+	return 0;
 }
 
-static void datra_dma_from_logic_irq_enable(u32 __iomem *control_base)
+/* The page of a fifo's data window, read and write fifo of the same
+ * index share the window */
+static unsigned long datra_fifo_page(struct datra_fifo_dev *fifo_dev)
 {
-	pr_debug("%s\n", __func__);
-	iowrite32_quick(BIT(16), control_base + (DATRA_REG_FIFO_IRQ_SET>>2));
+	return datra_phys_addr(fifo_dev->config_parent->parent,
+		datra_fifo_memory_location(fifo_dev)) >> PAGE_SHIFT;
 }
 
-/* Kills ongoing DMA transactions and resets everything. */
-static int datra_dma_to_logic_reset(struct datra_dma_dev *dma_dev)
+/* A page holds several fifo windows, and loading from a window pops its
+ * read fifo. Mapping the data page thus requires all other fifos in
+ * that page to be closed, and keeps them busy until released. Called
+ * with fop_sem held. */
+static int datra_fifo_page_reserve(struct datra_fifo_dev *fifo_dev)
 {
-	u32 __iomem *control_base = dma_dev->config_parent->control_base;
-	u32 reg;
-	int result;
-	DEFINE_WAIT(wait);
+	struct datra_fifo_control_dev *fifo_ctl_dev =
+		fifo_dev->config_parent->private_data;
+	int count = fifo_ctl_dev->number_of_fifo_write_devices +
+		fifo_ctl_dev->number_of_fifo_read_devices;
+	unsigned long page = datra_fifo_page(fifo_dev);
+	int i;
 
-	reg = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_CONTROL);
-	pr_debug("%s ctl=%#x\n", __func__, reg);
-	if (reg & BIT(1)) {
-		pr_err("%s: Reset already in progress\n", __func__);
-		return -EBUSY;
-	}
-	if (!(reg & BIT(0))) {
-		pr_debug("%s: DMA hardware not running\n", __func__);
-		return -EINVAL;
-	}
-	reg |= BIT(1);
-	prepare_to_wait(&dma_dev->wait_queue_to_logic, &wait, TASK_INTERRUPTIBLE);
-	/* Enable reset-ready-interrupt */
-	iowrite32(BIT(15), control_base + (DATRA_REG_FIFO_IRQ_SET>>2));
-	/* Send reset command */
-	iowrite32_quick(reg, control_base + (DATRA_DMA_TOLOGIC_CONTROL>>2));
-	for(;;) {
-		if ((datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_CONTROL) & BIT(1)) == 0) {
-			result = 0;
-			break;
-		}
-		if (signal_pending(current)) {
-			result = -ERESTARTSYS;
-			break;
-		}
-		if (schedule_timeout(HZ/4) == 0) {
-			pr_err("%s: TIMEOUT waiting for reset complete IRQ.\n", __func__);
-			result = -ETIMEDOUT;
-			break;
-		}
-		prepare_to_wait(&dma_dev->wait_queue_to_logic, &wait, TASK_INTERRUPTIBLE);
+	for (i = 0; i < count; ++i) {
+		struct datra_fifo_dev *other = &fifo_ctl_dev->fifo_devices[i];
+
+		if (other == fifo_dev || datra_fifo_page(other) != page)
+			continue;
+		if (other->is_open ||
+		    (other->mapped_by && other->mapped_by != fifo_dev))
+			return -EBUSY;
 	}
-	finish_wait(&dma_dev->wait_queue_from_logic, &wait);
+	for (i = 0; i < count; ++i) {
+		struct datra_fifo_dev *other = &fifo_ctl_dev->fifo_devices[i];
 
-	/* Re-enable the node */
-	iowrite32_quick(BIT(0), control_base + (DATRA_DMA_TOLOGIC_CONTROL>>2));
-	dma_dev->dma_to_logic_head = 0;
-	dma_dev->dma_to_logic_tail = 0;
-	kfifo_reset(&dma_dev->dma_to_logic_wip);
+		if (other != fifo_dev && datra_fifo_page(other) == page)
+			other->mapped_by = fifo_dev;
+	}
 	return 0;
 }
 
-static int datra_dma_from_logic_reset(struct datra_dma_dev *dma_dev)
+/* Called with fop_sem held */
+static void datra_fifo_page_release(struct datra_fifo_dev *fifo_dev)
 {
-	u32 __iomem *control_base = dma_dev->config_parent->control_base;
-	u32 reg;
-	int result;
-	DEFINE_WAIT(wait);
+	struct datra_fifo_control_dev *fifo_ctl_dev =
+		fifo_dev->config_parent->private_data;
+	int count = fifo_ctl_dev->number_of_fifo_write_devices +
+		fifo_ctl_dev->number_of_fifo_read_devices;
+	int i;
 
+	for (i = 0; i < count; ++i)
+		if (fifo_ctl_dev->fifo_devices[i].mapped_by == fifo_dev)
+			fifo_ctl_dev->fifo_devices[i].mapped_by = NULL;
+}
 
-	reg = datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_CONTROL);
-	pr_debug("%s ctl=%#x\n", __func__, reg);
-	if (reg & BIT(1)) {
-		pr_err("%s: Reset already in progress\n", __func__);
-		return -EBUSY;
-	}
-	if (!(reg & BIT(0))) {
-		pr_debug("%s: DMA hardware not running\n", __func__);
+/* Page 0 holds the data window of the fifo, page 1 its level register,
+ * read-only. The data page also covers neighbouring fifos, which must
+ * not be in use. The level page only allows reading registers. The
+ * driver keeps handling the fifo, so the kernel read ring cannot be used
+ * at the same time. */
+static int datra_fifo_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct datra_fifo_dev *fifo_dev = filp->private_data;
+	struct datra_dev *dev = fifo_dev->config_parent->parent;
+	const u32 __iomem *addr;
+	bool is_data = false;
+	int result;
+
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	switch (vma->vm_pgoff) {
+	case 0:
+		/* Reading the window pops data, only allow that on datrar */
+		if (!(filp->f_mode & FMODE_WRITE) && (vma->vm_flags & VM_WRITE))
+			return -EPERM;
+		if (fifo_dev->ring_size)
+			return -EBUSY;
+		addr = datra_fifo_memory_location(fifo_dev);
+		is_data = true;
+		if (down_interruptible(&dev->fop_sem))
+			return -ERESTARTSYS;
+		result = datra_fifo_page_reserve(fifo_dev);
+		up(&dev->fop_sem);
+		if (result)
+			return result;
+		break;
+	case 1:
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		addr = fifo_dev->config_parent->control_base +
+			((filp->f_mode & FMODE_WRITE) ?
+				DATRA_REG_FIFO_WRITE_LEVEL_BASE>>2 :
+				DATRA_REG_FIFO_READ_LEVEL_BASE>>2) +
+			fifo_dev->index;
+		break;
+	default:
 		return -EINVAL;
 	}
-	reg |= BIT(1);
-	prepare_to_wait(&dma_dev->wait_queue_from_logic, &wait, TASK_INTERRUPTIBLE);
-	/* Enable reset-ready-interrupt */
-	iowrite32(BIT(31), control_base + (DATRA_REG_FIFO_IRQ_SET>>2));
-	/* Send reset command */
-	iowrite32_quick(BIT(1)|BIT(0), control_base + (DATRA_DMA_FROMLOGIC_CONTROL>>2));
-	for(;;) {
-		if ((datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_CONTROL) & BIT(1)) == 0) {
-			result = 0;
-			break;
-		}
-		if (signal_pending(current)) {
-			result = -ERESTARTSYS;
-			break;
-		}
-		if (schedule_timeout(HZ) == 0) {
-			pr_err("%s: TIMEOUT waiting for reset complete IRQ ctrl=%#x ists=%#x\n",
-				__func__,
-				datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_CONTROL),
-				datra_reg_read_quick(control_base, DATRA_REG_FIFO_IRQ_STATUS));
-			result = -ETIMEDOUT;
-			break;
-		}
-		prepare_to_wait(&dma_dev->wait_queue_from_logic, &wait, TASK_INTERRUPTIBLE);
+	if (!(filp->f_mode & FMODE_WRITE) || vma->vm_pgoff == 1) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+		vm_flags_clear(vma, VM_MAYWRITE);
+#else
+		vma->vm_flags &= ~VM_MAYWRITE;
+#endif
 	}
-	finish_wait(&dma_dev->wait_queue_from_logic, &wait);
-
-	/* Re-enable the node */
-	iowrite32_quick(BIT(0), control_base + (DATRA_DMA_FROMLOGIC_CONTROL>>2));
 
-	dma_dev->dma_from_logic_head = 0;
-	dma_dev->dma_from_logic_tail = 0;
-	dma_dev->dma_from_logic_current_op.size = 0;
-	dma_dev->dma_from_logic_full = false;
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	result = vm_iomap_memory(vma,
+		datra_phys_addr(dev, addr) & PAGE_MASK, PAGE_SIZE);
+	if (is_data) {
+		down(&dev->fop_sem);
+		if (!result)
+			fifo_dev->is_mapped = true;
+		else if (!fifo_dev->is_mapped)
+			datra_fifo_page_release(fifo_dev);
+		up(&dev->fop_sem);
+	}
 	return result;
 }
 
-/* Forward declarations */
-static const struct file_operations datra_dma_to_logic_fops;
-static const struct file_operations datra_dma_from_logic_fops;
-static int datra_dma_to_logic_block_free(struct datra_dma_dev *dma_dev);
-static int datra_dma_from_logic_block_free(struct datra_dma_dev *dma_dev);
-
-static int datra_dma_open(struct inode *inode, struct file *filp)
+static long datra_fifo_rw_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	struct datra_dma_dev *dma_dev = container_of(
-		inode->i_cdev, struct datra_dma_dev, cdev_dma);
-	struct datra_config_dev *cfg_dev = dma_dev->config_parent;
-	struct datra_dev *dev = cfg_dev->parent;
-	int status = 0;
+	struct datra_fifo_dev *fifo_dev = filp->private_data;
+	if (unlikely(fifo_dev == NULL))
+		return -ENODEV;
 
-	pr_debug("%s(mode=%#x flags=%#x)\n", __func__,
-		filp->f_mode, filp->f_flags);
-
-	/* Must specify either read or write mode */
-	if ((filp->f_mode & (FMODE_READ | FMODE_WRITE)) == 0)
-		return -EINVAL;
-
-	if (down_interruptible(&dev->fop_sem))
-		return -ERESTARTSYS;
-	filp->private_data = dma_dev; /* for other methods */
-	nonseekable_open(inode, filp);
+	pr_debug("%s cmd=%#x (%d) arg=%#lx\n", __func__, cmd, _IOC_NR(cmd), arg);
+	if (_IOC_TYPE(cmd) != DATRA_IOC_MAGIC)
+		return -ENOTTY;
 
-	if (filp->f_mode & FMODE_WRITE) {
-		/* For mmap to work, the device must be opened in R+W mode, so
-		 * consider this the same as opening for write-only. */
-		if (dma_dev->open_mode & FMODE_WRITE) {
-			status = -EBUSY;
-			goto exit_open;
-		}
-		dma_dev->open_mode |= FMODE_WRITE; /* Set in-use bits */
-		filp->f_op = &datra_dma_to_logic_fops;
-		/* Reset usersignal */
-		iowrite32_quick(DATRA_USERSIGNAL_ZERO,
-			cfg_dev->control_base + (DATRA_DMA_TOLOGIC_USERBITS>>2));
-		/* Default to generic size */
-		dma_dev->dma_to_logic_block_size = datra_dma_default_block_size;
-	} else {
-		if (dma_dev->open_mode & FMODE_READ) {
-			status = -EBUSY;
-			goto exit_open;
-		}
-		dma_dev->open_mode |= FMODE_READ; /* Set in-use bits */
-		filp->f_op = &datra_dma_from_logic_fops;
+	switch (_IOC_NR(cmd))
+	{
+		case DATRA_IOC_ROUTE_QUERY_ID:
+			return datra_fifo_rw_get_route_id(fifo_dev);
+		case DATRA_IOC_ROUTE_TELL_TO_LOGIC:
+			if ((filp->f_mode & FMODE_WRITE) == 0)
+				return -ENOTTY; /* Cannot route from this node */
+			return datra_fifo_rw_add_route(fifo_dev, datra_fifo_rw_get_route_id(fifo_dev), arg);
+		case DATRA_IOC_ROUTE_TELL_FROM_LOGIC:
+			if ((filp->f_mode & FMODE_READ) == 0)
+				return -ENOTTY; /* Cannot route to this node */
+			return datra_fifo_rw_add_route(fifo_dev, arg, datra_fifo_rw_get_route_id(fifo_dev));
+		case DATRA_IOC_TRESHOLD_QUERY:
+			if (fifo_dev->adapt_latency_us)
+				return fifo_dev->adapt_threshold;
+			return fifo_dev->poll_treshold;
+		case DATRA_IOC_TRESHOLD_TELL:
+			if (arg < 1)
+				arg = 1;
+			else if (arg > 192)
+				arg = 192;
+			fifo_dev->poll_treshold = arg;
+			return 0;
+		case DATRA_IOC_TRESHOLD_ADAPTIVE:
+			if (arg > UINT_MAX)
+				return -EINVAL;
+			spin_lock(&fifo_dev->adapt_lock);
+			fifo_dev->adapt_rate = 0;
+			WRITE_ONCE(fifo_dev->adapt_threshold, fifo_dev->poll_treshold);
+			fifo_dev->adapt_words = fifo_dev->words_transfered;
+			fifo_dev->adapt_time = ktime_get();
+			WRITE_ONCE(fifo_dev->adapt_latency_us, arg);
+			spin_unlock(&fifo_dev->adapt_lock);
+			return 0;
+		/* ioctl value or type does not matter, this always resets the
+		 * associated fifo in the hardware. */
+		case DATRA_IOC_RESET_FIFO_WRITE:
+		case DATRA_IOC_RESET_FIFO_READ:
+			if ((filp->f_mode & FMODE_WRITE) != 0) {
+				datra_fifo_ring_clear(fifo_dev);
+				datra_reg_write_quick(fifo_dev->config_parent->control_base,
+					DATRA_REG_FIFO_RESET_WRITE, 1 << fifo_dev->index);
+			}
+			else {
+				datra_reg_write_quick(fifo_dev->config_parent->control_base,
+					DATRA_REG_FIFO_RESET_READ, 1 << fifo_dev->index);
+				datra_fifo_ring_clear(fifo_dev);
+				fifo_dev->byte_eof = false;
+				fifo_dev->byte_residue_len = 0;
+			}
+			return 0;
+		case DATRA_IOC_USERSIGNAL_QUERY:
+			/* TODO: Return LAST usersignal, not next */
+			return fifo_dev->user_signal;
+		case DATRA_IOC_USERSIGNAL_TELL:
+			if (!(filp->f_mode & FMODE_WRITE))
+				return -EINVAL;
+			if (fifo_dev->byte_mode)
+				return -EBUSY; /* Driver owns the signal */
+			arg &= 0xFFFF; /* Only lower bits */
+			/* Buffered data was written with the old signal */
+			if (wait_event_interruptible(fifo_dev->fifo_wait_queue,
+					fifo_dev->ring_head == READ_ONCE(fifo_dev->ring_tail)))
+				return -ERESTARTSYS;
+			if (!datra_fifo_write_usersignal(fifo_dev, arg)) {
+				printk(KERN_ERR "%s: Failed to set usersignal\n", __func__);
+				return -EIO;
+			}
+			fifo_dev->user_signal = arg;
+			return 0;
+		case DATRA_IOC_READ_FORMAT_QUERY:
+			return fifo_dev->read_format;
+		case DATRA_IOC_READ_FORMAT_TELL:
+			if (filp->f_mode & FMODE_WRITE)
+				return -EINVAL;
+			if (arg > DATRA_FIFO_READ_FORMAT_RECORDS)
+				return -EINVAL;
+			if (fifo_dev->byte_mode && arg != DATRA_FIFO_READ_FORMAT_STREAM)
+				return -EBUSY;
+			fifo_dev->read_format = arg;
+			return 0;
+		case DATRA_IOC_BYTE_MODE_QUERY:
+			return fifo_dev->byte_mode;
+		case DATRA_IOC_BYTE_MODE_TELL:
+			return datra_fifo_set_byte_mode(fifo_dev, filp, arg);
+		case DATRA_IOC_READ_TIMING:
+			return datra_fifo_read_timing(fifo_dev, filp, cmd, (void __user *)arg);
+		case DATRA_IOC_RINGSIZE_QUERY:
+			return fifo_dev->ring_size << 2;
+		case DATRA_IOC_RINGSIZE_TELL:
+			if (fifo_dev->is_mapped)
+				return -EBUSY;
+			return datra_fifo_ring_set_size(fifo_dev, arg,
+				(filp->f_mode & FMODE_WRITE) != 0);
+		case DATRA_IOC_FIFO_MMAP_LAYOUT:
+			return datra_fifo_mmap_layout(fifo_dev, filp,
+				(struct datra_fifo_mmap_layout __user *)arg);
+		default:
+			return -ENOTTY;
 	}
-exit_open:
-	up(&dev->fop_sem);
-	pr_debug("%s(mode=%#x flags=%#x) -> %d\n", __func__,
-		filp->f_mode, filp->f_flags, status);
-	return status;
 }
 
-static int datra_dma_common_release(struct datra_dma_dev *dma_dev, mode_t flag_to_clear)
-{
-	struct datra_dev *dev = dma_dev->config_parent->parent;
 
-	if (down_interruptible(&dev->fop_sem))
-		return -ERESTARTSYS;
-	dma_dev->open_mode &= ~flag_to_clear; /* Clear in use bit */
-	up(&dev->fop_sem);
+static const struct file_operations datra_fifo_read_fops =
+{
+	.owner = THIS_MODULE,
+	.read = datra_fifo_read_read,
+	.llseek = no_llseek,
+	.poll = datra_fifo_read_poll,
+	.unlocked_ioctl = datra_fifo_rw_ioctl,
+	.mmap = datra_fifo_mmap,
+	.open = datra_fifo_read_open,
+	.release = datra_fifo_read_release,
+};
 
-	return 0;
+static int datra_fifo_write_level(struct datra_fifo_dev *fifo_dev)
+{
+	return datra_reg_read_quick_index(
+		fifo_dev->config_parent->control_base,
+		DATRA_REG_FIFO_WRITE_LEVEL_BASE,
+		fifo_dev->index);
 }
 
-static int datra_dma_to_logic_release(struct inode *inode, struct file *filp)
+static void datra_fifo_write_enable_interrupt(struct datra_fifo_dev *fifo_dev, int thd)
 {
-	struct datra_dma_dev *dma_dev = filp->private_data;
-
-	/* If we were in "block" mode, release those resources now. */
-	if (dma_dev->dma_to_logic_blocks.blocks)
-		datra_dma_to_logic_block_free(dma_dev);
-
-	return datra_dma_common_release(dma_dev, FMODE_WRITE);
+	int index = fifo_dev->index;
+	__iomem int *control_base =
+		fifo_dev->config_parent->control_base;
+	if (thd > (DATRA_FIFO_WRITE_SIZE*2)/3)
+		thd = (DATRA_FIFO_WRITE_SIZE*2)/3;
+	else if (thd)
+		--thd; /* IRQ will trigger when level is above thd */
+	pr_debug("%s index=%d thd=%d\n", __func__, index, thd);
+	iowrite32(thd, control_base + (DATRA_REG_FIFO_WRITE_THD_BASE>>2) + index);
+	iowrite32(BIT(index), control_base + (DATRA_REG_FIFO_IRQ_SET>>2));
 }
 
-static int datra_dma_from_logic_release(struct inode *inode, struct file *filp)
+/* Write words from kernel memory into a fifo window */
+static void datra_fifo_burst_write(u32 __iomem *dst, const u32 *src,
+	unsigned int words)
 {
-	struct datra_dma_dev *dma_dev = filp->private_data;
-
-	/* If we were in "block" mode, release those resources now. */
-	if (dma_dev->dma_from_logic_blocks.blocks)
-		datra_dma_from_logic_block_free(dma_dev);
-
-	return datra_dma_common_release(dma_dev, FMODE_READ);
+#ifdef DATRA_HAVE_IO64
+	for (; words >= 2; words -= 2) {
+		iowrite64_quick(get_unaligned((const u64 *)src), dst);
+		src += 2;
+		dst += 2;
+	}
+#endif
+	for (; words; --words)
+		iowrite32_quick(*src++, dst++);
 }
 
-/* CPU and DMA shouldn't be accessing the same cache line simultaneously.
- * Since PAGE_SIZE is guaranteed to be larger, use that to align the head
- * pointer for DMA transfers. */
-static unsigned int round_up_to_cacheline(unsigned int value)
+/* Move data from the ring into the hardware fifo. Called with ring_lock
+ * held, from the ISR or after the writer added data. When the hardware
+ * fifo fills up, or after DATRA_FIFO_RING_BURSTS bursts, arms the
+ * interrupt to continue once half of it is free again. */
+static void datra_fifo_write_ring_drain(struct datra_fifo_dev *fifo_dev)
 {
-	return (value + (PAGE_SIZE-1)) & (~(PAGE_SIZE-1));
+	u32 __iomem *mapped_memory = datra_fifo_write_location(fifo_dev);
+	const bool write_combined = mapped_memory != datra_fifo_memory_location(fifo_dev);
+	unsigned int tail = fifo_dev->ring_tail;
+	unsigned int mask = fifo_dev->ring_size - 1;
+	unsigned int bursts = DATRA_FIFO_RING_BURSTS;
+
+	for (;;) {
+		unsigned int words = smp_load_acquire(&fifo_dev->ring_head) - tail;
+		unsigned int room;
+		unsigned int offset;
+		unsigned int chunk;
+
+		if (!words)
+			break;
+		room = datra_fifo_write_level(fifo_dev);
+		if (!room || !bursts--) {
+			datra_fifo_write_enable_interrupt(fifo_dev,
+				datra_fifo_wait_threshold(fifo_dev, DATRA_FIFO_WRITE_SIZE / 2));
+			break;
+		}
+		if (words > room)
+			words = room;
+		offset = tail & mask;
+		chunk = min(words, fifo_dev->ring_size - offset);
+		datra_fifo_burst_write(mapped_memory, fifo_dev->ring + offset, chunk);
+		if (chunk < words)
+			datra_fifo_burst_write(mapped_memory, fifo_dev->ring, words - chunk);
+		if (write_combined)
+			wmb();
+		tail += words;
+		smp_store_release(&fifo_dev->ring_tail, tail);
+	}
 }
 
-static unsigned int datra_dma_to_logic_avail(struct datra_dma_dev *dma_dev)
+/* write() on a fifo with a ring. Returns as soon as the data is in the
+ * ring, the ISR feeds it to the hardware. */
+static ssize_t datra_fifo_write_ring_write(struct datra_fifo_dev *fifo_dev,
+	const char __user *buf, size_t count, bool is_blocking)
 {
-	u32 __iomem *control_base = dma_dev->config_parent->control_base;
-	u32 status = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_STATUS);
-	/* Status: bits 24..31: #results; 16..23: available to execute */
-	u8 num_results;
+	unsigned int mask = fifo_dev->ring_size - 1;
+	unsigned long flags;
+	size_t len = 0;
+	int status = 0;
 
-	pr_debug("%s status=%#x\n", __func__, status);
-	for (num_results = (status >> 24); num_results != 0; --num_results) {
-		/* Fetch result from queue */
-		struct datra_dma_to_logic_operation op;
-		dma_addr_t addr = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_RESULT_ADDR_LOW);
-		if (dma_dev->dma_64bit)
-			addr |= ((dma_addr_t)datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_RESULT_ADDR_HIGH) << 32);
-		if (unlikely(!kfifo_get(&dma_dev->dma_to_logic_wip, &op))) {
-			pr_err("Nothing in fifo of DMA node %u but still %u results\n",
-				datra_dma_get_index(dma_dev), num_results);
-			BUG();
-		}
-		pr_debug("%s addr=0x%llx wip=0x%llx,%u\n", __func__, (u64)addr, (u64)op.addr, op.size);
-		if (unlikely(op.addr != addr)) {
-			pr_err("Mismatch in result of DMA node %u: phys=%pa expected 0x%llx (size %d) actual 0x%llx\n",
-				datra_dma_get_index(dma_dev),
-				&dma_dev->dma_to_logic_handle,
-				(u64)op.addr, op.size, (u64)addr);
-			pr_err("head=%#x (%d) tail=%#x (%d)\n",
-				dma_dev->dma_to_logic_head,
-				dma_dev->dma_to_logic_head,
-				dma_dev->dma_to_logic_tail,
-				dma_dev->dma_to_logic_tail);
+	while (count) {
+		unsigned int head = fifo_dev->ring_head;
+		unsigned int used = head - smp_load_acquire(&fifo_dev->ring_tail);
+		unsigned int words = fifo_dev->ring_size - used;
+		unsigned int offset;
+		unsigned int chunk;
+
+		if (!words) {
+			DEFINE_WAIT(wait);
+			++fifo_dev->ring_stalls;
+			atomic64_inc(&fifo_dev->stats.stalls);
 			for (;;) {
-				if (!kfifo_get(&dma_dev->dma_to_logic_wip, &op))
+				if (is_blocking)
+					prepare_to_wait(&fifo_dev->fifo_wait_queue, &wait, TASK_INTERRUPTIBLE);
+				used = head - smp_load_acquire(&fifo_dev->ring_tail);
+				words = fifo_dev->ring_size - used;
+				if (words || !is_blocking)
 					break;
-				pr_err("Internal entry: 0x%llx (size %d)\n", (u64)op.addr, op.size);
+				if (signal_pending(current)) {
+					status = -ERESTARTSYS;
+					break;
+				}
+				atomic64_inc(&fifo_dev->stats.blocked);
+				schedule();
 			}
-			while (num_results) {
-				dma_addr_t addr = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_RESULT_ADDR_LOW);
-				if (dma_dev->dma_64bit)
-					addr |= ((dma_addr_t)datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_RESULT_ADDR_HIGH) << 32);
-				pr_err("Logic result: 0x%llx\n", (u64)addr);
-				--num_results;
+			if (is_blocking)
+				finish_wait(&fifo_dev->fifo_wait_queue, &wait);
+			if (status)
+				return len ? len : status;
+			if (!words) {
+				/* Non-blocking IO, return what we have */
+				if (len)
+					break;
+				atomic64_inc(&fifo_dev->stats.eagain);
+				return -EAGAIN;
 			}
-			BUG();
-		}
-		dma_dev->dma_to_logic_tail += round_up_to_cacheline(op.size);
-		if (dma_dev->dma_to_logic_tail == dma_dev->dma_to_logic_memory_size)
-			dma_dev->dma_to_logic_tail = 0;
-		pr_debug("%s tail=%u\n", __func__, dma_dev->dma_to_logic_tail);
-		if (unlikely(dma_dev->dma_to_logic_tail > dma_dev->dma_to_logic_memory_size)) {
-			pr_err("Overflow in DMA node %u: tail %u size %u\n",
-				datra_dma_get_index(dma_dev),
-				dma_dev->dma_to_logic_tail, dma_dev->dma_to_logic_memory_size);
-			BUG();
 		}
+
+		if (words > (count >> 2))
+			words = count >> 2;
+		offset = head & mask;
+		chunk = min(words, fifo_dev->ring_size - offset);
+		if (unlikely(__copy_from_user(fifo_dev->ring + offset, buf, chunk << 2)))
+			return -EFAULT;
+		if (chunk < words &&
+		    unlikely(__copy_from_user(fifo_dev->ring, buf + (chunk << 2), (words - chunk) << 2)))
+			return -EFAULT;
+		smp_store_release(&fifo_dev->ring_head, head + words);
+		if (used + words > fifo_dev->ring_max_level)
+			fifo_dev->ring_max_level = used + words;
+		datra_fifo_count(fifo_dev, words);
+		len += words << 2;
+		buf += words << 2;
+		count -= words << 2;
+
+		spin_lock_irqsave(&fifo_dev->ring_lock, flags);
+		datra_fifo_write_ring_drain(fifo_dev);
+		spin_unlock_irqrestore(&fifo_dev->ring_lock, flags);
 	}
-	/* Calculate available space */
-	if (dma_dev->dma_to_logic_tail > dma_dev->dma_to_logic_head)
-		return dma_dev->dma_to_logic_tail - dma_dev->dma_to_logic_head;
-	else if (dma_dev->dma_to_logic_tail == dma_dev->dma_to_logic_head) {
-		/* Can mean "full" or "empty" */
-		if (!kfifo_is_empty(&dma_dev->dma_to_logic_wip))
-			return 0; /* head==tail and there is work in progress */
-	}
-	/* Return available bytes until end of buffer */
-	return dma_dev->dma_to_logic_memory_size - dma_dev->dma_to_logic_head;
+	return len;
 }
 
-
-/* Two things may block: There's no room in the ring, or there's no room
- * in the command buffer. */
-static ssize_t datra_dma_write(struct file *filp, const char __user *buf,
-	size_t count, loff_t *f_pos)
+static int datra_fifo_write_open(struct inode *inode, struct file *filp)
 {
-	int status = 0;
-	struct datra_dma_dev *dma_dev = filp->private_data;
-	u32 __iomem *control_base = dma_dev->config_parent->control_base;
-	unsigned int bytes_to_copy;
-	unsigned int bytes_copied = 0;
-	unsigned int bytes_avail;
-	struct datra_dma_to_logic_operation dma_op;
-	DEFINE_WAIT(wait);
-	const bool is_blocking = (filp->f_flags & O_NONBLOCK) == 0;
+	int result = 0;
+	struct datra_fifo_control_dev *fifo_ctl_dev =
+		container_of(inode->i_cdev, struct datra_fifo_control_dev, cdev_fifo_write);
+	int index = inode->i_rdev - fifo_ctl_dev->devt_first_fifo_device;
+	struct datra_fifo_dev *fifo_dev = &fifo_ctl_dev->fifo_devices[index];
+	struct datra_dev* dev = fifo_ctl_dev->config_parent->parent;
 
-	pr_debug("%s(%u)\n", __func__, (unsigned int)count);
+	pr_debug("%s index=%d mode=%#x flags=%#x i-devt=%u d=%u f=%u\n", __func__,
+		index, filp->f_mode, filp->f_flags,
+		inode->i_rdev, inode->i_cdev->dev, fifo_ctl_dev->devt_first_fifo_device);
 
-	if (count < 4) /* Do not allow read or write below word size */
+	/* Write-only device. Allow O_RDWR, which mmap requires, and treat
+	 * it as O_WRONLY like the DMA nodes do. */
+	if (!(filp->f_mode & FMODE_WRITE))
 		return -EINVAL;
-	count &= ~0x03;
 
-	if (dma_dev->dma_to_logic_blocks.blocks)
-		return -EBUSY;
+	if (down_interruptible(&dev->fop_sem))
+		return -ERESTARTSYS;
+	if (datra_fifo_is_busy(fifo_dev)) {
+		result = -EBUSY;
+		goto error;
+	}
+	fifo_dev->poll_treshold = DATRA_FIFO_WRITE_SIZE / 2;
+	fifo_dev->adapt_latency_us = 0;
+	fifo_dev->byte_mode = false;
+	filp->private_data = fifo_dev;
+	fifo_dev->user_signal = DATRA_USERSIGNAL_ZERO;
+	/* Set user signal register */
+	if (!datra_fifo_write_usersignal(fifo_dev, DATRA_USERSIGNAL_ZERO)) {
+		printk(KERN_ERR "%s: Failed to reset usersignals on w%d\n",
+			__func__, index);
+		result = -EIO;
+		goto error;
+	}
+	if (datra_fifo_write_ring_size) {
+		result = datra_fifo_ring_set_size(fifo_dev, datra_fifo_write_ring_size, true);
+		if (result)
+			goto error;
+	}
+	fifo_dev->is_open = true;
+	nonseekable_open(inode, filp);
+error:
+	up(&dev->fop_sem);
+	return result;
+}
 
-	while (count) {
-		bytes_to_copy = min((unsigned int)count, dma_dev->dma_to_logic_block_size);
-		for(;;) {
-			if (is_blocking)
-				prepare_to_wait(&dma_dev->wait_queue_to_logic, &wait, TASK_INTERRUPTIBLE);
-			bytes_avail = datra_dma_to_logic_avail(dma_dev);
-			pr_debug("%s bytes_avail=%u head=%u tail=%u\n", __func__,
-				bytes_avail, dma_dev->dma_to_logic_head, dma_dev->dma_to_logic_tail);
-			if (bytes_avail != 0)
-				break;
-			if (signal_pending(current))
-				goto error_interrupted;
-			/* Enable interrupt */
-			datra_dma_to_logic_irq_enable(control_base);
-			if (is_blocking)
-				schedule();
-			else {
-				if (bytes_copied)
-					goto exit_ok; /* Some data transferred */
-				else {
-					/* No data available, tell user */
-					status = -EAGAIN;
-					goto error_exit;
+static int datra_fifo_write_release(struct inode *inode, struct file *filp)
+{
+	struct datra_fifo_dev *fifo_dev = filp->private_data;
+	struct datra_dev* dev = fifo_dev->config_parent->parent;
+	int status = 0;
+
+	pr_debug("%s index=%d\n", __func__, fifo_dev->index);
+	/* Let the ISR write out what is still in the ring, unless the
+	 * caller is interrupted, in which case the rest is discarded. */
+	if (fifo_dev->ring_size)
+		wait_event_interruptible(fifo_dev->fifo_wait_queue,
+			fifo_dev->ring_head == READ_ONCE(fifo_dev->ring_tail));
+	if (down_interruptible(&dev->fop_sem))
+		return -ERESTARTSYS;
+	datra_fifo_ring_free(fifo_dev);
+	fifo_dev->is_open = false;
+	if (fifo_dev->is_mapped)
+		datra_fifo_page_release(fifo_dev);
+	fifo_dev->is_mapped = false;
+	up(&dev->fop_sem);
+	return status;
+}
+
+static ssize_t datra_fifo_write_words(struct file *filp, const char __user *buf, size_t count,
+	loff_t *f_pos)
+{
+	int status = 0;
+	struct datra_fifo_dev *fifo_dev = filp->private_data;
+	u32 __iomem *mapped_memory = datra_fifo_write_location(fifo_dev);
+	const bool write_combined = mapped_memory != datra_fifo_memory_location(fifo_dev);
+	size_t len = 0;
+
+	pr_debug("%s(%u)\n", __func__, (unsigned int)count);
+
+	if (count < 4) /* Do not allow read or write below word size */
+		return -EINVAL;
+
+	count &= ~0x03; /* Align to words */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	if (!access_ok(buf, count))
+#else
+	if (!access_ok(VERIFY_READ, buf, count))
+#endif
+		return -EFAULT;
+
+	if (fifo_dev->ring_size) {
+		status = datra_fifo_write_ring_write(fifo_dev, buf, count,
+			!(filp->f_flags & O_NONBLOCK));
+		if (status > 0)
+			*f_pos += status;
+		return status;
+	}
+
+	while (count)
+	{
+		int words_available;
+		size_t bytes;
+		if (filp->f_flags & O_NONBLOCK) {
+			words_available = datra_fifo_write_level(fifo_dev);
+			if (!words_available) {
+				/* Non-blocking IO, return what we have */
+				if (len)
+					break;
+				/* nothing copied yet, notify caller */
+				atomic64_inc(&fifo_dev->stats.eagain);
+				status = -EAGAIN;
+				goto error;
+			}
+		}
+		else {
+			DEFINE_WAIT(wait);
+			for (;;) {
+				prepare_to_wait(&fifo_dev->fifo_wait_queue, &wait, TASK_INTERRUPTIBLE);
+				words_available = datra_fifo_write_level(fifo_dev);
+				if (words_available)
+					break; /* Done waiting */
+				if (!signal_pending(current)) {
+					datra_fifo_write_enable_interrupt(fifo_dev,
+						datra_fifo_wait_threshold(fifo_dev, count >> 2));
+					atomic64_inc(&fifo_dev->stats.blocked);
+					schedule();
+					continue;
 				}
+				status = -ERESTARTSYS;
+				break;
 			}
+			finish_wait(&fifo_dev->fifo_wait_queue, &wait);
+			if (status)
+				goto error;
 		}
-		if (is_blocking)
-			finish_wait(&dma_dev->wait_queue_to_logic, &wait);
-		if (bytes_avail < bytes_to_copy)
-			bytes_to_copy = bytes_avail;
+		do {
+			unsigned int words;
+			bytes = words_available << 2;
+			if (bytes > DATRA_FIFO_WRITE_MAX_BURST_SIZE)
+				bytes = DATRA_FIFO_WRITE_MAX_BURST_SIZE;
+			if (count < bytes)
+				bytes = count;
+			words = bytes >> 2;
+			pr_debug("%s copy_from_user %p (%u)\n", __func__, mapped_memory, (unsigned int)bytes);
+			status = datra_fifo_burst_from_user(mapped_memory, buf, words);
+			/* Push out the write-combining buffer before the level is
+			 * read again */
+			if (write_combined)
+				wmb();
+			if (unlikely(status)) {
+				status = -EFAULT;
+				goto error;
+			}
+			datra_fifo_count(fifo_dev, words);
+			len += bytes;
+			buf += bytes;
+			count -= bytes;
+			if (!count)
+				break;
+			words_available -= words;
+		}
+		while (words_available);
+	}
 
-		/* Copy data into DMA buffer */
-		if (unlikely(copy_from_user(
-				(char __iomem *)dma_dev->dma_to_logic_memory + dma_dev->dma_to_logic_head,
-				buf, bytes_to_copy))) {
+	status = len;
+	*f_pos += len;
+error:
+	pr_debug("%s -> %d pos=%u\n", __func__, status, (unsigned int)*f_pos);
+	return status;
+}
+
+/* Push a single word with a special user signal, used in byte mode for
+ * trailing bytes and the end-of-stream marker. */
+static int datra_fifo_write_signalled(struct datra_fifo_dev *fifo_dev,
+	u32 word, u16 user_signal, bool is_blocking)
+{
+	int status = 0;
+
+	/* Buffered data must go out with the normal signal first */
+	if (fifo_dev->ring_size) {
+		if (!is_blocking) {
+			if (fifo_dev->ring_head != READ_ONCE(fifo_dev->ring_tail)) {
+				atomic64_inc(&fifo_dev->stats.eagain);
+				return -EAGAIN;
+			}
+		} else if (wait_event_interruptible(fifo_dev->fifo_wait_queue,
+				fifo_dev->ring_head == READ_ONCE(fifo_dev->ring_tail)))
+			return -ERESTARTSYS;
+	}
+	if (!datra_fifo_write_level(fifo_dev)) {
+		DEFINE_WAIT(wait);
+
+		if (!is_blocking) {
+			atomic64_inc(&fifo_dev->stats.eagain);
+			return -EAGAIN;
+		}
+		for (;;) {
+			prepare_to_wait(&fifo_dev->fifo_wait_queue, &wait, TASK_INTERRUPTIBLE);
+			if (datra_fifo_write_level(fifo_dev))
+				break;
+			if (signal_pending(current)) {
+				status = -ERESTARTSYS;
+				break;
+			}
+			datra_fifo_write_enable_interrupt(fifo_dev, 1);
+			atomic64_inc(&fifo_dev->stats.blocked);
+			schedule();
+		}
+		finish_wait(&fifo_dev->fifo_wait_queue, &wait);
+		if (status)
+			return status;
+	}
+	/* Use the uncached window, so the word cannot pass the signal */
+	if (!datra_fifo_write_usersignal(fifo_dev, user_signal))
+		return -EIO;
+	iowrite32(word, datra_fifo_memory_location(fifo_dev));
+	datra_fifo_write_usersignal(fifo_dev, fifo_dev->user_signal);
+	datra_fifo_count(fifo_dev, 1);
+	return 0;
+}
+
+static ssize_t datra_fifo_write_user(struct file *filp, const char __user *buf, size_t count,
+	loff_t *f_pos)
+{
+	struct datra_fifo_dev *fifo_dev = filp->private_data;
+	const bool is_blocking = !(filp->f_flags & O_NONBLOCK);
+	size_t trailing = count & 0x03;
+	ssize_t len = 0;
+	u32 word = 0;
+	int status;
+
+	if (!fifo_dev->byte_mode)
+		return datra_fifo_write_words(filp, buf, count, f_pos);
+
+	/* In byte mode, a zero-length write ends the stream */
+	if (!count)
+		return datra_fifo_write_signalled(fifo_dev, 0,
+			DATRA_USERSIGNAL_EOF, is_blocking);
+	if (count >= 4) {
+		len = datra_fifo_write_words(filp, buf, count, f_pos);
+		if (len < (ssize_t)(count - trailing))
+			return len; /* Error, or would block */
+	}
+	if (trailing) {
+		if (copy_from_user(&word, buf + len, trailing))
+			return len ? len : -EFAULT;
+		/* BYTES1..3 equal the number of valid bytes */
+		status = datra_fifo_write_signalled(fifo_dev, word,
+			trailing, is_blocking);
+		if (status)
+			return len ? len : status;
+		len += trailing;
+		*f_pos += trailing;
+	}
+	return len;
+}
+
+static ssize_t datra_fifo_write_write(struct file *filp, const char __user *buf, size_t count,
+	loff_t *f_pos)
+{
+	struct datra_fifo_dev *fifo_dev = filp->private_data;
+	ssize_t status;
+
+	status = datra_fifo_write_user(filp, buf, count, f_pos);
+	if (trace_datra_fifo_write_enabled())
+		trace_datra_fifo_write(datra_get_config_index(fifo_dev->config_parent),
+			fifo_dev->index, count, status,
+			fifo_dev->ring_size ?
+				fifo_dev->ring_size - (fifo_dev->ring_head - fifo_dev->ring_tail) :
+				datra_fifo_write_level(fifo_dev));
+	return status;
+}
+
+static unsigned int datra_fifo_write_poll(struct file *filp, poll_table *wait)
+{
+	struct datra_fifo_dev *fifo_dev = filp->private_data;
+	unsigned int mask;
+
+	poll_wait(filp, &fifo_dev->fifo_wait_queue, wait);
+	if (fifo_dev->ring_size) {
+		/* The ISR wakes us when it made room in the ring */
+		if (fifo_dev->ring_head - READ_ONCE(fifo_dev->ring_tail) < fifo_dev->ring_size)
+			mask = (POLLOUT | POLLWRNORM);
+		else
+			mask = 0;
+	}
+	else if (datra_fifo_write_level(fifo_dev))
+		mask = (POLLOUT | POLLWRNORM);
+	else {
+		/* Wait for buffer crossing user-defined treshold */
+		datra_fifo_write_enable_interrupt(fifo_dev, datra_fifo_poll_threshold(fifo_dev));
+		mask = 0;
+	}
+
+	pr_debug("%s -> %#x\n", __func__, mask);
+
+	return mask;
+}
+
+static const struct file_operations datra_fifo_write_fops =
+{
+	.write = datra_fifo_write_write,
+	.poll = datra_fifo_write_poll,
+	.llseek = no_llseek,
+	.unlocked_ioctl = datra_fifo_rw_ioctl,
+	.mmap = datra_fifo_mmap,
+	.open = datra_fifo_write_open,
+	.release = datra_fifo_write_release,
+};
+
+
+/* Levels of all fifos of a CPU node in one pass, so that an application
+ * handling many channels need not poll each fifo. */
+static long datra_fifo_ctl_get_levels(struct datra_fifo_control_dev *fifo_ctl_dev,
+	struct datra_fifo_levels __user *arg)
+{
+	u32 __iomem *control_base = fifo_ctl_dev->config_parent->control_base;
+	struct datra_fifo_levels levels;
+	unsigned int count;
+	unsigned int i;
+
+	memset(&levels, 0, sizeof(levels));
+	count = min_t(unsigned int, fifo_ctl_dev->number_of_fifo_read_devices, DATRA_FIFO_MAX_COUNT);
+	for (i = 0; i < count; ++i) {
+		levels.read_level[i] = datra_reg_read_quick_index(control_base,
+			DATRA_REG_FIFO_READ_LEVEL_BASE, i);
+		if (levels.read_level[i] & 0xFFFF)
+			levels.ready_read |= BIT(i);
+	}
+	count = min_t(unsigned int, fifo_ctl_dev->number_of_fifo_write_devices, DATRA_FIFO_MAX_COUNT);
+	for (i = 0; i < count; ++i) {
+		levels.write_level[i] = datra_reg_read_quick_index(control_base,
+			DATRA_REG_FIFO_WRITE_LEVEL_BASE, i);
+		if (levels.write_level[i])
+			levels.ready_write |= BIT(i);
+	}
+	if (copy_to_user(arg, &levels, sizeof(levels)))
+		return -EFAULT;
+	return 0;
+}
+
+/* Service several read or write fifos in one call, without waiting.
+ * Returns the total number of words transferred. */
+static long datra_fifo_ctl_batch(struct datra_fifo_control_dev *fifo_ctl_dev,
+	struct datra_fifo_batch __user *arg, bool is_write)
+{
+	struct datra_dev *dev = fifo_ctl_dev->config_parent->parent;
+	unsigned int number_of_fifos = is_write ?
+		fifo_ctl_dev->number_of_fifo_write_devices :
+		fifo_ctl_dev->number_of_fifo_read_devices;
+	struct datra_fifo_batch_item __user *user_items;
+	struct datra_fifo_batch_item *items;
+	struct datra_fifo_batch batch;
+	long total = 0;
+	long status;
+	unsigned int i;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+	if (!batch.count || batch.count > 2 * DATRA_FIFO_MAX_COUNT)
+		return -EINVAL;
+	user_items = (struct datra_fifo_batch_item __user *)(uintptr_t)batch.items;
+	items = memdup_user(user_items, batch.count * sizeof(*items));
+	if (IS_ERR(items))
+		return PTR_ERR(items);
+
+	/* Keeps the fifos from being opened while we use them */
+	if (down_interruptible(&dev->fop_sem)) {
+		status = -ERESTARTSYS;
+		goto exit_free;
+	}
+	for (i = 0; i < batch.count; ++i) {
+		struct datra_fifo_batch_item *item = &items[i];
+		void __user *buffer = (void __user *)(uintptr_t)item->buffer;
+
+		if (item->fifo >= number_of_fifos ||
+		    item->count > DATRA_FIFO_MEMORY_SIZE / 4 ||
+		    (item->buffer & 0x03)) {
+			status = -EINVAL;
+			goto exit_unlock;
+		}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+		if (!access_ok(buffer, item->count << 2)) {
+#else
+		if (!access_ok(is_write ? VERIFY_READ : VERIFY_WRITE, buffer, item->count << 2)) {
+#endif
 			status = -EFAULT;
-			goto error_exit;
+			goto exit_unlock;
 		}
+		if (datra_fifo_is_busy(&fifo_ctl_dev->fifo_devices[is_write ? item->fifo :
+				fifo_ctl_dev->number_of_fifo_write_devices + item->fifo])) {
+			status = -EBUSY;
+			goto exit_unlock;
+		}
+	}
+	for (i = 0; i < batch.count; ++i) {
+		struct datra_fifo_batch_item *item = &items[i];
+		void __user *buffer = (void __user *)(uintptr_t)item->buffer;
+		struct datra_fifo_dev *fifo_dev;
+		unsigned int words;
+
+		if (is_write) {
+			u32 __iomem *mapped_memory;
+
+			fifo_dev = &fifo_ctl_dev->fifo_devices[item->fifo];
+			mapped_memory = datra_fifo_write_location(fifo_dev);
+			words = min_t(unsigned int, item->count, datra_fifo_write_level(fifo_dev));
+			status = datra_fifo_burst_from_user(mapped_memory, buffer, words);
+			if (mapped_memory != datra_fifo_memory_location(fifo_dev))
+				wmb();
+		} else {
+			u32 level;
+
+			fifo_dev = &fifo_ctl_dev->fifo_devices[
+				fifo_ctl_dev->number_of_fifo_write_devices + item->fifo];
+			level = datra_fifo_read_level(fifo_dev);
+			words = min_t(unsigned int, item->count, level & 0xFFFF);
+			item->user_signal = level >> 16;
+			status = datra_fifo_burst_to_user(buffer,
+				datra_fifo_memory_location(fifo_dev), words);
+		}
+		if (unlikely(status))
+			goto exit_unlock;
+		item->count = words;
+		datra_fifo_count(fifo_dev, words);
+		total += words;
+	}
+	status = total;
+exit_unlock:
+	up(&dev->fop_sem);
+	if (status >= 0 && copy_to_user(user_items, items, batch.count * sizeof(*items)))
+		status = -EFAULT;
+exit_free:
+	kfree(items);
+	return status;
+}
 
-		/* Submit command to engine, wait for availability first */
-		dma_op.addr = dma_dev->dma_to_logic_handle + dma_dev->dma_to_logic_head;
-		dma_op.size = bytes_to_copy;
-		for(;;) {
-			if (is_blocking)
-				prepare_to_wait(&dma_dev->wait_queue_to_logic, &wait, TASK_INTERRUPTIBLE);
-			if (datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_STATUS) & 0xFF0000)
-				break; /* There is room in the command buffer */
+/* Interrupt service routine for CPU fifo node, version 2 */
+static irqreturn_t datra_fifo_isr(struct datra_dev *dev, struct datra_config_dev *cfg_dev)
+{
+	struct datra_fifo_control_dev *fifo_ctl_dev = cfg_dev->private_data;
+	u32 status_reg = datra_reg_read_quick(
+		cfg_dev->control_base, DATRA_REG_FIFO_IRQ_STATUS);
+	u16 read_status_reg;
+	u16 write_status_reg;
+	u8 index;
+
+	/* Allow IRQ sharing */
+	if (!status_reg)
+		return IRQ_NONE;
+
+	/* Acknowledge interrupt to hardware */
+	iowrite32_quick(status_reg,
+			cfg_dev->control_base + (DATRA_REG_FIFO_IRQ_CLR>>2));
+	pr_debug("%s(status=0x%x)\n", __func__, status_reg);
+	trace_datra_isr(datra_get_config_index(cfg_dev), status_reg);
+	/* Trigger the associated wait queues, "read" queues first. These
+	 * are in the upper 16 bits of the interrupt status word */
+	read_status_reg = status_reg >> 16;
+	for (index = 0; (read_status_reg != 0) && (index < fifo_ctl_dev->number_of_fifo_read_devices); ++index)
+	{
+		if (read_status_reg & 1) {
+			struct datra_fifo_dev *fifo_dev =
+				&fifo_ctl_dev->fifo_devices[fifo_ctl_dev->number_of_fifo_write_devices + index];
+			/* Move the data into the ring before logic backs up */
+			spin_lock(&fifo_dev->ring_lock);
+			if (fifo_dev->ring)
+				datra_fifo_read_ring_fill(fifo_dev,
+					datra_fifo_wait_threshold(fifo_dev, DATRA_FIFO_READ_SIZE / 2));
+			spin_unlock(&fifo_dev->ring_lock);
+			datra_wake_up(&fifo_dev->fifo_wait_queue, &fifo_dev->stats);
+		}
+		read_status_reg >>= 1;
+	}
+	write_status_reg = status_reg & 0xFFFF;
+	for (index = 0; (write_status_reg != 0) && (index < fifo_ctl_dev->number_of_fifo_write_devices); ++index)
+	{
+		if (write_status_reg & 1) {
+			struct datra_fifo_dev *fifo_dev = &fifo_ctl_dev->fifo_devices[index];
+			/* Refill the hardware fifo from the ring */
+			spin_lock(&fifo_dev->ring_lock);
+			if (fifo_dev->ring)
+				datra_fifo_write_ring_drain(fifo_dev);
+			spin_unlock(&fifo_dev->ring_lock);
+			datra_wake_up(&fifo_dev->fifo_wait_queue, &fifo_dev->stats);
+		}
+		write_status_reg >>= 1;
+	}
+	return IRQ_HANDLED;
+}
+
+
+static unsigned int datra_dma_get_index(const struct datra_dma_dev *dma_dev)
+{
+	return datra_get_config_index(dma_dev->config_parent);
+}
+
+static void datra_dma_to_logic_irq_enable(u32 __iomem *control_base)
+{
+	pr_debug("%s\n", __func__);
+	iowrite32_quick(BIT(0), control_base + (DATRA_REG_FIFO_IRQ_SET>>2));
+}
+
+static void datra_dma_from_logic_irq_enable(u32 __iomem *control_base)
+{
+	pr_debug("%s\n", __func__);
+	iowrite32_quick(BIT(16), control_base + (DATRA_REG_FIFO_IRQ_SET>>2));
+}
+
+/* Kills ongoing DMA transactions and resets everything. */
+static int datra_dma_to_logic_reset(struct datra_dma_dev *dma_dev)
+{
+	u32 __iomem *control_base = dma_dev->config_parent->control_base;
+	u32 reg;
+	int result;
+	DEFINE_WAIT(wait);
+
+	reg = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_CONTROL);
+	pr_debug("%s ctl=%#x\n", __func__, reg);
+	if (reg & BIT(1)) {
+		pr_err("%s: Reset already in progress\n", __func__);
+		return -EBUSY;
+	}
+	if (!(reg & BIT(0))) {
+		pr_debug("%s: DMA hardware not running\n", __func__);
+		return -EINVAL;
+	}
+	reg |= BIT(1);
+	prepare_to_wait(&dma_dev->wait_queue_to_logic, &wait, TASK_INTERRUPTIBLE);
+	/* Enable reset-ready-interrupt */
+	iowrite32(BIT(15), control_base + (DATRA_REG_FIFO_IRQ_SET>>2));
+	/* Send reset command */
+	iowrite32_quick(reg, control_base + (DATRA_DMA_TOLOGIC_CONTROL>>2));
+	for(;;) {
+		if ((datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_CONTROL) & BIT(1)) == 0) {
+			result = 0;
+			break;
+		}
+		if (signal_pending(current)) {
+			result = -ERESTARTSYS;
+			break;
+		}
+		if (schedule_timeout(HZ/4) == 0) {
+			pr_err("%s: TIMEOUT waiting for reset complete IRQ.\n", __func__);
+			result = -ETIMEDOUT;
+			break;
+		}
+		prepare_to_wait(&dma_dev->wait_queue_to_logic, &wait, TASK_INTERRUPTIBLE);
+	}
+	finish_wait(&dma_dev->wait_queue_from_logic, &wait);
+
+	/* Re-enable the node */
+	iowrite32_quick(BIT(0), control_base + (DATRA_DMA_TOLOGIC_CONTROL>>2));
+	dma_dev->dma_to_logic_head = 0;
+	dma_dev->dma_to_logic_tail = 0;
+	dma_dev->dma_to_logic_splice_residue_len = 0;
+	kfifo_reset(&dma_dev->dma_to_logic_wip);
+	datra_dma_latency_reset(&dma_dev->latency_to_logic);
+	return result;
+}
+
+static int datra_dma_from_logic_reset(struct datra_dma_dev *dma_dev)
+{
+	u32 __iomem *control_base = dma_dev->config_parent->control_base;
+	u32 reg;
+	int result;
+	DEFINE_WAIT(wait);
+
+
+	reg = datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_CONTROL);
+	pr_debug("%s ctl=%#x\n", __func__, reg);
+	if (reg & BIT(1)) {
+		pr_err("%s: Reset already in progress\n", __func__);
+		return -EBUSY;
+	}
+	if (!(reg & BIT(0))) {
+		pr_debug("%s: DMA hardware not running\n", __func__);
+		return -EINVAL;
+	}
+	reg |= BIT(1);
+	prepare_to_wait(&dma_dev->wait_queue_from_logic, &wait, TASK_INTERRUPTIBLE);
+	/* Enable reset-ready-interrupt */
+	iowrite32(BIT(31), control_base + (DATRA_REG_FIFO_IRQ_SET>>2));
+	/* Send reset command */
+	iowrite32_quick(BIT(1)|BIT(0), control_base + (DATRA_DMA_FROMLOGIC_CONTROL>>2));
+	for(;;) {
+		if ((datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_CONTROL) & BIT(1)) == 0) {
+			result = 0;
+			break;
+		}
+		if (signal_pending(current)) {
+			result = -ERESTARTSYS;
+			break;
+		}
+		if (schedule_timeout(HZ) == 0) {
+			pr_err("%s: TIMEOUT waiting for reset complete IRQ ctrl=%#x ists=%#x\n",
+				__func__,
+				datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_CONTROL),
+				datra_reg_read_quick(control_base, DATRA_REG_FIFO_IRQ_STATUS));
+			result = -ETIMEDOUT;
+			break;
+		}
+		prepare_to_wait(&dma_dev->wait_queue_from_logic, &wait, TASK_INTERRUPTIBLE);
+	}
+	finish_wait(&dma_dev->wait_queue_from_logic, &wait);
+
+	/* Re-enable the node */
+	iowrite32_quick(BIT(0), control_base + (DATRA_DMA_FROMLOGIC_CONTROL>>2));
+
+	dma_dev->dma_from_logic_head = 0;
+	dma_dev->dma_from_logic_tail = 0;
+	dma_dev->dma_from_logic_current_op.size = 0;
+	dma_dev->dma_from_logic_full = false;
+	dma_dev->dma_from_logic_eof = false;
+	datra_dma_latency_reset(&dma_dev->latency_from_logic);
+	return result;
+}
+
+/* Ring memory is either coherent, or cachable memory that is mapped for
+ * streaming DMA once, and synced in parts as data passes through. */
+static void *datra_dma_ring_alloc_memory(struct device *device, size_t size,
+	dma_addr_t *handle, bool streaming, enum dma_data_direction direction)
+{
+	void *mem;
+
+	if (!streaming)
+		return dma_alloc_coherent(device, size, handle, GFP_KERNEL);
+
+	mem = kmalloc_node(size, GFP_KERNEL, dev_to_node(device));
+	if (!mem)
+		return NULL;
+	*handle = dma_map_single(device, mem, size, direction);
+	if (dma_mapping_error(device, *handle)) {
+		kfree(mem);
+		return NULL;
+	}
+	return mem;
+}
+
+static void datra_dma_ring_free_memory(struct device *device, size_t size,
+	void *mem, dma_addr_t handle, bool streaming,
+	enum dma_data_direction direction)
+{
+	if (!streaming) {
+		dma_free_coherent(device, size, mem, handle);
+		return;
+	}
+	dma_unmap_single(device, handle, size, direction);
+	kfree(mem);
+}
+
+static int datra_dma_to_logic_ring_alloc(struct datra_dma_dev *dma_dev)
+{
+	struct device *device = dma_dev->config_parent->parent->device;
+
+	if (likely(dma_dev->dma_to_logic_memory))
+		return 0;
+	dma_dev->dma_to_logic_memory = datra_dma_ring_alloc_memory(device,
+		dma_dev->dma_to_logic_memory_size, &dma_dev->dma_to_logic_handle,
+		dma_dev->dma_to_logic_streaming, DMA_TO_DEVICE);
+	if (!dma_dev->dma_to_logic_memory)
+		return -ENOMEM;
+	pr_debug("%s addr=%#llx\n", __func__, (u64)dma_dev->dma_to_logic_handle);
+	return 0;
+}
+
+static void datra_dma_to_logic_ring_free(struct datra_dma_dev *dma_dev)
+{
+	struct device *device = dma_dev->config_parent->parent->device;
+
+	if (!dma_dev->dma_to_logic_memory)
+		return;
+	datra_dma_ring_free_memory(device, dma_dev->dma_to_logic_memory_size,
+		dma_dev->dma_to_logic_memory, dma_dev->dma_to_logic_handle,
+		dma_dev->dma_to_logic_streaming, DMA_TO_DEVICE);
+	dma_dev->dma_to_logic_memory = NULL;
+}
+
+static int datra_dma_from_logic_ring_alloc(struct datra_dma_dev *dma_dev)
+{
+	struct device *device = dma_dev->config_parent->parent->device;
+
+	if (likely(dma_dev->dma_from_logic_memory))
+		return 0;
+	dma_dev->dma_from_logic_memory = datra_dma_ring_alloc_memory(device,
+		dma_dev->dma_from_logic_memory_size, &dma_dev->dma_from_logic_handle,
+		dma_dev->dma_from_logic_streaming, DMA_FROM_DEVICE);
+	if (!dma_dev->dma_from_logic_memory)
+		return -ENOMEM;
+	pr_debug("%s addr=%#llx\n", __func__, (u64)dma_dev->dma_from_logic_handle);
+	return 0;
+}
+
+static void datra_dma_from_logic_ring_free(struct datra_dma_dev *dma_dev)
+{
+	struct device *device = dma_dev->config_parent->parent->device;
+
+	if (!dma_dev->dma_from_logic_memory)
+		return;
+	datra_dma_ring_free_memory(device, dma_dev->dma_from_logic_memory_size,
+		dma_dev->dma_from_logic_memory, dma_dev->dma_from_logic_handle,
+		dma_dev->dma_from_logic_streaming, DMA_FROM_DEVICE);
+	dma_dev->dma_from_logic_memory = NULL;
+	/* Reset may have failed, nothing must point into the ring anymore */
+	dma_dev->dma_from_logic_head = 0;
+	dma_dev->dma_from_logic_tail = 0;
+	dma_dev->dma_from_logic_current_op.size = 0;
+	dma_dev->dma_from_logic_full = false;
+}
+
+/* Forward declarations */
+static const struct file_operations datra_dma_to_logic_fops;
+static const struct file_operations datra_dma_from_logic_fops;
+static int datra_dma_to_logic_block_free(struct datra_dma_dev *dma_dev);
+static int datra_dma_from_logic_block_free(struct datra_dma_dev *dma_dev);
+static unsigned int datra_dma_to_logic_avail(struct datra_dma_dev *dma_dev);
+
+static int datra_dma_open(struct inode *inode, struct file *filp)
+{
+	struct datra_dma_dev *dma_dev = container_of(
+		inode->i_cdev, struct datra_dma_dev, cdev_dma);
+	struct datra_config_dev *cfg_dev = dma_dev->config_parent;
+	struct datra_dev *dev = cfg_dev->parent;
+	int status = 0;
+
+	pr_debug("%s(mode=%#x flags=%#x)\n", __func__,
+		filp->f_mode, filp->f_flags);
+
+	/* Must specify either read or write mode */
+	if ((filp->f_mode & (FMODE_READ | FMODE_WRITE)) == 0)
+		return -EINVAL;
+
+	if (down_interruptible(&dev->fop_sem))
+		return -ERESTARTSYS;
+	filp->private_data = dma_dev; /* for other methods */
+	nonseekable_open(inode, filp);
+
+	if (filp->f_mode & FMODE_WRITE) {
+		/* For mmap to work, the device must be opened in R+W mode, so
+		 * consider this the same as opening for write-only. */
+		if (dma_dev->open_mode & FMODE_WRITE) {
+			status = -EBUSY;
+			goto exit_open;
+		}
+		dma_dev->open_mode |= FMODE_WRITE; /* Set in-use bits */
+		filp->f_op = &datra_dma_to_logic_fops;
+		/* Reset usersignal */
+		iowrite32_quick(DATRA_USERSIGNAL_ZERO,
+			cfg_dev->control_base + (DATRA_DMA_TOLOGIC_USERBITS>>2));
+		/* Default to generic size */
+		dma_dev->dma_to_logic_block_size = datra_dma_default_block_size;
+		dma_dev->dma_to_logic_byte_mode = false;
+		dma_dev->dma_to_logic_splice_residue_len = 0;
+	} else {
+		if (dma_dev->open_mode & FMODE_READ) {
+			status = -EBUSY;
+			goto exit_open;
+		}
+		dma_dev->open_mode |= FMODE_READ; /* Set in-use bits */
+		filp->f_op = &datra_dma_from_logic_fops;
+		dma_dev->dma_from_logic_byte_mode = false;
+		dma_dev->dma_from_logic_eof = false;
+	}
+exit_open:
+	up(&dev->fop_sem);
+	pr_debug("%s(mode=%#x flags=%#x) -> %d\n", __func__,
+		filp->f_mode, filp->f_flags, status);
+	return status;
+}
+
+static int datra_dma_common_release(struct datra_dma_dev *dma_dev, mode_t flag_to_clear)
+{
+	struct datra_dev *dev = dma_dev->config_parent->parent;
+
+	if (down_interruptible(&dev->fop_sem))
+		return -ERESTARTSYS;
+	dma_dev->open_mode &= ~flag_to_clear; /* Clear in use bit */
+	up(&dev->fop_sem);
+
+	return 0;
+}
+
+static int datra_dma_to_logic_release(struct inode *inode, struct file *filp)
+{
+	struct datra_dma_dev *dma_dev = filp->private_data;
+
+	/* If we were in "block" mode, release those resources now. */
+	if (dma_dev->dma_to_logic_blocks.blocks)
+		datra_dma_to_logic_block_free(dma_dev);
+
+	/* Logic may still be reading from the ring, which is not harmful
+	 * but the memory must stay until it's done. A later close or remove
+	 * releases it then. */
+	if (!datra_dma_ring_cache && dma_dev->dma_to_logic_memory) {
+		if (!kfifo_is_empty(&dma_dev->dma_to_logic_wip))
+			datra_dma_to_logic_avail(dma_dev);
+		if (kfifo_is_empty(&dma_dev->dma_to_logic_wip))
+			datra_dma_to_logic_ring_free(dma_dev);
+	}
+
+	return datra_dma_common_release(dma_dev, FMODE_WRITE);
+}
+
+static int datra_dma_from_logic_release(struct inode *inode, struct file *filp)
+{
+	struct datra_dma_dev *dma_dev = filp->private_data;
+
+	/* If we were in "block" mode, release those resources now. */
+	if (dma_dev->dma_from_logic_blocks.blocks)
+		datra_dma_from_logic_block_free(dma_dev);
+
+	/* Logic writes into the ring, so stop it before releasing memory.
+	 * -EINVAL means the DMA core wasn't running. */
+	if (!datra_dma_ring_cache && dma_dev->dma_from_logic_memory) {
+		int ret = datra_dma_from_logic_reset(dma_dev);
+		if (ret == 0 || ret == -EINVAL)
+			datra_dma_from_logic_ring_free(dma_dev);
+	}
+
+	return datra_dma_common_release(dma_dev, FMODE_READ);
+}
+
+/* CPU and DMA shouldn't be accessing the same cache line simultaneously.
+ * Since PAGE_SIZE is guaranteed to be larger, use that to align the head
+ * pointer for DMA transfers. */
+static unsigned int round_up_to_cacheline(unsigned int value)
+{
+	return (value + (PAGE_SIZE-1)) & (~(PAGE_SIZE-1));
+}
+
+static unsigned int datra_dma_to_logic_avail(struct datra_dma_dev *dma_dev)
+{
+	u32 __iomem *control_base = dma_dev->config_parent->control_base;
+	u32 status = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_STATUS);
+	/* Status: bits 24..31: #results; 16..23: available to execute */
+	u8 num_results;
+
+	pr_debug("%s status=%#x\n", __func__, status);
+	for (num_results = (status >> 24); num_results != 0; --num_results) {
+		/* Fetch result from queue */
+		struct datra_dma_to_logic_operation op;
+		dma_addr_t addr = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_RESULT_ADDR_LOW);
+		if (dma_dev->dma_64bit)
+			addr |= ((dma_addr_t)datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_RESULT_ADDR_HIGH) << 32);
+		if (unlikely(!kfifo_get(&dma_dev->dma_to_logic_wip, &op))) {
+			pr_err("Nothing in fifo of DMA node %u but still %u results\n",
+				datra_dma_get_index(dma_dev), num_results);
+			BUG();
+		}
+		pr_debug("%s addr=0x%llx wip=0x%llx,%u\n", __func__, (u64)addr, (u64)op.addr, op.size);
+		trace_datra_dma_complete(datra_dma_get_index(dma_dev), true,
+			addr, op.size, 0, num_results - 1);
+		datra_dma_latency_complete(&dma_dev->latency_to_logic);
+		if (unlikely(op.addr != addr)) {
+			pr_err("Mismatch in result of DMA node %u: phys=%pa expected 0x%llx (size %d) actual 0x%llx\n",
+				datra_dma_get_index(dma_dev),
+				&dma_dev->dma_to_logic_handle,
+				(u64)op.addr, op.size, (u64)addr);
+			pr_err("head=%#x (%d) tail=%#x (%d)\n",
+				dma_dev->dma_to_logic_head,
+				dma_dev->dma_to_logic_head,
+				dma_dev->dma_to_logic_tail,
+				dma_dev->dma_to_logic_tail);
+			for (;;) {
+				if (!kfifo_get(&dma_dev->dma_to_logic_wip, &op))
+					break;
+				pr_err("Internal entry: 0x%llx (size %d)\n", (u64)op.addr, op.size);
+			}
+			while (num_results) {
+				dma_addr_t addr = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_RESULT_ADDR_LOW);
+				if (dma_dev->dma_64bit)
+					addr |= ((dma_addr_t)datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_RESULT_ADDR_HIGH) << 32);
+				pr_err("Logic result: 0x%llx\n", (u64)addr);
+				--num_results;
+			}
+			BUG();
+		}
+		if (dma_dev->dma_to_logic_streaming)
+			dma_sync_single_range_for_cpu(dma_dev->config_parent->parent->device,
+				dma_dev->dma_to_logic_handle, dma_dev->dma_to_logic_tail,
+				op.size, DMA_TO_DEVICE);
+		dma_dev->dma_to_logic_tail += round_up_to_cacheline(op.size);
+		if (dma_dev->dma_to_logic_tail == dma_dev->dma_to_logic_memory_size)
+			dma_dev->dma_to_logic_tail = 0;
+		pr_debug("%s tail=%u\n", __func__, dma_dev->dma_to_logic_tail);
+		if (unlikely(dma_dev->dma_to_logic_tail > dma_dev->dma_to_logic_memory_size)) {
+			pr_err("Overflow in DMA node %u: tail %u size %u\n",
+				datra_dma_get_index(dma_dev),
+				dma_dev->dma_to_logic_tail, dma_dev->dma_to_logic_memory_size);
+			BUG();
+		}
+	}
+	/* Calculate available space */
+	if (dma_dev->dma_to_logic_tail > dma_dev->dma_to_logic_head)
+		return dma_dev->dma_to_logic_tail - dma_dev->dma_to_logic_head;
+	else if (dma_dev->dma_to_logic_tail == dma_dev->dma_to_logic_head) {
+		/* Can mean "full" or "empty" */
+		if (!kfifo_is_empty(&dma_dev->dma_to_logic_wip))
+			return 0; /* head==tail and there is work in progress */
+	}
+	/* Return available bytes until end of buffer */
+	return dma_dev->dma_to_logic_memory_size - dma_dev->dma_to_logic_head;
+}
+
+
+/* Two things may block: There's no room in the ring, or there's no room
+ * in the command buffer. Data comes from either the user buffer "buf" or,
+ * when "kbuf" is set, from kernel memory (used for splice). */
+static ssize_t datra_dma_write_common(struct datra_dma_dev *dma_dev,
+	const char __user *buf, const char *kbuf, size_t count,
+	bool is_blocking)
+{
+	int status = 0;
+	u32 __iomem *control_base = dma_dev->config_parent->control_base;
+	unsigned int bytes_to_copy;
+	unsigned int bytes_copied = 0;
+	unsigned int bytes_avail;
+	struct datra_dma_to_logic_operation dma_op;
+	DEFINE_WAIT(wait);
+
+	pr_debug("%s(%u)\n", __func__, (unsigned int)count);
+
+	if (count < 4) /* Do not allow read or write below word size */
+		return -EINVAL;
+	count &= ~0x03;
+
+	if (dma_dev->dma_to_logic_blocks.blocks)
+		return -EBUSY;
+
+	status = datra_dma_to_logic_ring_alloc(dma_dev);
+	if (unlikely(status))
+		return status;
+
+	while (count) {
+		bytes_to_copy = min((unsigned int)count, dma_dev->dma_to_logic_block_size);
+		for(;;) {
+			if (is_blocking)
+				prepare_to_wait(&dma_dev->wait_queue_to_logic, &wait, TASK_INTERRUPTIBLE);
+			bytes_avail = datra_dma_to_logic_avail(dma_dev);
+			pr_debug("%s bytes_avail=%u head=%u tail=%u\n", __func__,
+				bytes_avail, dma_dev->dma_to_logic_head, dma_dev->dma_to_logic_tail);
+			if (bytes_avail != 0)
+				break;
+			if (signal_pending(current))
+				goto error_interrupted;
+			/* Enable interrupt */
+			datra_dma_to_logic_irq_enable(control_base);
+			if (is_blocking) {
+				atomic64_inc(&dma_dev->stats_to_logic.blocked);
+				schedule();
+			} else {
+				if (bytes_copied)
+					goto exit_ok; /* Some data transferred */
+				else {
+					/* No data available, tell user */
+					atomic64_inc(&dma_dev->stats_to_logic.eagain);
+					status = -EAGAIN;
+					goto error_exit;
+				}
+			}
+		}
+		if (is_blocking)
+			finish_wait(&dma_dev->wait_queue_to_logic, &wait);
+		if (bytes_avail < bytes_to_copy)
+			bytes_to_copy = bytes_avail;
+
+		/* Copy data into DMA buffer */
+		if (kbuf)
+			memcpy((char *)dma_dev->dma_to_logic_memory + dma_dev->dma_to_logic_head,
+				kbuf, bytes_to_copy);
+		else if (unlikely(copy_from_user(
+				(char __iomem *)dma_dev->dma_to_logic_memory + dma_dev->dma_to_logic_head,
+				buf, bytes_to_copy))) {
+			status = -EFAULT;
+			goto error_exit;
+		}
+		/* Clean only what was written */
+		if (dma_dev->dma_to_logic_streaming)
+			dma_sync_single_range_for_device(dma_dev->config_parent->parent->device,
+				dma_dev->dma_to_logic_handle, dma_dev->dma_to_logic_head,
+				bytes_to_copy, DMA_TO_DEVICE);
+
+		/* Submit command to engine, wait for availability first */
+		dma_op.addr = dma_dev->dma_to_logic_handle + dma_dev->dma_to_logic_head;
+		dma_op.size = bytes_to_copy;
+		for(;;) {
+			if (is_blocking)
+				prepare_to_wait(&dma_dev->wait_queue_to_logic, &wait, TASK_INTERRUPTIBLE);
+			if (datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_STATUS) & 0xFF0000)
+				break; /* There is room in the command buffer */
 			if (signal_pending(current))
 				goto error_interrupted;
 			/* Enable interrupt */
 			datra_dma_to_logic_irq_enable(control_base);
-			if (is_blocking)
-				schedule();
-			else {
-				if (bytes_copied)
-					goto exit_ok; /* Some data transferred */
-				else {
-					/* No data available, tell user */
-					status = -EAGAIN;
-					goto error_exit;
-				}
-			}
+			if (is_blocking) {
+				atomic64_inc(&dma_dev->stats_to_logic.blocked);
+				schedule();
+			} else {
+				if (bytes_copied)
+					goto exit_ok; /* Some data transferred */
+				else {
+					/* No data available, tell user */
+					atomic64_inc(&dma_dev->stats_to_logic.eagain);
+					status = -EAGAIN;
+					goto error_exit;
+				}
+			}
+		}
+		if (is_blocking)
+			finish_wait(&dma_dev->wait_queue_to_logic, &wait);
+		pr_debug("%s sending addr=%#x size=%u\n", __func__,
+			(unsigned int)dma_op.addr, dma_op.size);
+		iowrite32_quick(dma_op.addr & 0xFFFFFFFF, control_base + (DATRA_DMA_TOLOGIC_STARTADDR_LOW>>2));
+		if (dma_dev->dma_64bit)
+			iowrite32_quick(dma_op.addr >> 32, control_base + (DATRA_DMA_TOLOGIC_STARTADDR_HIGH>>2));
+		iowrite32(dma_op.size, control_base + (DATRA_DMA_TOLOGIC_BYTESIZE>>2));
+		datra_dma_count(&dma_dev->stats_to_logic, dma_op.size,
+			dma_op.size != dma_dev->dma_to_logic_block_size);
+		datra_dma_latency_submit(&dma_dev->latency_to_logic);
+		if (unlikely(kfifo_put(&dma_dev->dma_to_logic_wip, dma_op) == 0)) {
+			pr_err("dma_to_logic_wip kfifo was full, cannot put %#x %u\n",
+				(u32)dma_op.addr, dma_op.size);
+			BUG();
+		}
+		/* Reading the user signal costs a bus access, only do that
+		 * when tracing */
+		if (trace_datra_dma_submit_enabled())
+			trace_datra_dma_submit(datra_dma_get_index(dma_dev), true,
+				dma_op.addr, dma_op.size,
+				datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_USERBITS),
+				kfifo_len(&dma_dev->dma_to_logic_wip));
+
+		/* Update pointers for next chunk, if any */
+		dma_dev->dma_to_logic_head += round_up_to_cacheline(bytes_to_copy);
+		if (dma_dev->dma_to_logic_head == dma_dev->dma_to_logic_memory_size)
+			dma_dev->dma_to_logic_head = 0;
+		pr_debug("%s head=%u\n", __func__, dma_dev->dma_to_logic_head);
+		BUG_ON(dma_dev->dma_to_logic_head > dma_dev->dma_to_logic_memory_size);
+		if (kbuf)
+			kbuf += bytes_to_copy;
+		else
+			buf += bytes_to_copy;
+		bytes_copied += bytes_to_copy;
+		count -= bytes_to_copy;
+	}
+exit_ok:
+	status = bytes_copied;
+error_exit:
+	pr_debug("%s -> %d\n", __func__, status);
+	return status;
+
+error_interrupted:
+	if (is_blocking)
+		finish_wait(&dma_dev->wait_queue_to_logic, &wait);
+	pr_debug("%s -> ERESTARTSYS\n", __func__);
+	return -ERESTARTSYS;
+}
+
+/* Send a single word in its own transfer with a special user signal, for
+ * trailing bytes and the end-of-stream marker in byte mode. The signal
+ * register is latched when the command is submitted. */
+static int datra_dma_write_signalled(struct datra_dma_dev *dma_dev,
+	u32 word, u32 user_signal, bool is_blocking)
+{
+	u32 __iomem *control_base = dma_dev->config_parent->control_base;
+	ssize_t status;
+
+	iowrite32_quick(user_signal, control_base + (DATRA_DMA_TOLOGIC_USERBITS>>2));
+	status = datra_dma_write_common(dma_dev, NULL, (const char *)&word,
+			sizeof(word), is_blocking);
+	iowrite32_quick(DATRA_USERSIGNAL_ZERO, control_base + (DATRA_DMA_TOLOGIC_USERBITS>>2));
+	return status < 0 ? status : 0;
+}
+
+static ssize_t datra_dma_write_user(struct file *filp, const char __user *buf,
+	size_t count, loff_t *f_pos)
+{
+	struct datra_dma_dev *dma_dev = filp->private_data;
+	const bool is_blocking = (filp->f_flags & O_NONBLOCK) == 0;
+	size_t trailing = count & 0x03;
+	ssize_t status = 0;
+	u32 word = 0;
+	int result;
+
+	if (!dma_dev->dma_to_logic_byte_mode) {
+		status = datra_dma_write_common(dma_dev, buf, NULL, count, is_blocking);
+		if (status > 0)
+			*f_pos += status;
+		return status;
+	}
+
+	if (dma_dev->dma_to_logic_blocks.blocks)
+		return -EBUSY;
+	/* In byte mode, a zero-length write ends the stream */
+	if (!count)
+		return datra_dma_write_signalled(dma_dev, 0,
+			DATRA_USERSIGNAL_EOF, is_blocking);
+	if (count >= 4) {
+		status = datra_dma_write_common(dma_dev, buf, NULL, count, is_blocking);
+		if (status > 0)
+			*f_pos += status;
+		if (status < (ssize_t)(count - trailing))
+			return status; /* Error, or would block */
+	}
+	if (trailing) {
+		if (copy_from_user(&word, buf + status, trailing))
+			return status ? status : -EFAULT;
+		/* BYTES1..3 equal the number of valid bytes */
+		result = datra_dma_write_signalled(dma_dev, word, trailing, is_blocking);
+		if (result)
+			return status ? status : result;
+		status += trailing;
+		*f_pos += trailing;
+	}
+	return status;
+}
+
+/* Adds new read commands to the queue and returns number of results */
+static unsigned int datra_dma_from_logic_pump(struct datra_dma_dev *dma_dev)
+{
+	u32 __iomem *control_base = dma_dev->config_parent->control_base;
+	u32 status_reg;
+	u8 num_free_entries;
+
+	status_reg = datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_STATUS);
+	pr_debug("%s status=%#x\n", __func__, status_reg);
+	num_free_entries = (status_reg >> 16) & 0xFF;
+
+	while (!dma_dev->dma_from_logic_full) {
+		if (!num_free_entries)
+			break; /* No more room for commands */
+		if (dma_dev->dma_from_logic_streaming)
+			dma_sync_single_range_for_device(dma_dev->config_parent->parent->device,
+				dma_dev->dma_from_logic_handle, dma_dev->dma_from_logic_head,
+				dma_dev->dma_from_logic_block_size, DMA_FROM_DEVICE);
+		pr_debug("%s sending addr=0x%llx size=%u\n", __func__,
+			(u64)dma_dev->dma_from_logic_handle + dma_dev->dma_from_logic_head, dma_dev->dma_from_logic_block_size);
+		iowrite32((dma_dev->dma_from_logic_handle + dma_dev->dma_from_logic_head) & 0xFFFFFFFF, control_base + (DATRA_DMA_FROMLOGIC_STARTADDR_LOW>>2));
+		if (dma_dev->dma_64bit)
+			iowrite32((dma_dev->dma_from_logic_handle + dma_dev->dma_from_logic_head) >> 32, control_base + (DATRA_DMA_FROMLOGIC_STARTADDR_HIGH>>2));
+		iowrite32(dma_dev->dma_from_logic_block_size, control_base + (DATRA_DMA_FROMLOGIC_BYTESIZE>>2));
+		datra_dma_latency_submit(&dma_dev->latency_from_logic);
+		trace_datra_dma_submit(datra_dma_get_index(dma_dev), false,
+			dma_dev->dma_from_logic_handle + dma_dev->dma_from_logic_head,
+			dma_dev->dma_from_logic_block_size, 0, 0);
+		dma_dev->dma_from_logic_head += dma_dev->dma_from_logic_block_size;
+		if (dma_dev->dma_from_logic_head == dma_dev->dma_from_logic_memory_size)
+			dma_dev->dma_from_logic_head = 0;
+		if (dma_dev->dma_from_logic_head == dma_dev->dma_from_logic_tail)
+			dma_dev->dma_from_logic_full = true;
+		--num_free_entries;
+	}
+
+	trace_datra_dma_pump(datra_dma_get_index(dma_dev), num_free_entries,
+		status_reg >> 24);
+	return status_reg >> 24;
+}
+
+/* Copies data from the ring into the user buffer "buf", or into kernel
+ * memory at "kbuf" when that is set (used for splice). */
+static ssize_t datra_dma_read_common(struct datra_dma_dev *dma_dev,
+	char __user *buf, char *kbuf, size_t count, bool is_blocking)
+{
+	u32 __iomem *control_base = dma_dev->config_parent->control_base;
+	int status = 0;
+	unsigned int bytes_to_copy;
+	unsigned int bytes_copied = 0;
+	unsigned int results_avail = 0;
+	unsigned int tail;
+	u64 copy_start;
+	struct datra_dma_from_logic_operation *current_op =
+		&dma_dev->dma_from_logic_current_op;
+	DEFINE_WAIT(wait);
+
+	pr_debug("%s(%u)\n", __func__, (unsigned int)count);
+
+	if (dma_dev->dma_from_logic_byte_mode) {
+		if (dma_dev->dma_from_logic_eof) {
+			dma_dev->dma_from_logic_eof = false;
+			return 0;
+		}
+		if (!count)
+			return 0;
+	} else {
+		if (count < 4) /* Do not allow read or write below word size */
+			return -EINVAL;
+		count &= ~0x03;
+	}
+
+	if (dma_dev->dma_from_logic_blocks.blocks)
+		return -EBUSY;
+
+	status = datra_dma_from_logic_ring_alloc(dma_dev);
+	if (unlikely(status))
+		return status;
+
+	while (count) {
+		while (current_op->size == 0) {
+			/* Fetch a new operation from logic */
+			if (results_avail) {
+				dma_addr_t start_addr = datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_RESULT_ADDR_LOW);
+				if (dma_dev->dma_64bit)
+					start_addr |= ((dma_addr_t)datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_RESULT_ADDR_HIGH) << 32);
+				tail = start_addr - dma_dev->dma_from_logic_handle;
+				current_op->addr = ((char*)dma_dev->dma_from_logic_memory) + tail;
+				current_op->user_signal = datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_RESULT_USERBITS);
+				current_op->size = datra_reg_read(control_base, DATRA_DMA_FROMLOGIC_RESULT_BYTESIZE);
+				/* Invalidate only what logic wrote */
+				if (dma_dev->dma_from_logic_streaming)
+					dma_sync_single_range_for_cpu(dma_dev->config_parent->parent->device,
+						dma_dev->dma_from_logic_handle, tail,
+						current_op->size, DMA_FROM_DEVICE);
+				current_op->short_transfer = (current_op->size != dma_dev->dma_from_logic_block_size);
+				datra_dma_count(&dma_dev->stats_from_logic, current_op->size,
+					current_op->short_transfer);
+				trace_datra_dma_complete(datra_dma_get_index(dma_dev), false,
+					start_addr, current_op->size,
+					current_op->user_signal, results_avail - 1);
+				datra_dma_latency_complete(&dma_dev->latency_from_logic);
+				tail += dma_dev->dma_from_logic_block_size;
+				if (tail == dma_dev->dma_from_logic_memory_size)
+					tail = 0;
+				current_op->next_tail = tail;
+				--results_avail;
+				pr_debug("%s: nexttail=%u size=%u addr=%p\n", __func__,
+					tail, current_op->size, current_op->addr);
+				if (dma_dev->dma_from_logic_byte_mode) {
+					if (current_op->user_signal == DATRA_USERSIGNAL_EOF) {
+						/* End of stream marker, carries no data */
+						current_op->size = 0;
+						dma_dev->dma_from_logic_tail = tail;
+						dma_dev->dma_from_logic_full = false;
+						results_avail = datra_dma_from_logic_pump(dma_dev);
+						if (bytes_copied)
+							dma_dev->dma_from_logic_eof = true;
+						goto exit_ok;
+					}
+					/* Last word is only partially valid */
+					if (current_op->user_signal >= DATRA_USERSIGNAL_BYTES1 &&
+					    current_op->user_signal <= DATRA_USERSIGNAL_BYTES3 &&
+					    current_op->size >= 4)
+						current_op->size -= 4 - current_op->user_signal;
+				}
+			} else {
+				for(;;) {
+					if (is_blocking)
+						prepare_to_wait(&dma_dev->wait_queue_from_logic, &wait, TASK_INTERRUPTIBLE);
+					results_avail = datra_dma_from_logic_pump(dma_dev);
+					pr_debug("%s results_avail=%u head=%u tail=%u\n", __func__,
+						results_avail, dma_dev->dma_from_logic_head, dma_dev->dma_from_logic_tail);
+					if (results_avail != 0)
+						break;
+					if (signal_pending(current))
+						goto error_interrupted;
+					/* Enable interrupt */
+					datra_dma_from_logic_irq_enable(control_base);
+					if (is_blocking) {
+						atomic64_inc(&dma_dev->stats_from_logic.blocked);
+						schedule();
+					} else {
+						if (bytes_copied)
+							goto exit_ok; /* Some data transferred */
+						else {
+							/* No data available, tell user */
+							atomic64_inc(&dma_dev->stats_from_logic.eagain);
+							status = -EAGAIN;
+							goto error_exit;
+						}
+					}
+				}
+				if (is_blocking)
+					finish_wait(&dma_dev->wait_queue_from_logic, &wait);
+			}
+		}
+		/* Copy any remaining data into the user's buffer */
+		if (current_op->size) {
+			bytes_to_copy = current_op->size;
+			if (bytes_to_copy > count)
+				bytes_to_copy = count;
+			/* pr_debug("%s: copy_to_user %p (%u)\n", __func__, current_op->addr, bytes_to_copy); */
+			copy_start = ktime_get_ns();
+			if (dma_dev->dma_uncached && !dma_dev->dma_from_logic_streaming) {
+				/* Uncached ring, use wide burst loads */
+				if (kbuf)
+					datra_memcpy_from_uncached(kbuf, current_op->addr, bytes_to_copy);
+				else if (unlikely(datra_copy_to_user_from_uncached(buf, current_op->addr, bytes_to_copy))) {
+					status = -EFAULT;
+					goto error_exit;
+				}
+			} else {
+				if (kbuf)
+					memcpy(kbuf, current_op->addr, bytes_to_copy);
+				else if (unlikely(__copy_to_user(buf, current_op->addr, bytes_to_copy))) {
+					status = -EFAULT;
+					goto error_exit;
+				}
+			}
+			dma_dev->dma_from_logic_copy_ns += ktime_get_ns() - copy_start;
+			dma_dev->dma_from_logic_copy_bytes += bytes_to_copy;
+			if (kbuf)
+				kbuf += bytes_to_copy;
+			else
+				buf += bytes_to_copy;
+			bytes_copied += bytes_to_copy;
+			count -= bytes_to_copy;
+			current_op->size -= bytes_to_copy;
+			if (current_op->size != 0) {
+				/* No more room in user buffer */
+				current_op->addr += bytes_to_copy;
+				break;
+			} else {
+				dma_dev->dma_from_logic_tail = current_op->next_tail;
+				dma_dev->dma_from_logic_full = false;
+				pr_debug("%s: move tail %u\n", __func__,
+					dma_dev->dma_from_logic_tail);
+				/* We moved the tail up, so submit more work to logic */
+				results_avail = datra_dma_from_logic_pump(dma_dev);
+				if (current_op->short_transfer)
+					break; /* Usersignal change, return immediately */
+			}
+		}
+	}
+exit_ok:
+	status = bytes_copied;
+error_exit:
+	return status;
+error_interrupted:
+	if (is_blocking)
+		finish_wait(&dma_dev->wait_queue_from_logic, &wait);
+	return -ERESTARTSYS;
+}
+
+static ssize_t datra_dma_write(struct file *filp, const char __user *buf,
+	size_t count, loff_t *f_pos)
+{
+	struct datra_dma_dev *dma_dev = filp->private_data;
+	ssize_t status;
+
+	status = datra_dma_write_user(filp, buf, count, f_pos);
+	trace_datra_dma_write(datra_dma_get_index(dma_dev), 0, count, status,
+		kfifo_len(&dma_dev->dma_to_logic_wip));
+	return status;
+}
+
+static ssize_t datra_dma_read(struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+	struct datra_dma_dev *dma_dev = filp->private_data;
+	ssize_t status;
+
+	status = datra_dma_read_common(dma_dev, buf, NULL, count,
+			(filp->f_flags & O_NONBLOCK) == 0);
+	if (status > 0)
+		*f_pos += status;
+	trace_datra_dma_read(datra_dma_get_index(dma_dev), 0, count, status,
+		dma_dev->dma_from_logic_current_op.size);
+	return status;
+}
+
+#ifdef DATRA_HAVE_SPLICE
+/* Pages handed to the pipe are private copies, so the generic page
+ * reference counting helpers suffice. */
+static const struct pipe_buf_operations datra_dma_pipe_buf_ops = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 1, 0)
+	.can_merge = 0,
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+	.confirm = generic_pipe_buf_confirm,
+	.steal = generic_pipe_buf_steal,
+#else
+	.try_steal = generic_pipe_buf_try_steal,
+#endif
+	.release = generic_pipe_buf_release,
+	.get = generic_pipe_buf_get,
+};
+
+static unsigned int datra_pipe_free_slots(struct pipe_inode_info *pipe)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+	unsigned int used = pipe_occupancy(pipe->head, pipe->tail);
+
+	return (used < pipe->max_usage) ? pipe->max_usage - used : 0;
+#else
+	return pipe->buffers - pipe->nrbufs;
+#endif
+}
+
+/* Move data from logic into a pipe. Only blocks for the first page, after
+ * that it returns whatever is available, like a regular read would. The
+ * caller holds the pipe lock. */
+static ssize_t datra_dma_splice_read(struct file *filp, loff_t *ppos,
+	struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct datra_dma_dev *dma_dev = filp->private_data;
+	const bool is_blocking = !(filp->f_flags & O_NONBLOCK) &&
+		!(flags & SPLICE_F_NONBLOCK);
+	unsigned int slots = datra_pipe_free_slots(pipe);
+	ssize_t total = 0;
+	ssize_t ret;
+
+	pr_debug("%s(%u) slots=%u\n", __func__, (unsigned int)len, slots);
+
+	if (!slots)
+		return -EAGAIN;
+
+	while (len >= 4 && slots) {
+		struct pipe_buffer buf = { .ops = &datra_dma_pipe_buf_ops };
+		struct page *page = alloc_page(GFP_KERNEL);
+
+		if (!page) {
+			ret = -ENOMEM;
+			goto error;
+		}
+		ret = datra_dma_read_common(dma_dev, NULL, page_address(page),
+				min_t(size_t, len, PAGE_SIZE),
+				is_blocking && !total);
+		if (ret <= 0) {
+			put_page(page);
+			goto error;
+		}
+		buf.page = page;
+		buf.len = ret;
+		/* Releases the page on failure */
+		ret = add_to_pipe(pipe, &buf);
+		if (ret < 0)
+			goto error;
+		total += ret;
+		len -= ret;
+		--slots;
+	}
+	*ppos += total;
+	return total;
+
+error:
+	/* Report partial success, the error will come again next call */
+	if (total) {
+		*ppos += total;
+		return total;
+	}
+	return ret;
+}
+
+/* Pipe buffers need not hold whole words. A tail of 1-3 bytes is kept
+ * in the residue until the next buffer completes the word. */
+static int datra_dma_splice_write_actor(struct pipe_inode_info *pipe,
+	struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct file *filp = sd->u.file;
+	struct datra_dma_dev *dma_dev = filp->private_data;
+	const bool is_blocking = !(filp->f_flags & O_NONBLOCK) &&
+		!(sd->flags & SPLICE_F_NONBLOCK);
+	u8 *residue = (u8 *)&dma_dev->dma_to_logic_splice_residue;
+	unsigned int residue_len = dma_dev->dma_to_logic_splice_residue_len;
+	size_t done = 0;
+	size_t words;
+	char *data;
+	ssize_t ret = 0;
+
+	data = kmap(buf->page) + buf->offset;
+	if (residue_len) {
+		done = min_t(size_t, sd->len, 4 - residue_len);
+		memcpy(residue + residue_len, data, done);
+		if (residue_len + done < 4) {
+			dma_dev->dma_to_logic_splice_residue_len = residue_len + done;
+			goto out;
+		}
+		ret = datra_dma_write_common(dma_dev, NULL, (const char *)residue,
+				4, is_blocking);
+		if (ret < 0) {
+			done = 0;
+			goto out;
+		}
+		dma_dev->dma_to_logic_splice_residue_len = 0;
+	}
+	words = (sd->len - done) & ~3;
+	if (words) {
+		ret = datra_dma_write_common(dma_dev, NULL, data + done,
+				words, is_blocking);
+		if (ret < 0)
+			goto out;
+		done += ret;
+		if ((size_t)ret < words)
+			goto out; /* The rest comes in the next call */
+	}
+	if (sd->len > done) {
+		memcpy(residue, data + done, sd->len - done);
+		dma_dev->dma_to_logic_splice_residue_len = sd->len - done;
+		done = sd->len;
+	}
+out:
+	kunmap(buf->page);
+
+	return done ? done : ret;
+}
+
+/* Move data from a pipe to logic. Each pipe buffer is copied into the
+ * ring and sent out as one or more DMA transfers. In byte mode, bytes
+ * left over at the end are sent like a write() would. */
+static ssize_t datra_dma_splice_write(struct pipe_inode_info *pipe,
+	struct file *filp, loff_t *ppos, size_t len, unsigned int flags)
+{
+	struct datra_dma_dev *dma_dev = filp->private_data;
+	const bool is_blocking = !(filp->f_flags & O_NONBLOCK) &&
+		!(flags & SPLICE_F_NONBLOCK);
+	ssize_t ret;
+
+	pr_debug("%s(%u)\n", __func__, (unsigned int)len);
+
+	ret = splice_from_pipe(pipe, filp, ppos, len, flags,
+			datra_dma_splice_write_actor);
+	if (ret > 0 && dma_dev->dma_to_logic_byte_mode &&
+	    dma_dev->dma_to_logic_splice_residue_len) {
+		/* BYTES1..3 equal the number of valid bytes. On failure,
+		 * the bytes stay until the next splice. */
+		if (!datra_dma_write_signalled(dma_dev,
+				dma_dev->dma_to_logic_splice_residue,
+				dma_dev->dma_to_logic_splice_residue_len, is_blocking))
+			dma_dev->dma_to_logic_splice_residue_len = 0;
+	}
+	return ret;
+}
+#endif /* DATRA_HAVE_SPLICE */
+
+static unsigned int datra_dma_to_logic_poll(struct file *filp, poll_table *wait)
+{
+	struct datra_dma_dev *dma_dev = filp->private_data;
+	u32 __iomem *control_base = dma_dev->config_parent->control_base;
+	unsigned int mask = 0;
+	unsigned int avail;
+
+	poll_wait(filp, &dma_dev->wait_queue_to_logic, wait);
+
+	if (dma_dev->dma_to_logic_blocks.blocks) {
+		/* Writable when not all blocks have been submitted, or when
+		 * results are available and can be dequeued */
+		avail = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_STATUS);
+		if ((avail & 0xFF000000) == 0) {
+			/* No results yet, see if there are blocks available */
+			avail = ((avail >> 16) & 0xFF) + dma_dev->dma_to_logic_blocks.count - DMA_MAX_NUMBER_OF_COMMANDS;
+		}
+	} else
+		avail = datra_dma_to_logic_avail(dma_dev);
+	if (avail)
+		mask |= (POLLOUT | POLLWRNORM);
+	else
+		datra_dma_to_logic_irq_enable(control_base);
+
+	pr_debug("%s(%#x) -> %#x\n", __func__, avail, mask);
+	return mask;
+}
+
+static unsigned int datra_dma_from_logic_poll(struct file *filp, poll_table *wait)
+{
+	struct datra_dma_dev *dma_dev = filp->private_data;
+	u32 __iomem *control_base = dma_dev->config_parent->control_base;
+	unsigned int mask = 0;
+	unsigned int avail;
+
+	poll_wait(filp, &dma_dev->wait_queue_from_logic, wait);
+
+	if (dma_dev->dma_from_logic_blocks.blocks) {
+		avail = datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_STATUS);
+		pr_debug("%s(status=%#x)\n", __func__, avail);
+		avail &= 0xFF000000;
+	} else {
+		if (datra_dma_from_logic_ring_alloc(dma_dev))
+			return POLLERR;
+		if (dma_dev->dma_from_logic_current_op.size)
+			avail = 1;
+		else
+			avail = datra_dma_from_logic_pump(dma_dev);
+	}
+	if (avail)
+		mask |= (POLLIN | POLLRDNORM);
+	else
+		datra_dma_from_logic_irq_enable(control_base);
+
+	pr_debug("%s(%x) -> %#x\n", __func__, avail, mask);
+	return mask;
+}
+
+static int datra_dma_add_route(struct datra_dma_dev *dma_dev, int source, int dest)
+{
+	struct datra_route_item_t route;
+	route.srcFifo = (source >> 8) & 0xFF;
+	route.srcNode = source & 0xFF;
+	route.dstFifo = (dest >> 8) & 0xFF;
+	route.dstNode = dest & 0xFF;
+	datra_ctl_route_add(dma_dev->config_parent->parent, route);
+	return 0;
+}
+
+static int datra_dma_get_route_id(struct datra_dma_dev *dma_dev)
+{
+	/* Only one fifo, so upper 8 bits are always 0 */
+	return datra_dma_get_index(dma_dev);
+}
+
+/* Release pooled blocks until the pool is within "limit" bytes. Oldest
+ * blocks go first. Caller must hold block_pool_lock. */
+static void datra_dma_pool_trim(struct datra_dma_dev *dma_dev, size_t limit)
+{
+	struct device *device = dma_dev->config_parent->parent->device;
+	struct datra_dma_pool_block *entry;
+
+	while (dma_dev->block_pool_usage > limit) {
+		entry = list_last_entry(&dma_dev->block_pool,
+			struct datra_dma_pool_block, list);
+		list_del(&entry->list);
+		dma_dev->block_pool_usage -= entry->size;
+		dma_free_coherent(device, entry->size,
+			entry->mem_addr, entry->phys_addr);
+		kfree(entry);
+	}
+}
+
+/* Take a block of exactly "size" bytes from the pool, NULL if none */
+static void *datra_dma_pool_get(struct datra_dma_dev *dma_dev, u32 size,
+	dma_addr_t *phys_addr)
+{
+	struct datra_dma_pool_block *entry;
+	void *mem_addr = NULL;
+
+	mutex_lock(&dma_dev->block_pool_lock);
+	list_for_each_entry(entry, &dma_dev->block_pool, list) {
+		if (entry->size == size) {
+			list_del(&entry->list);
+			dma_dev->block_pool_usage -= size;
+			mem_addr = entry->mem_addr;
+			*phys_addr = entry->phys_addr;
+			kfree(entry);
+			break;
+		}
+	}
+	mutex_unlock(&dma_dev->block_pool_lock);
+
+	/* Don't leak the previous owner's data, like a fresh allocation */
+	if (mem_addr)
+		memset(mem_addr, 0, size);
+
+	return mem_addr;
+}
+
+/* Hand a block to the pool, or free it if the pool cannot hold it */
+static void datra_dma_pool_put(struct datra_dma_dev *dma_dev, void *mem_addr,
+	dma_addr_t phys_addr, u32 size)
+{
+	struct datra_dma_pool_block *entry = NULL;
+
+	mutex_lock(&dma_dev->block_pool_lock);
+	if (size <= dma_dev->block_pool_limit)
+		entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+	if (entry) {
+		datra_dma_pool_trim(dma_dev, dma_dev->block_pool_limit - size);
+		entry->mem_addr = mem_addr;
+		entry->phys_addr = phys_addr;
+		entry->size = size;
+		list_add(&entry->list, &dma_dev->block_pool);
+		dma_dev->block_pool_usage += size;
+	}
+	mutex_unlock(&dma_dev->block_pool_lock);
+
+	if (!entry)
+		dma_free_coherent(dma_dev->config_parent->parent->device,
+			size, mem_addr, phys_addr);
+}
+
+static void datra_dma_common_block_free_coherent(struct datra_dma_dev *dma_dev,
+	struct datra_dma_block_set* dma_block_set,
+	enum dma_data_direction direction)
+{
+	u32 i;
+
+	for (i = 0; i < dma_block_set->count; ++i) {
+		struct datra_dma_block *block = &dma_block_set->blocks[i];
+		if (block->mem_addr)
+			datra_dma_pool_put(dma_dev, block->mem_addr,
+				block->phys_addr, block->data.size);
+	}
+}
+
+/* forward */
+static void datra_dma_common_block_free_imported(struct datra_dma_block_set* dma_block_set,
+	enum dma_data_direction direction);
+#ifdef DATRA_HAVE_USERPTR
+static void datra_dma_common_block_free_userptr(struct device *device,
+	struct datra_dma_block_set* dma_block_set,
+	enum dma_data_direction direction);
+#endif
+
+static int datra_dma_common_block_free(struct datra_dma_dev *dma_dev,
+	struct datra_dma_block_set* dma_block_set,
+	enum dma_data_direction direction)
+{
+	if (dma_block_set->flags & DATRA_DMA_BLOCK_FLAG_IMPORTED)
+		datra_dma_common_block_free_imported(dma_block_set, direction);
+#ifdef DATRA_HAVE_USERPTR
+	else if (dma_block_set->flags & DATRA_DMA_BLOCK_FLAG_USERPTR)
+		datra_dma_common_block_free_userptr(dma_dev->config_parent->parent->device,
+			dma_block_set, direction);
+#endif
+	else if (!(dma_block_set->flags & DATRA_DMA_BLOCK_FLAG_SHAREDMEM)) {
+		datra_dma_common_block_free_coherent(dma_dev, dma_block_set, direction);
+	}
+	kfree(dma_block_set->blocks);
+	dma_block_set->blocks = NULL;
+	dma_block_set->count = 0;
+	dma_block_set->size = 0;
+	dma_block_set->flags = 0;
+	return 0;
+}
+
+static int datra_dma_to_logic_block_free(struct datra_dma_dev *dma_dev)
+{
+	/* Exported blocks may be in use elsewhere, they must stay */
+	if (atomic_read(&dma_dev->dma_to_logic_blocks.exports))
+		return -EBUSY;
+	/* Reset the device to release all resources */
+	datra_dma_to_logic_reset(dma_dev);
+	return datra_dma_common_block_free(dma_dev, &dma_dev->dma_to_logic_blocks, DMA_TO_DEVICE);
+}
+
+static int datra_dma_common_block_alloc_one_coherent(
+	struct datra_dma_dev *dma_dev,
+	struct datra_dma_block *block,
+	enum dma_data_direction direction)
+{
+	struct datra_dev *dev = dma_dev->config_parent->parent;
+
+	block->mem_addr = datra_dma_pool_get(dma_dev, block->data.size,
+		&block->phys_addr);
+	if (block->mem_addr)
+		return 0;
+
+	block->mem_addr = dma_alloc_coherent(dev->device,
+		block->data.size, &block->phys_addr, GFP_KERNEL);
+	if (!block->mem_addr)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static int datra_dma_common_block_alloc(struct datra_dma_dev *dma_dev,
+	struct datra_dma_configuration_req *request,
+	struct datra_dma_block_set* dma_block_set,
+	enum dma_data_direction direction)
+{
+	struct datra_dma_block *block;
+	u32 i;
+	int ret;
+
+	pr_debug("%s mode=%u count=%u size=%u\n", __func__,
+		request->mode, request->count, request->size);
+
+	if (!request->size || !request->count)
+		return -EINVAL;
+	request->size = PAGE_ALIGN(request->size);
+#ifdef DATRA_HAVE_HUGEPAGE
+	if (request->mode & DATRA_DMA_MODE_FLAG_HUGEPAGE)
+		request->size = ALIGN(request->size, PMD_SIZE);
+#else
+	request->mode &= ~DATRA_DMA_MODE_FLAG_HUGEPAGE;
+#endif
+	/* Pointless to use more */
+	if (request->count > DMA_MAX_NUMBER_OF_COMMANDS)
+		request->count = DMA_MAX_NUMBER_OF_COMMANDS;
+	block = kcalloc_node(request->count, sizeof(*block), GFP_KERNEL,
+		dev_to_node(dma_dev->config_parent->parent->device));
+	if (!block)
+		return -ENOMEM;
+	dma_block_set->blocks = block;
+	dma_block_set->size = request->size;
+	dma_block_set->count = request->count;
+	dma_block_set->flags = DATRA_DMA_BLOCK_FLAG_COHERENT;
+	if (request->mode & DATRA_DMA_MODE_FLAG_HUGEPAGE) {
+		/* Each block must be mapped separately */
+		dma_block_set->flags |= DATRA_DMA_BLOCK_FLAG_HUGEPAGE;
+		goto alloc_blocks;
+	}
+	/* The pre-allocated buffers are coherent, so if the blocks fit
+		* in there, we can just re-use the already allocated one */
+	if (direction == DMA_FROM_DEVICE) {
+		if (request->count * request->size <= dma_dev->dma_from_logic_memory_size &&
+		    !dma_dev->dma_from_logic_streaming &&
+		    !datra_dma_from_logic_ring_alloc(dma_dev)) {
+			dma_block_set->flags |= DATRA_DMA_BLOCK_FLAG_SHAREDMEM;
+			for (i = 0; i < request->count; ++i, ++block) {
+				block->data.id = i;
+				block->data.size = request->size;
+				block->data.offset = i * request->size;
+				block->mem_addr = ((char*)dma_dev->dma_from_logic_memory) + block->data.offset;
+				block->phys_addr = dma_dev->dma_from_logic_handle + block->data.offset;
+			}
+			return 0;
+		}
+	} else {
+		if (request->count * request->size <= dma_dev->dma_to_logic_memory_size &&
+		    !dma_dev->dma_to_logic_streaming &&
+		    !datra_dma_to_logic_ring_alloc(dma_dev)) {
+			dma_block_set->flags |= DATRA_DMA_BLOCK_FLAG_SHAREDMEM;
+			for (i = 0; i < request->count; ++i, ++block) {
+				block->data.id = i;
+				block->data.size = request->size;
+				block->data.offset = i * request->size;
+				block->mem_addr = ((char*)dma_dev->dma_to_logic_memory) + block->data.offset;
+				block->phys_addr = dma_dev->dma_to_logic_handle + block->data.offset;
+			}
+			return 0;
+		}
+	}
+alloc_blocks:
+	for (i = 0; i < request->count; ++i, ++block) {
+		block->data.id = i;
+		block->data.size = request->size;
+		block->data.offset = i * request->size;
+		ret = datra_dma_common_block_alloc_one_coherent(dma_dev, block, direction);
+		if (unlikely(ret)) {
+			datra_dma_common_block_free(dma_dev, dma_block_set, direction);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/* For backward compatibility */
+static int datra_dma_to_logic_block_alloc(struct datra_dma_dev *dma_dev,
+	struct datra_buffer_block_alloc_req __user *arg)
+{
+	struct datra_buffer_block_alloc_req request;
+	struct datra_dma_configuration_req r;
+	int ret;
+
+	if (copy_from_user(&request, arg, sizeof(request)))
+		return -EFAULT;
+	r.mode = DATRA_DMA_MODE_BLOCK_COHERENT;
+	r.size = request.size;
+	r.count = request.count;
+
+	ret = datra_dma_to_logic_block_free(dma_dev);
+	if (ret)
+		return ret;
+	ret = datra_dma_common_block_alloc(dma_dev, &r, &dma_dev->dma_to_logic_blocks, DMA_TO_DEVICE);
+	if (ret)
+		return ret;
+
+	request.size = r.size;
+	request.count = r.count;
+	if (copy_to_user(arg, &request, sizeof(request)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int datra_dma_to_logic_block_query(struct datra_dma_dev *dma_dev,
+	struct datra_buffer_block __user *arg)
+{
+	__u32 request_id;
+
+	if (get_user(request_id, &arg->id))
+		return -EFAULT;
+
+	if (request_id >= dma_dev->dma_to_logic_blocks.count)
+		return -EINVAL;
+
+	if (copy_to_user(arg, &dma_dev->dma_to_logic_blocks.blocks[request_id].data, sizeof(struct datra_buffer_block)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* Registered user memory is cachable, so ownership must be passed
+ * explicitly between CPU and logic for every transfer. */
+static void datra_dma_block_sync_for_device(struct datra_dma_block *block,
+	enum dma_data_direction direction)
+{
+#ifdef DATRA_HAVE_USERPTR
+	if (block->userptr_sgt.sgl)
+		dma_sync_sgtable_for_device(
+			block->parent->config_parent->parent->device,
+			&block->userptr_sgt, direction);
+#endif
+}
+
+static void datra_dma_block_sync_for_cpu(struct datra_dma_block *block,
+	enum dma_data_direction direction)
+{
+#ifdef DATRA_HAVE_USERPTR
+	if (block->userptr_sgt.sgl)
+		dma_sync_sgtable_for_cpu(
+			block->parent->config_parent->parent->device,
+			&block->userptr_sgt, direction);
+#endif
+}
+
+/* Fill in the timestamps of a DATRA_IOCDMABLOCK_DEQUEUE_TS request */
+static int datra_dma_block_put_timestamps(struct datra_dma_block *block,
+	struct datra_buffer_block __user *arg)
+{
+	/* The plain block is the first member */
+	struct datra_buffer_block_ts __user *ts =
+		(struct datra_buffer_block_ts __user *)arg;
+
+	if (put_user(block->submit_ns, &ts->submit_ns) ||
+	    put_user(block->complete_ns, &ts->complete_ns))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int datra_dma_to_logic_block_enqueue(struct datra_dma_dev *dma_dev,
+	struct datra_buffer_block __user *arg)
+{
+	struct datra_buffer_block request;
+	struct datra_dma_block *block;
+	u32 __iomem *control_base = dma_dev->config_parent->control_base;
+
+	if (copy_from_user(&request, arg, sizeof(request)))
+		return -EFAULT;
+
+	if (request.id >= dma_dev->dma_to_logic_blocks.count)
+		return -EINVAL;
+
+	block = &dma_dev->dma_to_logic_blocks.blocks[request.id];
+	if (block->data.state)
+		return -EBUSY;
+
+	block->data.bytes_used = request.bytes_used;
+	block->data.user_signal = request.user_signal;
+
+	/* This operation never blocks, unless something is wrong in HW */
+	if (!(datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_STATUS) & 0xFF0000))
+		return -EWOULDBLOCK;
+	datra_dma_block_sync_for_device(block, DMA_TO_DEVICE);
+	pr_debug("%s sending addr=%#llx size=%u\n", __func__,
+			(u64)block->phys_addr, block->data.bytes_used);
+	iowrite32_quick(block->phys_addr & 0xFFFFFFFF, control_base + (DATRA_DMA_TOLOGIC_STARTADDR_LOW>>2));
+	if (dma_dev->dma_64bit)
+		iowrite32_quick(block->phys_addr >> 32, control_base + (DATRA_DMA_TOLOGIC_STARTADDR_HIGH>>2));
+	iowrite32_quick(block->data.user_signal, control_base + (DATRA_DMA_TOLOGIC_USERBITS>>2));
+	iowrite32(block->data.bytes_used, control_base + (DATRA_DMA_TOLOGIC_BYTESIZE>>2));
+	datra_dma_count(&dma_dev->stats_to_logic, block->data.bytes_used,
+		block->data.bytes_used != block->data.size);
+	block->submit_ns = datra_dma_latency_submit(&dma_dev->latency_to_logic);
+	trace_datra_dma_block_enqueue(datra_dma_get_index(dma_dev), true,
+		block->data.id, block->data.bytes_used);
+	block->data.state = 1;
+
+	if (copy_to_user(arg, &block->data, sizeof(struct datra_buffer_block)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int datra_dma_to_logic_block_dequeue(struct datra_dma_dev *dma_dev,
+	struct datra_buffer_block __user *arg, bool is_blocking,
+	bool with_timestamps)
+{
+	struct datra_buffer_block request;
+	struct datra_dma_block *block;
+	u32 __iomem *control_base = dma_dev->config_parent->control_base;
+	u32 status;
+	dma_addr_t start_addr;
+
+	if (copy_from_user(&request, arg, sizeof(request)))
+		return -EFAULT;
+
+	if (request.id >= dma_dev->dma_to_logic_blocks.count)
+		return -EINVAL;
+
+	block = &dma_dev->dma_to_logic_blocks.blocks[request.id];
+	if (!block->data.state)
+		return -EINVAL;
+
+	if (is_blocking) {
+		DEFINE_WAIT(wait);
+		for (;;) {
+			prepare_to_wait(&dma_dev->wait_queue_to_logic, &wait, TASK_INTERRUPTIBLE);
+			status = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_STATUS);
+			if (status & 0xFF000000)
+				break; /* Results available, done waiting */
+			if (signal_pending(current)) {
+				finish_wait(&dma_dev->wait_queue_from_logic, &wait);
+				return -ERESTARTSYS;
+			}
+			/* Enable interrupt */
+			datra_dma_to_logic_irq_enable(control_base);
+			atomic64_inc(&dma_dev->stats_to_logic.blocked);
+			schedule();
 		}
-		if (is_blocking)
-			finish_wait(&dma_dev->wait_queue_to_logic, &wait);
-		pr_debug("%s sending addr=%#x size=%u\n", __func__,
-			(unsigned int)dma_op.addr, dma_op.size);
-		iowrite32_quick(dma_op.addr & 0xFFFFFFFF, control_base + (DATRA_DMA_TOLOGIC_STARTADDR_LOW>>2));
-		if (dma_dev->dma_64bit)
-			iowrite32_quick(dma_op.addr >> 32, control_base + (DATRA_DMA_TOLOGIC_STARTADDR_HIGH>>2));
-		iowrite32(dma_op.size, control_base + (DATRA_DMA_TOLOGIC_BYTESIZE>>2));
-		if (unlikely(kfifo_put(&dma_dev->dma_to_logic_wip, dma_op) == 0)) {
-			pr_err("dma_to_logic_wip kfifo was full, cannot put %#x %u\n",
-				(u32)dma_op.addr, dma_op.size);
-			BUG();
+		finish_wait(&dma_dev->wait_queue_from_logic, &wait);
+	} else {
+		status = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_STATUS);
+		if ((status & 0xFF000000) == 0) {
+			atomic64_inc(&dma_dev->stats_to_logic.eagain);
+			return -EAGAIN;
 		}
+	}
+	start_addr = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_RESULT_ADDR_LOW);
+	if (dma_dev->dma_64bit)
+		start_addr |= ((dma_addr_t)datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_RESULT_ADDR_HIGH) << 32);
 
-		/* Update pointers for next chunk, if any */
-		dma_dev->dma_to_logic_head += round_up_to_cacheline(bytes_to_copy);
-		if (dma_dev->dma_to_logic_head == dma_dev->dma_to_logic_memory_size)
-			dma_dev->dma_to_logic_head = 0;
-		pr_debug("%s head=%u\n", __func__, dma_dev->dma_to_logic_head);
-		BUG_ON(dma_dev->dma_to_logic_head > dma_dev->dma_to_logic_memory_size);
-		buf += bytes_to_copy;
-		bytes_copied += bytes_to_copy;
-		count -= bytes_to_copy;
+	if (start_addr != block->phys_addr) {
+		pr_err("%s Expected addr 0x%llx result 0x%llx\n", __func__, (u64)block->phys_addr, (u64)start_addr);
+		return -EIO;
 	}
-exit_ok:
-	status = bytes_copied;
-	*f_pos += bytes_copied;
-error_exit:
-	pr_debug("%s -> %d\n", __func__, status);
-	return status;
+	datra_dma_block_sync_for_cpu(block, DMA_TO_DEVICE);
+	trace_datra_dma_block_dequeue(datra_dma_get_index(dma_dev), true,
+		block->data.id, block->data.bytes_used);
+	block->complete_ns = datra_dma_latency_complete(&dma_dev->latency_to_logic);
 
-error_interrupted:
-	if (is_blocking)
-		finish_wait(&dma_dev->wait_queue_to_logic, &wait);
-	pr_debug("%s -> ERESTARTSYS\n", __func__);
-	return -ERESTARTSYS;
+	block->data.state = 0;
+
+	if (copy_to_user(arg, &block->data, sizeof(struct datra_buffer_block)))
+		return -EFAULT;
+	if (with_timestamps)
+		return datra_dma_block_put_timestamps(block, arg);
+
+	return 0;
 }
 
-/* Adds new read commands to the queue and returns number of results */
-static unsigned int datra_dma_from_logic_pump(struct datra_dma_dev *dma_dev)
+#ifdef DATRA_HAVE_HUGEPAGE
+/* Memory behind a huge page mapping. Reference counted, since the VMA can
+ * be duplicated or split. */
+struct datra_dma_huge_map {
+	struct kref ref;
+	unsigned long pfn;
+	size_t size;
+};
+
+static void datra_dma_huge_map_release(struct kref *ref)
 {
-	u32 __iomem *control_base = dma_dev->config_parent->control_base;
-	u32 status_reg;
-	u8 num_free_entries;
+	kfree(container_of(ref, struct datra_dma_huge_map, ref));
+}
 
-	status_reg = datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_STATUS);
-	pr_debug("%s status=%#x\n", __func__, status_reg);
-	num_free_entries = (status_reg >> 16) & 0xFF;
+static void datra_dma_huge_vm_open(struct vm_area_struct *vma)
+{
+	struct datra_dma_huge_map *map = vma->vm_private_data;
 
-	while (!dma_dev->dma_from_logic_full) {
-		if (!num_free_entries)
-			break; /* No more room for commands */
-		pr_debug("%s sending addr=0x%llx size=%u\n", __func__,
-			(u64)dma_dev->dma_from_logic_handle + dma_dev->dma_from_logic_head, dma_dev->dma_from_logic_block_size);
-		iowrite32((dma_dev->dma_from_logic_handle + dma_dev->dma_from_logic_head) & 0xFFFFFFFF, control_base + (DATRA_DMA_FROMLOGIC_STARTADDR_LOW>>2));
-		if (dma_dev->dma_64bit)
-			iowrite32((dma_dev->dma_from_logic_handle + dma_dev->dma_from_logic_head) >> 32, control_base + (DATRA_DMA_FROMLOGIC_STARTADDR_HIGH>>2));
-		iowrite32(dma_dev->dma_from_logic_block_size, control_base + (DATRA_DMA_FROMLOGIC_BYTESIZE>>2));
-		dma_dev->dma_from_logic_head += dma_dev->dma_from_logic_block_size;
-		if (dma_dev->dma_from_logic_head == dma_dev->dma_from_logic_memory_size)
-			dma_dev->dma_from_logic_head = 0;
-		if (dma_dev->dma_from_logic_head == dma_dev->dma_from_logic_tail)
-			dma_dev->dma_from_logic_full = true;
-		--num_free_entries;
+	kref_get(&map->ref);
+}
+
+static void datra_dma_huge_vm_close(struct vm_area_struct *vma)
+{
+	struct datra_dma_huge_map *map = vma->vm_private_data;
+
+	kref_put(&map->ref, datra_dma_huge_map_release);
+}
+
+/* Regular page fault, for parts that cannot be mapped with a huge page */
+static vm_fault_t datra_dma_huge_vm_fault(struct vm_fault *vmf)
+{
+	struct datra_dma_huge_map *map = vmf->vma->vm_private_data;
+
+	if ((vmf->pgoff << PAGE_SHIFT) >= map->size)
+		return VM_FAULT_SIGBUS;
+
+	return vmf_insert_pfn(vmf->vma, vmf->address, map->pfn + vmf->pgoff);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+static vm_fault_t datra_dma_huge_vm_huge_fault(struct vm_fault *vmf,
+	unsigned int order)
+#else
+static vm_fault_t datra_dma_huge_vm_huge_fault(struct vm_fault *vmf,
+	enum page_entry_size pe_size)
+#endif
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct datra_dma_huge_map *map = vma->vm_private_data;
+	unsigned long address = vmf->address & PMD_MASK;
+	pgoff_t pgoff = vmf->pgoff - ((vmf->address - address) >> PAGE_SHIFT);
+	unsigned long pfn = map->pfn + pgoff;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+	if (order != PMD_ORDER)
+#else
+	if (pe_size != PE_SIZE_PMD)
+#endif
+		return VM_FAULT_FALLBACK;
+	/* The whole huge page must be inside both the VMA and the block, and
+	 * the physical memory must be aligned like the virtual address. */
+	if (address < vma->vm_start || address + PMD_SIZE > vma->vm_end ||
+	    (pgoff << PAGE_SHIFT) + PMD_SIZE > map->size ||
+	    !IS_ALIGNED(pfn, PMD_SIZE >> PAGE_SHIFT))
+		return VM_FAULT_FALLBACK;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+	return vmf_insert_pfn_pmd(vmf, pfn, vmf->flags & FAULT_FLAG_WRITE);
+#else
+	return vmf_insert_pfn_pmd(vmf, __pfn_to_pfn_t(pfn, PFN_DEV),
+		vmf->flags & FAULT_FLAG_WRITE);
+#endif
+}
+
+static const struct vm_operations_struct datra_dma_huge_vm_ops = {
+	.open = datra_dma_huge_vm_open,
+	.close = datra_dma_huge_vm_close,
+	.fault = datra_dma_huge_vm_fault,
+	.huge_fault = datra_dma_huge_vm_huge_fault,
+};
+
+/* Set up a VMA that maps the block on demand, using PMD mappings where
+ * alignment permits. Returns false if the block cannot be mapped this way,
+ * in which case the caller should fall back to dma_mmap_coherent. */
+static bool datra_dma_huge_mmap(struct device *device,
+	struct vm_area_struct *vma, struct datra_dma_block *block)
+{
+	struct datra_dma_huge_map *map;
+	struct sg_table sgt;
+	unsigned long pfn;
+	int ret;
+
+	/* Inserting pfns into private writable mappings is not possible */
+	if (!(vma->vm_flags & VM_SHARED) && (vma->vm_flags & VM_MAYWRITE))
+		return false;
+
+	/* Need the pfn of physically contiguous memory that is backed by
+	 * struct pages, which is not the case behind an IOMMU or for
+	 * "no-map" reserved memory. */
+	ret = dma_get_sgtable(device, &sgt, block->mem_addr,
+		block->phys_addr, block->data.size);
+	if (ret < 0)
+		return false;
+	if (sgt.orig_nents != 1) {
+		sg_free_table(&sgt);
+		return false;
 	}
+	pfn = page_to_pfn(sg_page(sgt.sgl));
+	sg_free_table(&sgt);
+	if (!pfn_valid(pfn))
+		return false;
+
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return false;
+	kref_init(&map->ref);
+	map->pfn = pfn;
+	map->size = block->data.size;
+
+	/* Same attributes as the kernel mapping of the coherent memory */
+	if (!dev_is_dma_coherent(device))
+		vma->vm_page_prot = pgprot_dmacoherent(vma->vm_page_prot);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_set(vma, VM_PFNMAP | VM_HUGEPAGE);
+#else
+	vma->vm_flags |= VM_PFNMAP | VM_HUGEPAGE;
+#endif
+	vma->vm_ops = &datra_dma_huge_vm_ops;
+	vma->vm_private_data = map;
 
-	return status_reg >> 24;
+	return true;
 }
+#endif /* DATRA_HAVE_HUGEPAGE */
 
-static ssize_t datra_dma_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+static int datra_dma_common_mmap(struct datra_dma_dev *dma_dev,
+	struct vm_area_struct *vma,
+	struct datra_dma_block_set* dma_block_set)
 {
-	struct datra_dma_dev *dma_dev = filp->private_data;
-	u32 __iomem *control_base = dma_dev->config_parent->control_base;
-	int status = 0;
-	unsigned int bytes_to_copy;
-	unsigned int bytes_copied = 0;
-	unsigned int results_avail = 0;
-	unsigned int tail;
-	struct datra_dma_from_logic_operation *current_op =
-		&dma_dev->dma_from_logic_current_op;
-	DEFINE_WAIT(wait);
-	const bool is_blocking = (filp->f_flags & O_NONBLOCK) == 0;
+	const unsigned int count = dma_block_set->count;
+	struct datra_dma_block *block = NULL;
+	unsigned int vm_offset = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned int i;
 
-	pr_debug("%s(%u)\n", __func__, (unsigned int)count);
+	pr_debug("%s offset=%u\n", __func__, vm_offset);
 
-	if (count < 4) /* Do not allow read or write below word size */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+
+	/* Only memory the driver allocated itself can be mapped here */
+	if (dma_block_set->flags & (DATRA_DMA_BLOCK_FLAG_IMPORTED | DATRA_DMA_BLOCK_FLAG_USERPTR))
 		return -EINVAL;
-	count &= ~0x03;
 
-	if (dma_dev->dma_from_logic_blocks.blocks)
-		return -EBUSY;
+	if (dma_block_set->flags & DATRA_DMA_BLOCK_FLAG_SHAREDMEM) {
+		block = &dma_block_set->blocks[0];
+		return dma_mmap_coherent(dma_dev->config_parent->parent->device,
+			vma, block->mem_addr, block->phys_addr,
+			(u64)dma_block_set->size * dma_block_set->count);
+	}
 
-	while (count) {
-		while (current_op->size == 0) {
-			/* Fetch a new operation from logic */
-			if (results_avail) {
-				dma_addr_t start_addr = datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_RESULT_ADDR_LOW);
-				if (dma_dev->dma_64bit)
-					start_addr |= ((dma_addr_t)datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_RESULT_ADDR_HIGH) << 32);
-				tail = start_addr - dma_dev->dma_from_logic_handle;
-				current_op->addr = ((char*)dma_dev->dma_from_logic_memory) + tail;
-				current_op->user_signal = datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_RESULT_USERBITS);
-				current_op->size = datra_reg_read(control_base, DATRA_DMA_FROMLOGIC_RESULT_BYTESIZE);
-				current_op->short_transfer = (current_op->size != dma_dev->dma_from_logic_block_size);
-				tail += dma_dev->dma_from_logic_block_size;
-				if (tail == dma_dev->dma_from_logic_memory_size)
-					tail = 0;
-				current_op->next_tail = tail;
-				--results_avail;
-				pr_debug("%s: nexttail=%u size=%u addr=%p\n", __func__,
-					tail, current_op->size, current_op->addr);
-			} else {
-				for(;;) {
-					if (is_blocking)
-						prepare_to_wait(&dma_dev->wait_queue_from_logic, &wait, TASK_INTERRUPTIBLE);
-					results_avail = datra_dma_from_logic_pump(dma_dev);
-					pr_debug("%s results_avail=%u head=%u tail=%u\n", __func__,
-						results_avail, dma_dev->dma_from_logic_head, dma_dev->dma_from_logic_tail);
-					if (results_avail != 0)
-						break;
-					if (signal_pending(current))
-						goto error_interrupted;
-					/* Enable interrupt */
-					datra_dma_from_logic_irq_enable(control_base);
-					if (is_blocking)
-						schedule();
-					else {
-						if (bytes_copied)
-							goto exit_ok; /* Some data transferred */
-						else {
-							/* No data available, tell user */
-							status = -EAGAIN;
-							goto error_exit;
-						}
-					}
-				}
-				if (is_blocking)
-					finish_wait(&dma_dev->wait_queue_from_logic, &wait);
-			}
-		}
-		/* Copy any remaining data into the user's buffer */
-		if (current_op->size) {
-			bytes_to_copy = current_op->size;
-			if (bytes_to_copy > count)
-				bytes_to_copy = count;
-			/* pr_debug("%s: copy_to_user %p (%u)\n", __func__, current_op->addr, bytes_to_copy); */
-			if (unlikely(__copy_to_user(buf, current_op->addr, bytes_to_copy))) {
-				status = -EFAULT;
-				goto error_exit;
-			}
-			bytes_copied += bytes_to_copy;
-			count -= bytes_to_copy;
-			buf += bytes_to_copy;
-			current_op->size -= bytes_to_copy;
-			if (current_op->size != 0) {
-				/* No more room in user buffer */
-				current_op->addr += bytes_to_copy;
-				break;
-			} else {
-				dma_dev->dma_from_logic_tail = current_op->next_tail;
-				dma_dev->dma_from_logic_full = false;
-				pr_debug("%s: move tail %u\n", __func__,
-					dma_dev->dma_from_logic_tail);
-				/* We moved the tail up, so submit more work to logic */
-				results_avail = datra_dma_from_logic_pump(dma_dev);
-				if (current_op->short_transfer)
-					break; /* Usersignal change, return immediately */
-			}
+	for (i = 0; i < count; ++i) {
+		if (dma_block_set->blocks[i].data.offset == vm_offset) {
+			block = &dma_block_set->blocks[i];
+			break;
 		}
 	}
-exit_ok:
-	status = bytes_copied;
-	*f_pos += bytes_copied;
-error_exit:
-	return status;
-error_interrupted:
-	if (is_blocking)
-		finish_wait(&dma_dev->wait_queue_from_logic, &wait);
-	return -ERESTARTSYS;
+
+	if (block == NULL) {
+		pr_err("%s offset %u not found\n", __func__, vm_offset);
+		return -EINVAL;
+	}
+
+	if (PAGE_ALIGN(block->data.size) < vma->vm_end - vma->vm_start) {
+		pr_err("%s size mismatch\n", __func__);
+		return -EINVAL;
+	}
+
+	vma->vm_pgoff = 0;
+
+#ifdef DATRA_HAVE_HUGEPAGE
+	if ((dma_block_set->flags & DATRA_DMA_BLOCK_FLAG_HUGEPAGE) &&
+	    datra_dma_huge_mmap(dma_dev->config_parent->parent->device, vma, block))
+		return 0;
+#endif
+
+	return dma_mmap_coherent(dma_dev->config_parent->parent->device,
+		vma, block->mem_addr, block->phys_addr, block->data.size);
+}
+
+#if defined(DATRA_HAVE_DMABUF) || defined(DATRA_HAVE_USERPTR)
+/* Logic takes a single start address per transfer, so the whole buffer
+ * must be one range in the device's address space. */
+static bool datra_dma_sgt_is_contiguous(struct sg_table *sgt)
+{
+	struct scatterlist *sg;
+	dma_addr_t next = 0;
+	unsigned int i;
+
+	for_each_sgtable_dma_sg(sgt, sg, i) {
+		if (i && sg_dma_address(sg) != next)
+			return false;
+		next = sg_dma_address(sg) + sg_dma_len(sg);
+	}
+	return true;
 }
+#endif
 
-static unsigned int datra_dma_to_logic_poll(struct file *filp, poll_table *wait)
+#ifdef DATRA_HAVE_DMABUF
+/* A dma-buf can outlive the DMA node. When the node goes away first, its
+ * exports are detached from the block set under this lock. */
+static DEFINE_MUTEX(datra_dma_export_lock);
+
+struct datra_dma_buf_export {
+	struct device *device; /* Owner of the memory, referenced */
+	struct datra_dma_block_set *dma_block_set; /* NULL once orphaned */
+	struct list_head list; /* In the block set's export_list */
+	void *mem_addr;
+	dma_addr_t phys_addr;
+	size_t size;
+	struct mutex lock; /* Protects attachments */
+	struct list_head attachments;
+};
+
+struct datra_dma_buf_attachment {
+	struct list_head list;
+	struct device *device;
+	struct sg_table sgt;
+	enum dma_data_direction direction; /* DMA_NONE when not mapped */
+};
+
+static int datra_dma_buf_attach(struct dma_buf *dmabuf,
+	struct dma_buf_attachment *attach)
 {
-	struct datra_dma_dev *dma_dev = filp->private_data;
-	u32 __iomem *control_base = dma_dev->config_parent->control_base;
-	unsigned int mask = 0;
-	unsigned int avail;
+	struct datra_dma_buf_export *export = dmabuf->priv;
+	struct datra_dma_buf_attachment *a;
+	int ret;
 
-	poll_wait(filp, &dma_dev->wait_queue_to_logic, wait);
+	a = kzalloc(sizeof(*a), GFP_KERNEL);
+	if (!a)
+		return -ENOMEM;
+	/* Describe the coherent memory in terms of pages, so the importer
+	 * can create its own mapping */
+	ret = dma_get_sgtable(export->device, &a->sgt, export->mem_addr,
+			export->phys_addr, export->size);
+	if (ret < 0) {
+		kfree(a);
+		return ret;
+	}
+	a->device = attach->dev;
+	a->direction = DMA_NONE;
+	attach->priv = a;
 
-	if (dma_dev->dma_to_logic_blocks.blocks) {
-		/* Writable when not all blocks have been submitted, or when
-		 * results are available and can be dequeued */
-		avail = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_STATUS);
-		if ((avail & 0xFF000000) == 0) {
-			/* No results yet, see if there are blocks available */
-			avail = ((avail >> 16) & 0xFF) + dma_dev->dma_to_logic_blocks.count - DMA_MAX_NUMBER_OF_COMMANDS;
-		}
-	} else
-		avail = datra_dma_to_logic_avail(dma_dev);
-	if (avail)
-		mask |= (POLLOUT | POLLWRNORM);
-	else
-		datra_dma_to_logic_irq_enable(control_base);
+	mutex_lock(&export->lock);
+	list_add(&a->list, &export->attachments);
+	mutex_unlock(&export->lock);
 
-	pr_debug("%s(%#x) -> %#x\n", __func__, avail, mask);
-	return mask;
+	return 0;
 }
 
-static unsigned int datra_dma_from_logic_poll(struct file *filp, poll_table *wait)
+static void datra_dma_buf_detach(struct dma_buf *dmabuf,
+	struct dma_buf_attachment *attach)
 {
-	struct datra_dma_dev *dma_dev = filp->private_data;
-	u32 __iomem *control_base = dma_dev->config_parent->control_base;
-	unsigned int mask = 0;
-	unsigned int avail;
-
-	poll_wait(filp, &dma_dev->wait_queue_from_logic, wait);
+	struct datra_dma_buf_export *export = dmabuf->priv;
+	struct datra_dma_buf_attachment *a = attach->priv;
 
-	if (dma_dev->dma_from_logic_blocks.blocks) {
-		avail = datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_STATUS);
-		pr_debug("%s(status=%#x)\n", __func__, avail);
-		avail &= 0xFF000000;
-	} else {
-		if (dma_dev->dma_from_logic_current_op.size)
-			avail = 1;
-		else
-			avail = datra_dma_from_logic_pump(dma_dev);
-	}
-	if (avail)
-		mask |= (POLLIN | POLLRDNORM);
-	else
-		datra_dma_from_logic_irq_enable(control_base);
+	mutex_lock(&export->lock);
+	list_del(&a->list);
+	mutex_unlock(&export->lock);
 
-	pr_debug("%s(%x) -> %#x\n", __func__, avail, mask);
-	return mask;
+	sg_free_table(&a->sgt);
+	kfree(a);
 }
 
-static int datra_dma_add_route(struct datra_dma_dev *dma_dev, int source, int dest)
+static struct sg_table *datra_dma_buf_map(struct dma_buf_attachment *attach,
+	enum dma_data_direction direction)
 {
-	struct datra_route_item_t route;
-	route.srcFifo = (source >> 8) & 0xFF;
-	route.srcNode = source & 0xFF;
-	route.dstFifo = (dest >> 8) & 0xFF;
-	route.dstNode = dest & 0xFF;
-	datra_ctl_route_add(dma_dev->config_parent->parent, route);
-	return 0;
+	struct datra_dma_buf_export *export = attach->dmabuf->priv;
+	struct datra_dma_buf_attachment *a = attach->priv;
+	int ret;
+
+	ret = dma_map_sgtable(a->device, &a->sgt, direction, 0);
+	if (ret)
+		return ERR_PTR(ret);
+
+	mutex_lock(&export->lock);
+	a->direction = direction;
+	mutex_unlock(&export->lock);
+
+	return &a->sgt;
 }
 
-static int datra_dma_get_route_id(struct datra_dma_dev *dma_dev)
+static void datra_dma_buf_unmap(struct dma_buf_attachment *attach,
+	struct sg_table *sgt, enum dma_data_direction direction)
 {
-	/* Only one fifo, so upper 8 bits are always 0 */
-	return datra_dma_get_index(dma_dev);
+	struct datra_dma_buf_export *export = attach->dmabuf->priv;
+	struct datra_dma_buf_attachment *a = attach->priv;
+
+	mutex_lock(&export->lock);
+	a->direction = DMA_NONE;
+	mutex_unlock(&export->lock);
+
+	dma_unmap_sgtable(a->device, sgt, direction, 0);
 }
 
-static void datra_dma_common_block_free_coherent(struct datra_dev *dev,
-	struct datra_dma_block_set* dma_block_set,
-	enum dma_data_direction direction)
+static void datra_dma_buf_release(struct dma_buf *dmabuf)
 {
-	u32 i;
+	struct datra_dma_buf_export *export = dmabuf->priv;
 
-	for (i = 0; i < dma_block_set->count; ++i) {
-		struct datra_dma_block *block = &dma_block_set->blocks[i];
-		if (block->mem_addr)
-			dma_free_coherent(dev->device, block->data.size,
-				block->mem_addr, block->phys_addr);
+	mutex_lock(&datra_dma_export_lock);
+	if (export->dma_block_set) {
+		list_del(&export->list);
+		atomic_dec(&export->dma_block_set->exports);
 	}
+	mutex_unlock(&datra_dma_export_lock);
+	put_device(export->device);
+	kfree(export);
 }
 
-static int datra_dma_common_block_free(struct datra_dma_dev *dma_dev,
-	struct datra_dma_block_set* dma_block_set,
-	enum dma_data_direction direction)
+/* The node is going away while its blocks are still exported. Their
+ * memory cannot be freed, so leak it, and detach the exports so they
+ * don't refer to the block set anymore. */
+static void datra_dma_common_block_orphan(struct datra_dma_dev *dma_dev,
+	struct datra_dma_block_set *dma_block_set)
 {
-	if (!(dma_block_set->flags & DATRA_DMA_BLOCK_FLAG_SHAREDMEM)) {
-		datra_dma_common_block_free_coherent(dma_dev->config_parent->parent, dma_block_set, direction);
+	struct datra_dma_buf_export *export;
+	struct datra_dma_buf_export *next;
+
+	mutex_lock(&datra_dma_export_lock);
+	if (!list_empty(&dma_block_set->export_list))
+		dev_warn(dma_dev->config_parent->parent->device,
+			"DMA blocks still exported, leaking %llu bytes\n",
+			(u64)dma_block_set->size * dma_block_set->count);
+	list_for_each_entry_safe(export, next, &dma_block_set->export_list, list) {
+		list_del(&export->list);
+		export->dma_block_set = NULL;
 	}
-	kfree(dma_block_set->blocks);
-	dma_block_set->blocks = NULL;
-	dma_block_set->count = 0;
-	dma_block_set->size = 0;
-	dma_block_set->flags = 0;
-	return 0;
+	atomic_set(&dma_block_set->exports, 0);
+	mutex_unlock(&datra_dma_export_lock);
 }
 
-static int datra_dma_to_logic_block_free(struct datra_dma_dev *dma_dev)
+static int datra_dma_buf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
 {
-	/* Reset the device to release all resources */
-	datra_dma_to_logic_reset(dma_dev);
-	return datra_dma_common_block_free(dma_dev, &dma_dev->dma_to_logic_blocks, DMA_TO_DEVICE);
+	struct datra_dma_buf_export *export = dmabuf->priv;
+
+	return dma_mmap_coherent(export->device, vma,
+			export->mem_addr, export->phys_addr, export->size);
 }
 
-static int datra_dma_common_block_alloc_one_coherent(
-	struct datra_dma_dev *dma_dev,
-	struct datra_dma_block *block,
+/* The memory is coherent for the Datra device, but importers may have
+ * mapped it through a streaming mapping, so sync on their behalf. */
+static int datra_dma_buf_begin_cpu_access(struct dma_buf *dmabuf,
 	enum dma_data_direction direction)
 {
-	struct datra_dev *dev = dma_dev->config_parent->parent;
+	struct datra_dma_buf_export *export = dmabuf->priv;
+	struct datra_dma_buf_attachment *a;
 
-	block->mem_addr = dma_alloc_coherent(dev->device,
-		block->data.size, &block->phys_addr, GFP_KERNEL);
-	if (!block->mem_addr)
-		return -ENOMEM;
+	mutex_lock(&export->lock);
+	list_for_each_entry(a, &export->attachments, list) {
+		if (a->direction != DMA_NONE)
+			dma_sync_sgtable_for_cpu(a->device, &a->sgt, a->direction);
+	}
+	mutex_unlock(&export->lock);
 
 	return 0;
 }
 
-static int datra_dma_common_block_alloc(struct datra_dma_dev *dma_dev,
-	struct datra_dma_configuration_req *request,
-	struct datra_dma_block_set* dma_block_set,
+static int datra_dma_buf_end_cpu_access(struct dma_buf *dmabuf,
 	enum dma_data_direction direction)
 {
-	struct datra_dma_block *block;
-	u32 i;
-	int ret;
-
-	pr_debug("%s mode=%u count=%u size=%u\n", __func__,
-		request->mode, request->count, request->size);
+	struct datra_dma_buf_export *export = dmabuf->priv;
+	struct datra_dma_buf_attachment *a;
 
-	if (!request->size || !request->count)
-		return -EINVAL;
-	request->size = PAGE_ALIGN(request->size);
-	/* Pointless to use more */
-	if (request->count > DMA_MAX_NUMBER_OF_COMMANDS)
-		request->count = DMA_MAX_NUMBER_OF_COMMANDS;
-	block = kcalloc(request->count, sizeof(*block), GFP_KERNEL);
-	if (!block)
-		return -ENOMEM;
-	dma_block_set->blocks = block;
-	dma_block_set->size = request->size;
-	dma_block_set->count = request->count;
-	dma_block_set->flags = DATRA_DMA_BLOCK_FLAG_COHERENT;
-	/* The pre-allocated buffers are coherent, so if the blocks fit
-		* in there, we can just re-use the already allocated one */
-	if (direction == DMA_FROM_DEVICE) {
-		if (request->count * request->size <= dma_dev->dma_from_logic_memory_size) {
-			dma_block_set->flags |= DATRA_DMA_BLOCK_FLAG_SHAREDMEM;
-			for (i = 0; i < request->count; ++i, ++block) {
-				block->data.id = i;
-				block->data.size = request->size;
-				block->data.offset = i * request->size;
-				block->mem_addr = ((char*)dma_dev->dma_from_logic_memory) + block->data.offset;
-				block->phys_addr = dma_dev->dma_from_logic_handle + block->data.offset;
-			}
-			return 0;
-		}
-	} else {
-		if (request->count * request->size <= dma_dev->dma_to_logic_memory_size) {
-			dma_block_set->flags |= DATRA_DMA_BLOCK_FLAG_SHAREDMEM;
-			for (i = 0; i < request->count; ++i, ++block) {
-				block->data.id = i;
-				block->data.size = request->size;
-				block->data.offset = i * request->size;
-				block->mem_addr = ((char*)dma_dev->dma_to_logic_memory) + block->data.offset;
-				block->phys_addr = dma_dev->dma_to_logic_handle + block->data.offset;
-			}
-			return 0;
-		}
-	}
-	for (i = 0; i < request->count; ++i, ++block) {
-		block->data.id = i;
-		block->data.size = request->size;
-		block->data.offset = i * request->size;
-		ret = datra_dma_common_block_alloc_one_coherent(dma_dev, block, direction);
-		if (unlikely(ret)) {
-			datra_dma_common_block_free(dma_dev, dma_block_set, direction);
-			return ret;
-		}
+	mutex_lock(&export->lock);
+	list_for_each_entry(a, &export->attachments, list) {
+		if (a->direction != DMA_NONE)
+			dma_sync_sgtable_for_device(a->device, &a->sgt, a->direction);
 	}
+	mutex_unlock(&export->lock);
+
 	return 0;
 }
 
-/* For backward compatibility */
-static int datra_dma_to_logic_block_alloc(struct datra_dma_dev *dma_dev,
-	struct datra_buffer_block_alloc_req __user *arg)
+static const struct dma_buf_ops datra_dma_buf_ops = {
+	.attach = datra_dma_buf_attach,
+	.detach = datra_dma_buf_detach,
+	.map_dma_buf = datra_dma_buf_map,
+	.unmap_dma_buf = datra_dma_buf_unmap,
+	.release = datra_dma_buf_release,
+	.mmap = datra_dma_buf_mmap,
+	.begin_cpu_access = datra_dma_buf_begin_cpu_access,
+	.end_cpu_access = datra_dma_buf_end_cpu_access,
+};
+
+static int datra_dma_common_block_export(struct file *filp,
+	struct datra_dma_block_set *dma_block_set,
+	struct datra_buffer_block_export_req __user *arg)
 {
-	struct datra_buffer_block_alloc_req request;
-	struct datra_dma_configuration_req r;
+	struct datra_dma_dev *dma_dev = filp->private_data;
+	struct datra_buffer_block_export_req request;
+	struct datra_dma_buf_export *export;
+	struct dma_buf *dmabuf;
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
 	int ret;
 
 	if (copy_from_user(&request, arg, sizeof(request)))
 		return -EFAULT;
-	r.mode = DATRA_DMA_MODE_BLOCK_COHERENT;
-	r.size = request.size;
-	r.count = request.count;
 
-	datra_dma_to_logic_block_free(dma_dev);
-	ret = datra_dma_common_block_alloc(dma_dev, &r, &dma_dev->dma_to_logic_blocks, DMA_TO_DEVICE);
-	if (ret)
+	if (!dma_block_set->blocks)
+		return -EINVAL;
+	/* Not ours to give away */
+	if (dma_block_set->flags & (DATRA_DMA_BLOCK_FLAG_IMPORTED | DATRA_DMA_BLOCK_FLAG_USERPTR))
+		return -EINVAL;
+	if (request.flags & ~O_CLOEXEC)
+		return -EINVAL;
+
+	export = kzalloc(sizeof(*export), GFP_KERNEL);
+	if (!export)
+		return -ENOMEM;
+	export->device = dma_dev->config_parent->parent->device;
+	export->dma_block_set = dma_block_set;
+	mutex_init(&export->lock);
+	INIT_LIST_HEAD(&export->attachments);
+
+	if (request.id == DATRA_DMABLOCK_EXPORT_ALL) {
+		/* Only shared memory is guaranteed to be one contiguous area */
+		if (!(dma_block_set->flags & DATRA_DMA_BLOCK_FLAG_SHAREDMEM)) {
+			ret = -EINVAL;
+			goto error_free;
+		}
+		export->mem_addr = dma_block_set->blocks[0].mem_addr;
+		export->phys_addr = dma_block_set->blocks[0].phys_addr;
+		export->size = dma_block_set->size * dma_block_set->count;
+	} else {
+		struct datra_dma_block *block;
+
+		if (request.id >= dma_block_set->count) {
+			ret = -EINVAL;
+			goto error_free;
+		}
+		block = &dma_block_set->blocks[request.id];
+		export->mem_addr = block->mem_addr;
+		export->phys_addr = block->phys_addr;
+		export->size = block->data.size;
+	}
+
+	exp_info.ops = &datra_dma_buf_ops;
+	exp_info.size = export->size;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = export;
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		ret = PTR_ERR(dmabuf);
+		goto error_free;
+	}
+	/* From here on, datra_dma_buf_release takes care of cleaning up */
+	get_device(export->device);
+	mutex_lock(&datra_dma_export_lock);
+	list_add(&export->list, &dma_block_set->export_list);
+	atomic_inc(&dma_block_set->exports);
+	mutex_unlock(&datra_dma_export_lock);
+
+	ret = dma_buf_fd(dmabuf, request.flags);
+	if (ret < 0) {
+		dma_buf_put(dmabuf);
 		return ret;
+	}
+	request.fd = ret;
+	pr_debug("%s id=%#x size=%zu fd=%d\n", __func__,
+		request.id, export->size, request.fd);
 
-	request.size = r.size;
-	request.count = r.count;
+	/* The fd is already installed, so no point in failing now */
 	if (copy_to_user(arg, &request, sizeof(request)))
 		return -EFAULT;
 
 	return 0;
+
+error_free:
+	kfree(export);
+	return ret;
 }
 
-static int datra_dma_to_logic_block_query(struct datra_dma_dev *dma_dev,
-	struct datra_buffer_block __user *arg)
+static void datra_dma_common_block_free_imported(struct datra_dma_block_set* dma_block_set,
+	enum dma_data_direction direction)
 {
-	__u32 request_id;
+	u32 i;
 
-	if (get_user(request_id, &arg->id))
+	for (i = 0; i < dma_block_set->count; ++i) {
+		struct datra_dma_block *block = &dma_block_set->blocks[i];
+		struct dma_buf_attachment *attach = block->import_attach;
+		struct dma_buf *dmabuf;
+
+		if (!attach)
+			continue;
+		dmabuf = attach->dmabuf;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+		dma_buf_unmap_attachment_unlocked(attach, block->import_sgt, direction);
+#else
+		dma_buf_unmap_attachment(attach, block->import_sgt, direction);
+#endif
+		dma_buf_detach(dmabuf, attach);
+		dma_buf_put(dmabuf);
+		block->import_attach = NULL;
+		block->import_sgt = NULL;
+	}
+}
+
+static int datra_dma_common_block_import(struct datra_dma_dev *dma_dev,
+	struct datra_dma_block_set *dma_block_set,
+	enum dma_data_direction direction,
+	struct datra_buffer_block_import_req __user *arg)
+{
+	struct device *device = dma_dev->config_parent->parent->device;
+	struct datra_buffer_block_import_req request;
+	struct dma_buf *dmabuf;
+	struct dma_buf_attachment *attach;
+	struct sg_table *sgt;
+	struct datra_dma_block *blocks;
+	struct datra_dma_block *block;
+	int ret;
+
+	if (copy_from_user(&request, arg, sizeof(request)))
 		return -EFAULT;
 
-	if (request_id >= dma_dev->dma_to_logic_blocks.count)
-		return -EINVAL;
+	/* Do not mix with blocks the driver allocated itself */
+	if (dma_block_set->blocks &&
+	    !(dma_block_set->flags & DATRA_DMA_BLOCK_FLAG_IMPORTED))
+		return -EBUSY;
+	/* Pointless to use more */
+	if (dma_block_set->count >= DMA_MAX_NUMBER_OF_COMMANDS)
+		return -ENOSPC;
+
+	dmabuf = dma_buf_get(request.fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+	if (dmabuf->size > U32_MAX) {
+		ret = -EINVAL;
+		goto error_put;
+	}
 
-	if (copy_to_user(arg, &dma_dev->dma_to_logic_blocks.blocks[request_id].data, sizeof(struct datra_buffer_block)))
+	attach = dma_buf_attach(dmabuf, device);
+	if (IS_ERR(attach)) {
+		ret = PTR_ERR(attach);
+		goto error_put;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+	sgt = dma_buf_map_attachment_unlocked(attach, direction);
+#else
+	sgt = dma_buf_map_attachment(attach, direction);
+#endif
+	if (IS_ERR(sgt)) {
+		ret = PTR_ERR(sgt);
+		goto error_detach;
+	}
+	if (!datra_dma_sgt_is_contiguous(sgt)) {
+		dev_dbg(device, "%s: dma-buf is not contiguous\n", __func__);
+		ret = -EINVAL;
+		goto error_unmap;
+	}
+
+	blocks = krealloc(dma_block_set->blocks,
+		(dma_block_set->count + 1) * sizeof(*blocks), GFP_KERNEL);
+	if (!blocks) {
+		ret = -ENOMEM;
+		goto error_unmap;
+	}
+	dma_block_set->blocks = blocks;
+	block = &blocks[dma_block_set->count];
+	memset(block, 0, sizeof(*block));
+	block->parent = dma_dev;
+	block->phys_addr = sg_dma_address(sgt->sgl);
+	block->import_attach = attach;
+	block->import_sgt = sgt;
+	block->data.id = dma_block_set->count;
+	block->data.offset = DATRA_DMABLOCK_OFFSET_NONE;
+	block->data.size = dmabuf->size;
+	if (!dma_block_set->count)
+		dma_block_set->size = dmabuf->size;
+	++dma_block_set->count;
+	dma_block_set->flags = DATRA_DMA_BLOCK_FLAG_IMPORTED;
+
+	pr_debug("%s id=%u addr=%#llx size=%u\n", __func__,
+		block->data.id, (u64)block->phys_addr, block->data.size);
+
+	request.id = block->data.id;
+	request.size = block->data.size;
+	if (copy_to_user(arg, &request, sizeof(request)))
 		return -EFAULT;
 
 	return 0;
-}
 
-static int datra_dma_to_logic_block_enqueue(struct datra_dma_dev *dma_dev,
-	struct datra_buffer_block __user *arg)
+error_unmap:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+	dma_buf_unmap_attachment_unlocked(attach, sgt, direction);
+#else
+	dma_buf_unmap_attachment(attach, sgt, direction);
+#endif
+error_detach:
+	dma_buf_detach(dmabuf, attach);
+error_put:
+	dma_buf_put(dmabuf);
+	return ret;
+}
+#else
+static int datra_dma_common_block_export(struct file *filp,
+	struct datra_dma_block_set *dma_block_set,
+	struct datra_buffer_block_export_req __user *arg)
 {
-	struct datra_buffer_block request;
-	struct datra_dma_block *block;
-	u32 __iomem *control_base = dma_dev->config_parent->control_base;
-
-	if (copy_from_user(&request, arg, sizeof(request)))
-		return -EFAULT;
+	return -ENOTTY;
+}
 
-	if (request.id >= dma_dev->dma_to_logic_blocks.count)
-		return -EINVAL;
+static void datra_dma_common_block_orphan(struct datra_dma_dev *dma_dev,
+	struct datra_dma_block_set *dma_block_set)
+{
+}
 
-	block = &dma_dev->dma_to_logic_blocks.blocks[request.id];
-	if (block->data.state)
-		return -EBUSY;
+static void datra_dma_common_block_free_imported(struct datra_dma_block_set* dma_block_set,
+	enum dma_data_direction direction)
+{
+}
 
-	block->data.bytes_used = request.bytes_used;
-	block->data.user_signal = request.user_signal;
+static int datra_dma_common_block_import(struct datra_dma_dev *dma_dev,
+	struct datra_dma_block_set *dma_block_set,
+	enum dma_data_direction direction,
+	struct datra_buffer_block_import_req __user *arg)
+{
+	return -ENOTTY;
+}
+#endif /* DATRA_HAVE_DMABUF */
 
-	/* This operation never blocks, unless something is wrong in HW */
-	if (!(datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_STATUS) & 0xFF0000))
-		return -EWOULDBLOCK;
-	pr_debug("%s sending addr=%#llx size=%u\n", __func__,
-			(u64)block->phys_addr, block->data.bytes_used);
-	iowrite32_quick(block->phys_addr & 0xFFFFFFFF, control_base + (DATRA_DMA_TOLOGIC_STARTADDR_LOW>>2));
-	if (dma_dev->dma_64bit)
-		iowrite32_quick(block->phys_addr >> 32, control_base + (DATRA_DMA_TOLOGIC_STARTADDR_HIGH>>2));
-	iowrite32_quick(block->data.user_signal, control_base + (DATRA_DMA_TOLOGIC_USERBITS>>2));
-	iowrite32(block->data.bytes_used, control_base + (DATRA_DMA_TOLOGIC_BYTESIZE>>2));
-	block->data.state = 1;
+#ifdef DATRA_HAVE_USERPTR
+static void datra_dma_common_block_free_userptr(struct device *device,
+	struct datra_dma_block_set* dma_block_set,
+	enum dma_data_direction direction)
+{
+	u32 i;
 
-	if (copy_to_user(arg, &block->data, sizeof(struct datra_buffer_block)))
-		return -EFAULT;
+	for (i = 0; i < dma_block_set->count; ++i) {
+		struct datra_dma_block *block = &dma_block_set->blocks[i];
 
-	return 0;
+		if (!block->userptr_sgt.sgl)
+			continue;
+		dma_unmap_sgtable(device, &block->userptr_sgt, direction, 0);
+		sg_free_table(&block->userptr_sgt);
+		block->userptr_sgt.sgl = NULL;
+	}
+	if (dma_block_set->pages) {
+		/* Logic may have written to the pages */
+		unpin_user_pages_dirty_lock(dma_block_set->pages,
+			dma_block_set->nr_pages, direction == DMA_FROM_DEVICE);
+		kvfree(dma_block_set->pages);
+		dma_block_set->pages = NULL;
+		dma_block_set->nr_pages = 0;
+	}
 }
 
-static int datra_dma_to_logic_block_dequeue(struct datra_dma_dev *dma_dev,
-	struct datra_buffer_block __user *arg, bool is_blocking)
+/* Pin the user buffer and map each block once, so that enqueue and
+ * dequeue only need to maintain the caches. */
+static int datra_dma_common_block_userptr(struct datra_dma_dev *dma_dev,
+	struct datra_dma_block_set *dma_block_set,
+	enum dma_data_direction direction,
+	struct datra_buffer_block_userptr_req __user *arg)
 {
-	struct datra_buffer_block request;
+	struct device *device = dma_dev->config_parent->parent->device;
+	struct datra_buffer_block_userptr_req request;
 	struct datra_dma_block *block;
-	u32 __iomem *control_base = dma_dev->config_parent->control_base;
-	u32 status;
-	dma_addr_t start_addr;
+	unsigned int pages_per_block;
+	unsigned int nr_pages;
+	u32 total_size;
+	int pinned;
+	u32 i;
+	int ret;
 
 	if (copy_from_user(&request, arg, sizeof(request)))
 		return -EFAULT;
 
-	if (request.id >= dma_dev->dma_to_logic_blocks.count)
-		return -EINVAL;
+	pr_debug("%s addr=%#llx count=%u size=%u\n", __func__,
+		request.addr, request.count, request.size);
 
-	block = &dma_dev->dma_to_logic_blocks.blocks[request.id];
-	if (!block->data.state)
+	if (!request.size || !request.count)
+		return -EINVAL;
+	/* Pinning works on whole pages, and rounding up would reach
+	 * beyond the user's buffer */
+	if (!PAGE_ALIGNED(request.addr) || !PAGE_ALIGNED(request.size))
 		return -EINVAL;
+	/* Pointless to use more */
+	if (request.count > DMA_MAX_NUMBER_OF_COMMANDS)
+		request.count = DMA_MAX_NUMBER_OF_COMMANDS;
+	/* Block offsets are 32-bit */
+	if (check_mul_overflow(request.size, request.count, &total_size))
+		return -EINVAL;
+	pages_per_block = request.size >> PAGE_SHIFT;
+	nr_pages = total_size >> PAGE_SHIFT;
 
-	if (is_blocking) {
-		DEFINE_WAIT(wait);
-		for (;;) {
-			prepare_to_wait(&dma_dev->wait_queue_to_logic, &wait, TASK_INTERRUPTIBLE);
-			status = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_STATUS);
-			if (status & 0xFF000000)
-				break; /* Results available, done waiting */
-			if (signal_pending(current)) {
-				finish_wait(&dma_dev->wait_queue_from_logic, &wait);
-				return -ERESTARTSYS;
-			}
-			/* Enable interrupt */
-			datra_dma_to_logic_irq_enable(control_base);
-			schedule();
-		}
-		finish_wait(&dma_dev->wait_queue_from_logic, &wait);
-	} else {
-		status = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_STATUS);
-		if ((status & 0xFF000000) == 0)
-			return -EAGAIN;
+	block = kcalloc_node(request.count, sizeof(*block), GFP_KERNEL,
+		dev_to_node(device));
+	if (!block)
+		return -ENOMEM;
+	dma_block_set->blocks = block;
+	dma_block_set->size = request.size;
+	dma_block_set->count = request.count;
+	dma_block_set->flags = DATRA_DMA_BLOCK_FLAG_USERPTR;
+
+	dma_block_set->pages = kvmalloc_node(array_size(nr_pages, sizeof(struct page *)),
+		GFP_KERNEL, dev_to_node(device));
+	if (!dma_block_set->pages) {
+		ret = -ENOMEM;
+		goto error_free;
 	}
-	start_addr = datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_RESULT_ADDR_LOW);
-	if (dma_dev->dma_64bit)
-		start_addr |= ((dma_addr_t)datra_reg_read_quick(control_base, DATRA_DMA_TOLOGIC_RESULT_ADDR_HIGH) << 32);
-
-	if (start_addr != block->phys_addr) {
-		pr_err("%s Expected addr 0x%llx result 0x%llx\n", __func__, (u64)block->phys_addr, (u64)start_addr);
-		return -EIO;
+	pinned = pin_user_pages_fast(request.addr, nr_pages,
+		FOLL_LONGTERM | (direction == DMA_FROM_DEVICE ? FOLL_WRITE : 0),
+		dma_block_set->pages);
+	if (pinned < 0) {
+		ret = pinned;
+		goto error_free;
+	}
+	dma_block_set->nr_pages = pinned;
+	if (pinned != nr_pages) {
+		ret = -EFAULT;
+		goto error_free;
 	}
 
-	block->data.state = 0;
+	for (i = 0; i < request.count; ++i, ++block) {
+		block->parent = dma_dev;
+		block->data.id = i;
+		block->data.size = request.size;
+		block->data.offset = i * request.size;
+		ret = sg_alloc_table_from_pages(&block->userptr_sgt,
+			dma_block_set->pages + i * pages_per_block,
+			pages_per_block, 0, request.size, GFP_KERNEL);
+		if (ret)
+			goto error_free;
+		ret = dma_map_sgtable(device, &block->userptr_sgt, direction, 0);
+		if (ret) {
+			sg_free_table(&block->userptr_sgt);
+			block->userptr_sgt.sgl = NULL;
+			goto error_free;
+		}
+		if (!datra_dma_sgt_is_contiguous(&block->userptr_sgt)) {
+			dev_dbg(device, "%s: block %u is not contiguous\n",
+				__func__, i);
+			ret = -EINVAL;
+			goto error_free;
+		}
+		block->phys_addr = sg_dma_address(block->userptr_sgt.sgl);
+	}
 
-	if (copy_to_user(arg, &block->data, sizeof(struct datra_buffer_block)))
+	if (copy_to_user(arg, &request, sizeof(request)))
 		return -EFAULT;
 
 	return 0;
+
+error_free:
+	datra_dma_common_block_free(dma_dev, dma_block_set, direction);
+	return ret;
 }
 
-static int datra_dma_common_mmap(struct datra_dma_dev *dma_dev,
-	struct vm_area_struct *vma,
-	struct datra_dma_block_set* dma_block_set)
+static int datra_dma_to_logic_block_userptr(struct datra_dma_dev *dma_dev,
+	struct datra_buffer_block_userptr_req __user *arg)
 {
-	const unsigned int count = dma_block_set->count;
-	struct datra_dma_block *block = NULL;
-	unsigned int vm_offset = vma->vm_pgoff << PAGE_SHIFT;
-	unsigned int i;
-
-	pr_debug("%s offset=%u\n", __func__, vm_offset);
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
-	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
-#else
-	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
-#endif
-
-	if (dma_block_set->flags & DATRA_DMA_BLOCK_FLAG_SHAREDMEM) {
-		block = &dma_block_set->blocks[0];
-		return dma_mmap_coherent(dma_dev->config_parent->parent->device,
-			vma, block->mem_addr, block->phys_addr,
-			dma_block_set->size * dma_block_set->count);
-	}
-
-	for (i = 0; i < count; ++i) {
-		if (dma_block_set->blocks[i].data.offset == vm_offset) {
-			block = &dma_block_set->blocks[i];
-			break;
-		}
-	}
-
-	if (block == NULL) {
-		pr_err("%s offset %u not found\n", __func__, vm_offset);
-		return -EINVAL;
-	}
+	int ret;
 
-	if (PAGE_ALIGN(block->data.size) < vma->vm_end - vma->vm_start) {
-		pr_err("%s size mismatch\n", __func__);
-		return -EINVAL;
-	}
+	ret = datra_dma_to_logic_block_free(dma_dev);
+	if (ret)
+		return ret;
+	return datra_dma_common_block_userptr(dma_dev,
+		&dma_dev->dma_to_logic_blocks, DMA_TO_DEVICE, arg);
+}
 
-	vma->vm_pgoff = 0;
+static int datra_dma_from_logic_block_userptr(struct datra_dma_dev *dma_dev,
+	struct datra_buffer_block_userptr_req __user *arg)
+{
+	int ret;
 
-	return dma_mmap_coherent(dma_dev->config_parent->parent->device,
-		vma, block->mem_addr, block->phys_addr, block->data.size);
+	ret = datra_dma_from_logic_block_free(dma_dev);
+	if (ret)
+		return ret;
+	return datra_dma_common_block_userptr(dma_dev,
+		&dma_dev->dma_from_logic_blocks, DMA_FROM_DEVICE, arg);
 }
+#endif /* DATRA_HAVE_USERPTR */
 
 static int datra_dma_to_logic_mmap(struct file *filp, struct vm_area_struct *vma)
 {
@@ -2393,16 +5574,33 @@ static int datra_dma_to_logic_reconfigure(struct datra_dma_dev *dma_dev,
 	if (copy_from_user(&request, arg, sizeof(request)))
 		return -EFAULT;
 
-	pr_debug("%s mode=%d count=%u size=%u\n", __func__,
+	pr_debug("%s mode=%#x count=%u size=%u\n", __func__,
 		request.mode, request.count, request.size);
 
-	datra_dma_to_logic_block_free(dma_dev);
+	if (request.mode & ~(DATRA_DMA_MODE_MASK | DATRA_DMA_MODE_FLAG_HUGEPAGE))
+		return -EINVAL;
+
+	ret = datra_dma_to_logic_block_free(dma_dev);
+	if (ret)
+		return ret;
 
-	switch (request.mode) {
+	switch (request.mode & DATRA_DMA_MODE_MASK) {
 		case DATRA_DMA_MODE_STANDALONE:
 			ret = -EINVAL;
 			break;
 		case DATRA_DMA_MODE_RINGBUFFER_BOUNCE:
+		case DATRA_DMA_MODE_RINGBUFFER_STREAMING:
+			/* Logic may still access the ring, only replace it once
+			 * the engine is stopped. -EINVAL means the DMA core
+			 * wasn't running. It's allocated on next use. */
+			if (dma_dev->dma_to_logic_streaming !=
+			    ((request.mode & DATRA_DMA_MODE_MASK) == DATRA_DMA_MODE_RINGBUFFER_STREAMING)) {
+				ret = datra_dma_to_logic_reset(dma_dev);
+				if (ret && ret != -EINVAL)
+					break;
+				datra_dma_to_logic_ring_free(dma_dev);
+				dma_dev->dma_to_logic_streaming = !dma_dev->dma_to_logic_streaming;
+			}
 			request.size = dma_dev->dma_to_logic_block_size;
 			request.count = dma_dev->dma_to_logic_memory_size / dma_dev->dma_to_logic_block_size;
 			ret = 0;
@@ -2465,8 +5663,20 @@ static long datra_dma_to_logic_ioctl(struct file *filp, unsigned int cmd, unsign
 		case DATRA_IOC_USERSIGNAL_QUERY:
 			return datra_reg_read_quick(dma_dev->config_parent->control_base, DATRA_DMA_TOLOGIC_USERBITS);
 		case DATRA_IOC_USERSIGNAL_TELL:
+			if (dma_dev->dma_to_logic_byte_mode)
+				return -EBUSY; /* Driver owns the signal */
 			iowrite32_quick(arg, dma_dev->config_parent->control_base + (DATRA_DMA_TOLOGIC_USERBITS>>2));
 			return 0;
+		case DATRA_IOC_BYTE_MODE_QUERY:
+			return dma_dev->dma_to_logic_byte_mode;
+		case DATRA_IOC_BYTE_MODE_TELL:
+			if (arg > 1)
+				return -EINVAL;
+			if (arg)
+				iowrite32_quick(DATRA_USERSIGNAL_ZERO,
+					dma_dev->config_parent->control_base + (DATRA_DMA_TOLOGIC_USERBITS>>2));
+			dma_dev->dma_to_logic_byte_mode = arg;
+			return 0;
 		case DATRA_IOC_DMA_RECONFIGURE:
 			return datra_dma_to_logic_reconfigure(dma_dev,
 				(struct datra_dma_configuration_req __user *)arg);
@@ -2484,7 +5694,21 @@ static long datra_dma_to_logic_ioctl(struct file *filp, unsigned int cmd, unsign
 		case DATRA_IOC_DMABLOCK_DEQUEUE:
 			return datra_dma_to_logic_block_dequeue(dma_dev,
 				(struct datra_buffer_block __user *)arg,
-				(filp->f_flags & O_NONBLOCK) == 0);
+				(filp->f_flags & O_NONBLOCK) == 0,
+				_IOC_SIZE(cmd) == sizeof(struct datra_buffer_block_ts));
+		case DATRA_IOC_DMABLOCK_EXPORT:
+			return datra_dma_common_block_export(filp,
+				&dma_dev->dma_to_logic_blocks,
+				(struct datra_buffer_block_export_req __user *)arg);
+		case DATRA_IOC_DMABLOCK_IMPORT:
+			return datra_dma_common_block_import(dma_dev,
+				&dma_dev->dma_to_logic_blocks, DMA_TO_DEVICE,
+				(struct datra_buffer_block_import_req __user *)arg);
+#ifdef DATRA_HAVE_USERPTR
+		case DATRA_IOC_DMABLOCK_USERPTR:
+			return datra_dma_to_logic_block_userptr(dma_dev,
+				(struct datra_buffer_block_userptr_req __user *)arg);
+#endif
 		default:
 			return -ENOTTY;
 	}
@@ -2492,6 +5716,9 @@ static long datra_dma_to_logic_ioctl(struct file *filp, unsigned int cmd, unsign
 
 static int datra_dma_from_logic_block_free(struct datra_dma_dev *dma_dev)
 {
+	/* Exported blocks may be in use elsewhere, they must stay */
+	if (atomic_read(&dma_dev->dma_from_logic_blocks.exports))
+		return -EBUSY;
 	/* Reset the device to release all resources */
 	datra_dma_from_logic_reset(dma_dev);
 	return datra_dma_common_block_free(dma_dev, &dma_dev->dma_from_logic_blocks, DMA_FROM_DEVICE);
@@ -2510,7 +5737,9 @@ static int datra_dma_from_logic_block_alloc(struct datra_dma_dev *dma_dev,
 	r.size = request.size;
 	r.count = request.count;
 
-	datra_dma_from_logic_block_free(dma_dev);
+	ret = datra_dma_from_logic_block_free(dma_dev);
+	if (ret)
+		return ret;
 	ret = datra_dma_common_block_alloc(dma_dev, &r,
 		&dma_dev->dma_from_logic_blocks, DMA_FROM_DEVICE);
 	if (ret)
@@ -2571,6 +5800,7 @@ static int datra_dma_from_logic_block_enqueue(struct datra_dma_dev *dma_dev,
 	pr_debug("%s status=%#x\n", __func__, status_reg);
 	if (!(status_reg & 0xFF0000))
 		return -EWOULDBLOCK;
+	datra_dma_block_sync_for_device(block, DMA_FROM_DEVICE);
 
 	/* Send to logic */
 	pr_debug("%s sending addr=0x%llx size=%u\n", __func__,
@@ -2579,6 +5809,9 @@ static int datra_dma_from_logic_block_enqueue(struct datra_dma_dev *dma_dev,
 	if (dma_dev->dma_64bit)
 		iowrite32(block->phys_addr >> 32, control_base + (DATRA_DMA_FROMLOGIC_STARTADDR_HIGH>>2));
 	iowrite32(request_bytes_used, control_base + (DATRA_DMA_FROMLOGIC_BYTESIZE>>2));
+	block->submit_ns = datra_dma_latency_submit(&dma_dev->latency_from_logic);
+	trace_datra_dma_block_enqueue(datra_dma_get_index(dma_dev), false,
+		block->data.id, request_bytes_used);
 	block->data.bytes_used = 0;
 	block->data.state = 1;
 
@@ -2589,7 +5822,8 @@ static int datra_dma_from_logic_block_enqueue(struct datra_dma_dev *dma_dev,
 }
 
 static int datra_dma_from_logic_block_dequeue(struct datra_dma_dev *dma_dev,
-	struct datra_buffer_block __user *arg, bool is_blocking)
+	struct datra_buffer_block __user *arg, bool is_blocking,
+	bool with_timestamps)
 {
 	struct datra_buffer_block request;
 	struct datra_dma_block *block;
@@ -2623,8 +5857,11 @@ static int datra_dma_from_logic_block_dequeue(struct datra_dma_dev *dma_dev,
 		}
 		/* Enable interrupt */
 		datra_dma_from_logic_irq_enable(control_base);
-		if (!is_blocking)
+		if (!is_blocking) {
+			atomic64_inc(&dma_dev->stats_from_logic.eagain);
 			return -EAGAIN;
+		}
+		atomic64_inc(&dma_dev->stats_from_logic.blocked);
 		schedule();
 	}
 	if (is_blocking)
@@ -2637,12 +5874,20 @@ static int datra_dma_from_logic_block_dequeue(struct datra_dma_dev *dma_dev,
 		pr_err("%s Expected addr 0x%llx result 0x%llx\n", __func__, (u64)block->phys_addr, (u64)start_addr);
 		return -EIO;
 	}
+	datra_dma_block_sync_for_cpu(block, DMA_FROM_DEVICE);
 	block->data.user_signal = datra_reg_read_quick(control_base, DATRA_DMA_FROMLOGIC_RESULT_USERBITS);
 	block->data.bytes_used = datra_reg_read(control_base, DATRA_DMA_FROMLOGIC_RESULT_BYTESIZE);
 	block->data.state = 0;
+	datra_dma_count(&dma_dev->stats_from_logic, block->data.bytes_used,
+		block->data.bytes_used != block->data.size);
+	trace_datra_dma_block_dequeue(datra_dma_get_index(dma_dev), false,
+		block->data.id, block->data.bytes_used);
+	block->complete_ns = datra_dma_latency_complete(&dma_dev->latency_from_logic);
 
 	if (copy_to_user(arg, &block->data, sizeof(struct datra_buffer_block)))
 		return -EFAULT;
+	if (with_timestamps)
+		return datra_dma_block_put_timestamps(block, arg);
 
 	return 0;
 }
@@ -2664,16 +5909,33 @@ static int datra_dma_from_logic_reconfigure(struct datra_dma_dev *dma_dev,
 	if (copy_from_user(&request, arg, sizeof(request)))
 		return -EFAULT;
 
-	pr_debug("%s mode=%d count=%u size=%u\n", __func__,
+	pr_debug("%s mode=%#x count=%u size=%u\n", __func__,
 		request.mode, request.count, request.size);
 
-	datra_dma_from_logic_block_free(dma_dev);
+	if (request.mode & ~(DATRA_DMA_MODE_MASK | DATRA_DMA_MODE_FLAG_HUGEPAGE))
+		return -EINVAL;
+
+	ret = datra_dma_from_logic_block_free(dma_dev);
+	if (ret)
+		return ret;
 
-	switch (request.mode) {
+	switch (request.mode & DATRA_DMA_MODE_MASK) {
 		case DATRA_DMA_MODE_STANDALONE:
 			ret = -EINVAL;
 			break;
 		case DATRA_DMA_MODE_RINGBUFFER_BOUNCE:
+		case DATRA_DMA_MODE_RINGBUFFER_STREAMING:
+			/* Logic may still access the ring, only replace it once
+			 * the engine is stopped. -EINVAL means the DMA core
+			 * wasn't running. It's allocated on next use. */
+			if (dma_dev->dma_from_logic_streaming !=
+			    ((request.mode & DATRA_DMA_MODE_MASK) == DATRA_DMA_MODE_RINGBUFFER_STREAMING)) {
+				ret = datra_dma_from_logic_reset(dma_dev);
+				if (ret && ret != -EINVAL)
+					break;
+				datra_dma_from_logic_ring_free(dma_dev);
+				dma_dev->dma_from_logic_streaming = !dma_dev->dma_from_logic_streaming;
+			}
 			request.size = dma_dev->dma_from_logic_block_size;
 			request.count = dma_dev->dma_from_logic_memory_size / dma_dev->dma_from_logic_block_size;
 			ret = 0;
@@ -2726,6 +5988,9 @@ static long datra_dma_from_logic_ioctl(struct file *filp, unsigned int cmd, unsi
 				return -EBUSY; /* Cannot change value */
 			if (dma_dev->dma_from_logic_memory_size % arg)
 				return -EINVAL; /* Must be divisable */
+			/* Blocks must not share cache lines when streaming */
+			if (dma_dev->dma_from_logic_streaming && arg < dma_get_cache_alignment())
+				return -EINVAL;
 			dma_dev->dma_from_logic_block_size = arg;
 			dma_dev->dma_from_logic_head = 0;
 			dma_dev->dma_from_logic_tail = 0;
@@ -2737,6 +6002,14 @@ static long datra_dma_from_logic_ioctl(struct file *filp, unsigned int cmd, unsi
 			return dma_dev->dma_from_logic_current_op.user_signal;
 		case DATRA_IOC_USERSIGNAL_TELL:
 			return -EACCES;
+		case DATRA_IOC_BYTE_MODE_QUERY:
+			return dma_dev->dma_from_logic_byte_mode;
+		case DATRA_IOC_BYTE_MODE_TELL:
+			if (arg > 1)
+				return -EINVAL;
+			dma_dev->dma_from_logic_byte_mode = arg;
+			dma_dev->dma_from_logic_eof = false;
+			return 0;
 		case DATRA_IOC_DMA_RECONFIGURE:
 			return datra_dma_from_logic_reconfigure(dma_dev,
 				(struct datra_dma_configuration_req __user *)arg);
@@ -2754,7 +6027,21 @@ static long datra_dma_from_logic_ioctl(struct file *filp, unsigned int cmd, unsi
 		case DATRA_IOC_DMABLOCK_DEQUEUE:
 			return datra_dma_from_logic_block_dequeue(dma_dev,
 				(struct datra_buffer_block __user *)arg,
-				(filp->f_flags & O_NONBLOCK) == 0);
+				(filp->f_flags & O_NONBLOCK) == 0,
+				_IOC_SIZE(cmd) == sizeof(struct datra_buffer_block_ts));
+		case DATRA_IOC_DMABLOCK_EXPORT:
+			return datra_dma_common_block_export(filp,
+				&dma_dev->dma_from_logic_blocks,
+				(struct datra_buffer_block_export_req __user *)arg);
+		case DATRA_IOC_DMABLOCK_IMPORT:
+			return datra_dma_common_block_import(dma_dev,
+				&dma_dev->dma_from_logic_blocks, DMA_FROM_DEVICE,
+				(struct datra_buffer_block_import_req __user *)arg);
+#ifdef DATRA_HAVE_USERPTR
+		case DATRA_IOC_DMABLOCK_USERPTR:
+			return datra_dma_from_logic_block_userptr(dma_dev,
+				(struct datra_buffer_block_userptr_req __user *)arg);
+#endif
 		default:
 			return -ENOTTY;
 	}
@@ -2764,9 +6051,15 @@ static const struct file_operations datra_dma_to_logic_fops =
 {
 	.owner = THIS_MODULE,
 	.write = datra_dma_write,
+#ifdef DATRA_HAVE_SPLICE
+	.splice_write = datra_dma_splice_write,
+#endif
 	.llseek = no_llseek,
 	.poll = datra_dma_to_logic_poll,
 	.mmap = datra_dma_to_logic_mmap,
+#ifdef DATRA_HAVE_HUGEPAGE
+	.get_unmapped_area = thp_get_unmapped_area,
+#endif
 	.unlocked_ioctl = datra_dma_to_logic_ioctl,
 	.open = datra_dma_open,
 	.release = datra_dma_to_logic_release,
@@ -2776,9 +6069,15 @@ static const struct file_operations datra_dma_from_logic_fops =
 {
 	.owner = THIS_MODULE,
 	.read = datra_dma_read,
+#ifdef DATRA_HAVE_SPLICE
+	.splice_read = datra_dma_splice_read,
+#endif
 	.llseek = no_llseek,
 	.poll = datra_dma_from_logic_poll,
 	.mmap = datra_dma_from_logic_mmap,
+#ifdef DATRA_HAVE_HUGEPAGE
+	.get_unmapped_area = thp_get_unmapped_area,
+#endif
 	.unlocked_ioctl = datra_dma_from_logic_ioctl,
 	.open = datra_dma_open,
 	.release = datra_dma_from_logic_release,
@@ -2802,6 +6101,7 @@ static irqreturn_t datra_dma_isr(struct datra_dev *dev, struct datra_config_dev
 	pr_debug("%s(status=%#x)\n", __func__, status);
 	if (!status)
 		return IRQ_NONE;
+	trace_datra_isr(datra_get_config_index(cfg_dev), status);
 	/* Acknowledge IRQ */
 	iowrite32_quick(status,
 			cfg_dev->control_base + (DATRA_REG_FIFO_IRQ_CLR>>2));
@@ -2815,10 +6115,16 @@ static irqreturn_t datra_dma_isr(struct datra_dev *dev, struct datra_config_dev
 			datra_reg_read_quick(cfg_dev->control_base, DATRA_DMA_FROMLOGIC_CONTROL) & ~BIT(1),
 			cfg_dev->control_base + (DATRA_DMA_FROMLOGIC_CONTROL>>2));
 	/* Wake up the proper queues */
+	if (status & BIT(0))
+		datra_dma_latency_irq(&dma_dev->latency_to_logic,
+			cfg_dev->control_base, DATRA_DMA_TOLOGIC_STATUS);
+	if (status & BIT(16))
+		datra_dma_latency_irq(&dma_dev->latency_from_logic,
+			cfg_dev->control_base, DATRA_DMA_FROMLOGIC_STATUS);
 	if (status & (BIT(0) | BIT(15)))
-		wake_up_interruptible(&dma_dev->wait_queue_to_logic);
+		datra_wake_up(&dma_dev->wait_queue_to_logic, &dma_dev->stats_to_logic);
 	if (status & (BIT(16) | BIT(31)))
-		wake_up_interruptible(&dma_dev->wait_queue_from_logic);
+		datra_wake_up(&dma_dev->wait_queue_from_logic, &dma_dev->stats_from_logic);
 	return IRQ_HANDLED;
 }
 
@@ -2864,6 +6170,75 @@ static irqreturn_t datra_isr(int irq, void *dev_id)
 	return result;
 }
 
+/* Statistics attributes, "offset" locates the counter within the
+ * device's driver data. */
+struct datra_stat_attribute {
+	struct device_attribute attr;
+	size_t offset;
+};
+
+static ssize_t datra_stat_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct datra_stat_attribute *stat_attr =
+		container_of(attr, struct datra_stat_attribute, attr);
+	atomic64_t *counter = (atomic64_t *)
+		((char *)dev_get_drvdata(dev) + stat_attr->offset);
+
+	return sprintf(buf, "%llu\n", (u64)atomic64_read(counter));
+}
+
+#define DATRA_STAT_ATTR(_prefix, _type, _member, _name) \
+	static struct datra_stat_attribute datra_stat_##_prefix##_##_name = { \
+		.attr = __ATTR(_name, 0444, datra_stat_show, NULL), \
+		.offset = offsetof(_type, _member._name), \
+	}
+
+#define DATRA_STAT_ATTRS(_prefix, _type, _member) \
+	DATRA_STAT_ATTR(_prefix, _type, _member, bytes); \
+	DATRA_STAT_ATTR(_prefix, _type, _member, blocks); \
+	DATRA_STAT_ATTR(_prefix, _type, _member, short_transfers); \
+	DATRA_STAT_ATTR(_prefix, _type, _member, irqs); \
+	DATRA_STAT_ATTR(_prefix, _type, _member, wakeups); \
+	DATRA_STAT_ATTR(_prefix, _type, _member, blocked); \
+	DATRA_STAT_ATTR(_prefix, _type, _member, eagain); \
+	DATRA_STAT_ATTR(_prefix, _type, _member, stalls); \
+	static struct attribute *datra_stat_##_prefix##_attrs[] = { \
+		&datra_stat_##_prefix##_bytes.attr.attr, \
+		&datra_stat_##_prefix##_blocks.attr.attr, \
+		&datra_stat_##_prefix##_short_transfers.attr.attr, \
+		&datra_stat_##_prefix##_irqs.attr.attr, \
+		&datra_stat_##_prefix##_wakeups.attr.attr, \
+		&datra_stat_##_prefix##_blocked.attr.attr, \
+		&datra_stat_##_prefix##_eagain.attr.attr, \
+		&datra_stat_##_prefix##_stalls.attr.attr, \
+		NULL, \
+	}
+
+DATRA_STAT_ATTRS(to_logic, struct datra_dma_dev, stats_to_logic);
+DATRA_STAT_ATTRS(from_logic, struct datra_dma_dev, stats_from_logic);
+DATRA_STAT_ATTRS(fifo, struct datra_fifo_dev, stats);
+
+static const struct attribute_group datra_dma_to_logic_stat_group = {
+	.name = "statistics_to_logic",
+	.attrs = datra_stat_to_logic_attrs,
+};
+
+static const struct attribute_group datra_dma_from_logic_stat_group = {
+	.name = "statistics_from_logic",
+	.attrs = datra_stat_from_logic_attrs,
+};
+
+static const struct attribute_group datra_fifo_stat_group = {
+	.name = "statistics",
+	.attrs = datra_stat_fifo_attrs,
+};
+
+static const struct attribute_group *datra_fifo_groups[] = {
+	&datra_fifo_stat_group,
+	NULL,
+};
+
 static int create_sub_devices_cpu_fifo(struct datra_config_dev *cfg_dev)
 {
 	int retval;
@@ -2904,6 +6279,16 @@ static int create_sub_devices_cpu_fifo(struct datra_config_dev *cfg_dev)
 	fifo_ctl_dev->number_of_fifo_write_devices = number_of_write_fifos;
 	fifo_ctl_dev->number_of_fifo_read_devices = number_of_read_fifos;
 
+	/* Reads must not go through a write-combining mapping, since
+	 * speculative loads would pop data from the FIFO. */
+	if (datra_fifo_write_combine && dev->mem && number_of_write_fifos) {
+		fifo_ctl_dev->write_base_wc = devm_ioremap_wc(device,
+			dev->mem->start + datra_get_config_mem_offset(cfg_dev),
+			number_of_write_fifos * DATRA_FIFO_MEMORY_SIZE);
+		if (!fifo_ctl_dev->write_base_wc)
+			dev_warn(device, "write-combining FIFO mapping failed\n");
+	}
+
 	first_fifo_devt = dev->devt_last;
 	retval = register_chrdev_region(first_fifo_devt,
 				(number_of_write_fifos + number_of_read_fifos), DRIVER_FIFO_CLASS_NAME);
@@ -2935,9 +6320,11 @@ static int create_sub_devices_cpu_fifo(struct datra_config_dev *cfg_dev)
 		fifo_dev->config_parent = cfg_dev;
 		fifo_dev->index = i;
 		init_waitqueue_head(&fifo_dev->fifo_wait_queue);
-		char_device = device_create(dev->class, device,
-			first_fifo_devt + fifo_index,
-			fifo_dev, DRIVER_FIFO_WRITE_NAME, dev->count_fifo_write_devices + i);
+		spin_lock_init(&fifo_dev->ring_lock);
+		spin_lock_init(&fifo_dev->adapt_lock);
+		char_device = device_create_with_groups(dev->class, device,
+			first_fifo_devt + fifo_index, fifo_dev, datra_fifo_groups,
+			DRIVER_FIFO_WRITE_NAME, dev->count_fifo_write_devices + i);
 		if (IS_ERR(char_device)) {
 			dev_err(device, "unable to create fifo write device %d\n",
 				i);
@@ -2951,9 +6338,11 @@ static int create_sub_devices_cpu_fifo(struct datra_config_dev *cfg_dev)
 		fifo_dev->config_parent = cfg_dev;
 		fifo_dev->index = i;
 		init_waitqueue_head(&fifo_dev->fifo_wait_queue);
-		char_device = device_create(dev->class, device,
-			first_fifo_devt + fifo_index,
-			fifo_dev, DRIVER_FIFO_READ_NAME, dev->count_fifo_read_devices + i);
+		spin_lock_init(&fifo_dev->ring_lock);
+		spin_lock_init(&fifo_dev->adapt_lock);
+		char_device = device_create_with_groups(dev->class, device,
+			first_fifo_devt + fifo_index, fifo_dev, datra_fifo_groups,
+			DRIVER_FIFO_READ_NAME, dev->count_fifo_read_devices + i);
 		if (IS_ERR(char_device)) {
 			dev_err(char_device, "unable to create fifo read device %d\n",
 				i);
@@ -2983,6 +6372,138 @@ error_register_chrdev_region:
 	return retval;
 }
 
+static ssize_t block_pool_limit_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct datra_dma_dev *dma_dev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%zu\n", dma_dev->block_pool_limit);
+}
+
+static ssize_t block_pool_limit_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct datra_dma_dev *dma_dev = dev_get_drvdata(dev);
+	unsigned long value;
+	int ret;
+
+	ret = kstrtoul(buf, 0, &value);
+	if (ret)
+		return ret;
+
+	mutex_lock(&dma_dev->block_pool_lock);
+	dma_dev->block_pool_limit = value;
+	datra_dma_pool_trim(dma_dev, value);
+	mutex_unlock(&dma_dev->block_pool_lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(block_pool_limit);
+
+static ssize_t block_pool_usage_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct datra_dma_dev *dma_dev = dev_get_drvdata(dev);
+	size_t usage;
+
+	mutex_lock(&dma_dev->block_pool_lock);
+	usage = dma_dev->block_pool_usage;
+	mutex_unlock(&dma_dev->block_pool_lock);
+
+	return sprintf(buf, "%zu\n", usage);
+}
+static DEVICE_ATTR_RO(block_pool_usage);
+
+/* Writing anything releases all pooled blocks */
+static ssize_t block_pool_flush_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct datra_dma_dev *dma_dev = dev_get_drvdata(dev);
+
+	mutex_lock(&dma_dev->block_pool_lock);
+	datra_dma_pool_trim(dma_dev, 0);
+	mutex_unlock(&dma_dev->block_pool_lock);
+
+	return count;
+}
+static DEVICE_ATTR_WO(block_pool_flush);
+
+static struct attribute *datra_dma_attrs[] = {
+	&dev_attr_block_pool_limit.attr,
+	&dev_attr_block_pool_usage.attr,
+	&dev_attr_block_pool_flush.attr,
+	NULL,
+};
+
+static const struct attribute_group datra_dma_group = {
+	.attrs = datra_dma_attrs,
+};
+
+static const struct attribute_group *datra_dma_groups[] = {
+	&datra_dma_group,
+	&datra_dma_to_logic_stat_group,
+	&datra_dma_from_logic_stat_group,
+	NULL,
+};
+
+static int datra_latency_show(struct seq_file *m, void *offset)
+{
+	struct datra_latency_hist *hist = m->private;
+	unsigned int i;
+
+	seq_puts(m, "ns count\n");
+	for (i = 0; i < DATRA_LATENCY_BUCKETS; ++i) {
+		u64 count = atomic64_read(&hist->buckets[i]);
+
+		if (count)
+			seq_printf(m, "%llu %llu\n", 1ULL << i, count);
+	}
+	return 0;
+}
+
+static int datra_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, datra_latency_show, inode->i_private);
+}
+
+/* Writing anything clears the histogram */
+static ssize_t datra_latency_write(struct file *file, const char __user *buf,
+	size_t count, loff_t *ppos)
+{
+	struct datra_latency_hist *hist =
+		((struct seq_file *)file->private_data)->private;
+	unsigned int i;
+
+	for (i = 0; i < DATRA_LATENCY_BUCKETS; ++i)
+		atomic64_set(&hist->buckets[i], 0);
+	return count;
+}
+
+static const struct file_operations datra_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = datra_latency_open,
+	.read = seq_read,
+	.write = datra_latency_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void datra_dma_debugfs_init(struct datra_dma_dev *dma_dev,
+	const char *name)
+{
+	struct dentry *dir = debugfs_create_dir(name,
+		dma_dev->config_parent->parent->debugfs);
+
+	debugfs_create_file("to_logic_hardware_latency", 0644, dir,
+		&dma_dev->latency_to_logic.hardware, &datra_latency_fops);
+	debugfs_create_file("to_logic_user_latency", 0644, dir,
+		&dma_dev->latency_to_logic.user, &datra_latency_fops);
+	debugfs_create_file("from_logic_hardware_latency", 0644, dir,
+		&dma_dev->latency_from_logic.hardware, &datra_latency_fops);
+	debugfs_create_file("from_logic_user_latency", 0644, dir,
+		&dma_dev->latency_from_logic.user, &datra_latency_fops);
+}
+
 static int create_sub_devices_dma_fifo(
 	struct datra_config_dev *cfg_dev)
 {
@@ -3016,6 +6537,15 @@ static int create_sub_devices_dma_fifo(
 	init_waitqueue_head(&dma_dev->wait_queue_to_logic);
 	init_waitqueue_head(&dma_dev->wait_queue_from_logic);
 	INIT_KFIFO(dma_dev->dma_to_logic_wip);
+	INIT_KFIFO(dma_dev->latency_to_logic.submit_ns);
+	INIT_KFIFO(dma_dev->latency_to_logic.complete);
+	INIT_KFIFO(dma_dev->latency_from_logic.submit_ns);
+	INIT_KFIFO(dma_dev->latency_from_logic.complete);
+	INIT_LIST_HEAD(&dma_dev->dma_to_logic_blocks.export_list);
+	INIT_LIST_HEAD(&dma_dev->dma_from_logic_blocks.export_list);
+	mutex_init(&dma_dev->block_pool_lock);
+	INIT_LIST_HEAD(&dma_dev->block_pool);
+	dma_dev->block_pool_limit = datra_dma_block_pool_limit;
 
 	first_fifo_devt = dev->devt_last;
 	retval = register_chrdev_region(first_fifo_devt, 1, DRIVER_DMA_CLASS_NAME);
@@ -3023,23 +6553,9 @@ static int create_sub_devices_dma_fifo(
 		goto error_register_chrdev_region;
 	dev->devt_last += 1;
 
-	dma_dev->dma_to_logic_memory = dma_alloc_coherent(device,
-		datra_dma_memory_size, &dma_dev->dma_to_logic_handle, GFP_DMA | GFP_KERNEL);
-	if (!dma_dev->dma_to_logic_memory) {
-		dev_err(device, "Failed dma_alloc_coherent for DMA device\n");
-		retval = -ENOMEM;
-		goto error_dma_to_logic_alloc;
-	}
+	/* Ring memory is allocated when first used */
 	dma_dev->dma_to_logic_memory_size = datra_dma_memory_size;
 	dma_dev->dma_to_logic_block_size = datra_dma_default_block_size;
-
-	dma_dev->dma_from_logic_memory = dma_alloc_coherent(device,
-		datra_dma_memory_size, &dma_dev->dma_from_logic_handle, GFP_DMA | GFP_KERNEL);
-	if (!dma_dev->dma_from_logic_memory) {
-		dev_err(device, "Failed dma_alloc_coherent for DMA device\n");
-		retval = -ENOMEM;
-		goto error_dma_from_logic_alloc;
-	}
 	dma_dev->dma_from_logic_memory_size = datra_dma_memory_size;
 	dma_dev->dma_from_logic_block_size = datra_dma_default_block_size;
 
@@ -3050,15 +6566,18 @@ static int create_sub_devices_dma_fifo(
 		dev_err(device, "cdev_add(dma_dev) failed\n");
 		goto error_cdev_add;
 	}
-	char_device = device_create(dev->class, device,
-		first_fifo_devt, dma_dev, DRIVER_DMA_DEVICE_NAME, dev->number_of_dma_devices);
+	char_device = device_create_with_groups(dev->class, device,
+		first_fifo_devt, dma_dev, datra_dma_groups,
+		DRIVER_DMA_DEVICE_NAME, dev->number_of_dma_devices);
 	if (IS_ERR(char_device)) {
 		dev_err(device, "unable to create DMA device %d\n", dev->number_of_dma_devices);
 		retval = PTR_ERR(char_device);
 		goto failed_device_create;
 	}
+	datra_dma_debugfs_init(dma_dev, dev_name(char_device));
 
 	dma_dev->dma_64bit = dev->dma_addr_bits > 32;
+	dma_dev->dma_uncached = datra_memcpy_source_is_uncached(device);
 
 	/* Interrupts not active yet, so wait for reset to complete by looking at IRQ status register */
 	retval = readl_poll_timeout(cfg_dev->control_base + (DATRA_REG_FIFO_IRQ_STATUS>>2),
@@ -3079,12 +6598,6 @@ static int create_sub_devices_dma_fifo(
 
 failed_device_create:
 error_cdev_add:
-	dma_free_coherent(device, dma_dev->dma_from_logic_memory_size,
-		dma_dev->dma_from_logic_memory, dma_dev->dma_from_logic_handle);
-error_dma_from_logic_alloc:
-	dma_free_coherent(device, dma_dev->dma_to_logic_memory_size,
-		dma_dev->dma_to_logic_memory, dma_dev->dma_to_logic_handle);
-error_dma_to_logic_alloc:
 	unregister_chrdev_region(first_fifo_devt, dev->devt_last);
 	dev->devt_last = first_fifo_devt;
 error_register_chrdev_region:
@@ -3096,18 +6609,20 @@ static void destroy_sub_devices_dma_fifo(
 	struct datra_config_dev *cfg_dev)
 {
 	struct datra_dma_dev* dma_dev = cfg_dev->private_data;
-	struct device *device = cfg_dev->parent->device;
-	/* Free any transfers */
-	datra_dma_to_logic_block_free(dma_dev);
-	datra_dma_from_logic_block_free(dma_dev);
+	/* Free any transfers. Exported blocks must stay, and will leak. */
+	if (datra_dma_to_logic_block_free(dma_dev) == -EBUSY)
+		datra_dma_common_block_orphan(dma_dev, &dma_dev->dma_to_logic_blocks);
+	if (datra_dma_from_logic_block_free(dma_dev) == -EBUSY)
+		datra_dma_common_block_orphan(dma_dev, &dma_dev->dma_from_logic_blocks);
+	mutex_lock(&dma_dev->block_pool_lock);
+	datra_dma_pool_trim(dma_dev, 0);
+	mutex_unlock(&dma_dev->block_pool_lock);
 	/* Stop the DMA cores */
 	iowrite32_quick(0, cfg_dev->control_base + (DATRA_DMA_FROMLOGIC_CONTROL>>2));
 	iowrite32_quick(0, cfg_dev->control_base + (DATRA_DMA_TOLOGIC_CONTROL>>2));
 	/* Release internal buffers */
-	dma_free_coherent(device, dma_dev->dma_from_logic_memory_size,
-		dma_dev->dma_from_logic_memory, dma_dev->dma_from_logic_handle);
-	dma_free_coherent(device, dma_dev->dma_to_logic_memory_size,
-		dma_dev->dma_to_logic_memory, dma_dev->dma_to_logic_handle);
+	datra_dma_from_logic_ring_free(dma_dev);
+	datra_dma_to_logic_ring_free(dma_dev);
 	device_destroy(cfg_dev->parent->class, dma_dev->cdev_dma.dev);
 }
 
@@ -3230,6 +6745,26 @@ static void datra_proc_show_cpu(struct seq_file *m, struct datra_config_dev *cfg
 		}
 		seq_printf(m, "total w=%d r=%d\n", tr_w, tr_r);
 	}
+	for (i = 0; i < fifo_dev->number_of_fifo_write_devices; ++i) {
+		struct datra_fifo_dev *wr = &fifo_dev->fifo_devices[i];
+		if (wr->ring_size)
+			seq_printf(m, "  fifo=%2d w ring=%u/%u max=%u stalls=%u\n",
+				i, wr->ring_head - wr->ring_tail, wr->ring_size,
+				wr->ring_max_level, wr->ring_stalls);
+		if (wr->adapt_latency_us)
+			seq_printf(m, "  fifo=%2d w adaptive target=%uus rate=%u/s thd=%u\n",
+				i, wr->adapt_latency_us, wr->adapt_rate, wr->adapt_threshold);
+	}
+	for (i = 0; i < fifo_dev->number_of_fifo_read_devices; ++i) {
+		struct datra_fifo_dev *rd = &fifo_dev->fifo_devices[fifo_dev->number_of_fifo_write_devices + i];
+		if (rd->ring_size)
+			seq_printf(m, "  fifo=%2d r ring=%u/%u max=%u overflows=%u stalls=%u\n",
+				i, rd->ring_head - rd->ring_tail, rd->ring_size,
+				rd->ring_max_level, rd->ring_overflows, rd->ring_stalls);
+		if (rd->adapt_latency_us)
+			seq_printf(m, "  fifo=%2d r adaptive target=%uus rate=%u/s thd=%u\n",
+				i, rd->adapt_latency_us, rd->adapt_rate, rd->adapt_threshold);
+	}
 	seq_printf(m, "  Counters: read=%u write=%u\n",
 		datra_reg_read_quick(control_base, DATRA_REG_FIFO_READ_COUNT),
 		datra_reg_read_quick(control_base, DATRA_REG_FIFO_WRITE_COUNT));
@@ -3278,6 +6813,14 @@ static void datra_proc_show_dma(struct seq_file *m, struct datra_config_dev *cfg
 	status = datra_reg_read_quick(cfg_dev->control_base, DATRA_DMA_FROMLOGIC_STATUS);
 	seq_printf(m, " re=%u fr=%u idle=%c\n",
 		status >> 24, (status >> 16) & 0xFF, (status & 0x01) ? 'Y' : 'N');
+	seq_printf(m, "  Block pool: %zu of %zu bytes\n",
+		dma_dev->block_pool_usage, dma_dev->block_pool_limit);
+	if (dma_dev->dma_from_logic_copy_ns)
+		seq_printf(m, "  Read copy: %llu bytes, %llu MB/s%s\n",
+			dma_dev->dma_from_logic_copy_bytes,
+			div64_u64(dma_dev->dma_from_logic_copy_bytes * 1000,
+				dma_dev->dma_from_logic_copy_ns),
+			dma_dev->dma_uncached ? " (uncached)" : "");
 }
 
 
@@ -3448,6 +6991,22 @@ static u32 datra_core_get_dma_addr_bus_width(struct datra_dev *dev)
 	return ret;
 }
 
+/* Handle interrupts, and thus wake up readers and writers, on the CPUs
+ * close to the device. Passing NULL removes the hint. */
+static void datra_core_set_irq_affinity_hint(struct datra_dev *dev,
+	const struct cpumask *mask)
+{
+	int node = dev_to_node(dev->device);
+
+	if (node == NUMA_NO_NODE)
+		return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+	irq_set_affinity_and_hint(dev->irq, mask);
+#else
+	irq_set_affinity_hint(dev->irq, mask);
+#endif
+}
+
 int datra_core_probe(struct device *device, struct datra_dev *dev)
 {
 	dev_t devt;
@@ -3465,7 +7024,16 @@ int datra_core_probe(struct device *device, struct datra_dev *dev)
 
 	/* Check DMA node address bus width and set dma_bit_mask accordingly */
 	dev->dma_addr_bits = datra_core_get_dma_addr_bus_width(dev);
+	if (dev->dma_addr_bits_max && dev->dma_addr_bits > dev->dma_addr_bits_max)
+		dev->dma_addr_bits = dev->dma_addr_bits_max;
 	retval = dma_set_mask_and_coherent(device, DMA_BIT_MASK(dev->dma_addr_bits));
+	if (unlikely(retval) && dev->dma_addr_bits > 32) {
+		/* Platform can't do it, fall back to the lower 4GB */
+		dev_warn(device, "Failed to set %u-bit DMA mask, using 32 bits\n",
+			dev->dma_addr_bits);
+		dev->dma_addr_bits = 32;
+		retval = dma_set_mask_and_coherent(device, DMA_BIT_MASK(32));
+	}
 	if (unlikely(retval))
 		dev_warn(device, "Failed to set DMA mask: %d", retval);
 
@@ -3531,9 +7099,12 @@ int datra_core_probe(struct device *device, struct datra_dev *dev)
 		dev_err(device, "Cannot claim IRQ\n");
 		goto failed_request_irq;
 	}
+	datra_core_set_irq_affinity_hint(dev, cpumask_of_node(dev_to_node(device)));
 	/* For edge-triggered interrupt, re-arm by writing something */
 	datra_reg_write_quick(dev->base, DATRA_REG_CONTROL_IRQ_REARM, 1);
 
+	dev->debugfs = debugfs_create_dir(DRIVER_CLASS_NAME, NULL);
+
 	while (device_index < dev->number_of_config_devices)
 	{
 		struct datra_config_dev* cfg_dev =
@@ -3573,10 +7144,12 @@ int datra_core_probe(struct device *device, struct datra_dev *dev)
 	return 0;
 
 failed_device_create_cfg:
+	debugfs_remove_recursive(dev->debugfs);
 	while (device_index) {
 		device_destroy(dev->class, dev->devt + 1 + device_index);
 		--device_index;
 	}
+	datra_core_set_irq_affinity_hint(dev, NULL);
 failed_request_irq:
 failed_device_create:
 	class_destroy(dev->class);
@@ -3592,9 +7165,12 @@ int datra_core_remove(struct device *device, struct datra_dev *dev)
 	int i;
 
 	remove_proc_entry(DRIVER_CLASS_NAME, NULL);
+	debugfs_remove_recursive(dev->debugfs);
 
 	for (i = 0; i < dev->number_of_config_devices; ++i)
 		destroy_sub_devices(&dev->config_devices[i]);
+	/* The IRQ is released after this, and must not have a hint then */
+	datra_core_set_irq_affinity_hint(dev, NULL);
 
 	for (i = dev->number_of_config_devices +
 		dev->count_fifo_write_devices + dev->count_fifo_read_devices;
@@ -37,6 +37,7 @@
 #define ICAP_NOT_AVAILABLE	((u8)-1)
 
 struct datra_dev; /* forward */
+struct dentry;
 
 struct datra_config_dev
 {
@@ -68,6 +69,8 @@ struct datra_dev
 	u8 number_of_dma_devices;
 	u8 icap_device_index;
 	u32 dma_addr_bits;
+	u32 dma_addr_bits_max; /* Limit imposed by the bus, 0 if none */
+	struct dentry *debugfs; /* Root of this device in debugfs */
 };
 
 int datra_core_remove(struct device *device, struct datra_dev *dev);
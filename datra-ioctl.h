@@ -55,6 +55,111 @@ struct datra_buffer_block {
 	__u16 state; /* Who's owner of the buffer */
 };
 
+/* Block with the CLOCK_MONOTONIC times of its transfer, in nanoseconds */
+struct datra_buffer_block_ts {
+	struct datra_buffer_block block;
+	__u32 reserved;	/* Keeps the layout equal on 32 and 64-bit */
+	__u64 submit_ns;	/* When the block was enqueued */
+	__u64 complete_ns;	/* Interrupt that reported completion, else dequeue */
+};
+
+/* Export a block, or the whole block set, as a dma-buf file descriptor */
+struct datra_buffer_block_export_req {
+	__u32 id;	/* Block index, or DATRA_DMABLOCK_EXPORT_ALL */
+	__u32 flags;	/* O_CLOEXEC to set close-on-exec on the new fd */
+	__s32 fd;	/* (out) dma-buf file descriptor */
+};
+/* Export all blocks as one buffer. Only possible when the set is
+ * contiguous, which is the case when it fits in the ring buffer. */
+#define DATRA_DMABLOCK_EXPORT_ALL	0xFFFFFFFF
+
+/* Import a dma-buf as an extra block. The result is a block that can be
+ * enqueued and dequeued like any other, but it cannot be mapped through
+ * the datrad device (its offset is DATRA_DMABLOCK_OFFSET_NONE). */
+struct datra_buffer_block_import_req {
+	__s32 fd;	/* dma-buf file descriptor to import */
+	__u32 id;	/* (out) index of the new block */
+	__u32 size;	/* (out) size of the block */
+};
+#define DATRA_DMABLOCK_OFFSET_NONE	0xFFFFFFFF
+
+/* Register a user buffer for block mode. The buffer is pinned and mapped
+ * for DMA once, and split into "count" blocks of "size" bytes. The offset
+ * of each block is its position within the user buffer. Each block must
+ * be contiguous in the device's address space, which holds for hugepage
+ * backed buffers or when the device is behind an IOMMU. */
+struct datra_buffer_block_userptr_req {
+	__u64 addr;	/* Start of the buffer, page aligned */
+	__u32 size;	/* Size of each block, a multiple of the page size */
+	__u32 count;	/* Number of blocks (may be reduced) */
+};
+
+/* Maximum number of read or write fifos in a CPU node */
+#define DATRA_FIFO_MAX_COUNT	16
+
+/* Levels of all fifos of a CPU node, taken in one pass */
+struct datra_fifo_levels {
+	__u32 ready_read;	/* Bitmask of read fifos holding data */
+	__u32 ready_write;	/* Bitmask of write fifos with room */
+	__u32 read_level[DATRA_FIFO_MAX_COUNT];	/* Words available in bits 0..15, user signal in 16..31 */
+	__u32 write_level[DATRA_FIFO_MAX_COUNT];	/* Words of room */
+};
+
+/* One transfer in a batch. Without waiting, moves at most "count" words
+ * between the buffer and the fifo. Reads stop at a user signal change,
+ * like read() does. */
+struct datra_fifo_batch_item {
+	__u64 buffer;	/* Userspace buffer, 32-bit aligned */
+	__u32 fifo;	/* Index of the fifo within the CPU node */
+	__u32 count;	/* In: maximum number of words. Out: words transferred */
+	__u32 user_signal;	/* Out (reads only): user signal of the data */
+	__u32 reserved;
+};
+
+struct datra_fifo_batch {
+	__u64 items;	/* Userspace array of struct datra_fifo_batch_item */
+	__u32 count;	/* Number of items, at most 2*DATRA_FIFO_MAX_COUNT */
+	__u32 reserved;
+};
+
+/* When a blocking read() on a read fifo returns, like termios VMIN and
+ * VTIME. With both 0 (default), read() waits until the buffer is full.
+ * min_words only: return once at least min_words words were read.
+ * timeout_us only: return what is available, wait at most timeout_us for
+ * the first data, fail with ETIMEDOUT when none arrives.
+ * Both: return once min_words were read, or when no new data arrived for
+ * timeout_us after the first word. A user signal change still ends a
+ * read in all cases. */
+struct datra_fifo_read_timing {
+	__u32 min_words;
+	__u32 timeout_us;
+};
+
+/* Read formats for read fifos. In STREAM format (default), read() returns
+ * plain data and ends at each user signal change. In RECORDS format,
+ * read() returns a sequence of records, each a struct datra_fifo_record
+ * followed by "words" data words, so that one read() can deliver data
+ * with many different user signals. A blocking read waits for the first
+ * record, and then returns all records that fit and are available. */
+#define DATRA_FIFO_READ_FORMAT_STREAM	0
+#define DATRA_FIFO_READ_FORMAT_RECORDS	1
+
+struct datra_fifo_record {
+	__u16 user_signal;
+	__u16 words;	/* Number of 32-bit data words following */
+};
+
+/* mmap layout of a datrar or datraw device. Map one page at offset 0 to
+ * access the data window at data_offset within it, and one page at
+ * offset page_size (read-only) to poll the level register at
+ * level_offset - page_size within it. */
+struct datra_fifo_mmap_layout {
+	__u32 page_size;
+	__u32 data_offset;
+	__u32 data_size;
+	__u32 level_offset;
+};
+
 /* This STANDALONE mode is not supported anymore */
 #define DATRA_DMA_MODE_STANDALONE 0
 /* (default) Copies data from userspace into a kernel buffer and
@@ -67,9 +172,21 @@ struct datra_buffer_block {
 /* Blockwise data transfers, using  streaming DMA into cachable memory.
  * Managing the cache may cost more than actually copying the data. */
 #define DATRA_DMA_MODE_BLOCK_STREAMING	3
+/* Like RINGBUFFER_BOUNCE, but the ring is cachable memory. The driver
+ * only cleans or invalidates the parts of the ring that data passes
+ * through. Faster than the coherent ring when that is uncached, as on
+ * Zynq HP ports without hardware coherency. */
+#define DATRA_DMA_MODE_RINGBUFFER_STREAMING	4
+/* Flags that can be combined with the mode */
+#define DATRA_DMA_MODE_MASK	0xFFFF
+/* Map blocks into userspace using huge (PMD sized, typically 2MB) pages
+ * where possible, to reduce TLB misses on large blocks. The block size is
+ * rounded up to a multiple of the huge page size. Only applies to
+ * DATRA_DMA_MODE_BLOCK_COHERENT, and mappings must be shared. */
+#define DATRA_DMA_MODE_FLAG_HUGEPAGE	0x10000
 
 struct datra_dma_configuration_req {
-	__u32 mode;	/* One of DATRA_DMA_MODE.. */
+	__u32 mode;	/* One of DATRA_DMA_MODE.., and DATRA_DMA_MODE_FLAG.. */
 	__u32 size;	/* Size of each buffer (will be page aligned) */
 	__u32 count;	/* Number of buffers */
 };
@@ -99,12 +216,30 @@ struct datra_dma_configuration_req {
 #define DATRA_IOC_USERSIGNAL_QUERY	0x12
 #define DATRA_IOC_USERSIGNAL_TELL	0x13
 
+#define DATRA_IOC_RINGSIZE_QUERY	0x14
+#define DATRA_IOC_RINGSIZE_TELL	0x15
+
+#define DATRA_IOC_FIFO_LEVELS	0x16
+#define DATRA_IOC_FIFO_BATCH_READ	0x17
+#define DATRA_IOC_FIFO_BATCH_WRITE	0x18
+
+#define DATRA_IOC_READ_TIMING	0x19
+#define DATRA_IOC_TRESHOLD_ADAPTIVE	0x1A
+#define DATRA_IOC_READ_FORMAT_QUERY	0x1B
+#define DATRA_IOC_READ_FORMAT_TELL	0x1C
+#define DATRA_IOC_BYTE_MODE_QUERY	0x1D
+#define DATRA_IOC_BYTE_MODE_TELL	0x1E
+
 #define DATRA_IOC_DMA_RECONFIGURE	0x1F
 #define DATRA_IOC_DMABLOCK_ALLOC	0x20
 #define DATRA_IOC_DMABLOCK_FREE 	0x21
 #define DATRA_IOC_DMABLOCK_QUERY	0x22
 #define DATRA_IOC_DMABLOCK_ENQUEUE	0x23
 #define DATRA_IOC_DMABLOCK_DEQUEUE	0x24
+#define DATRA_IOC_DMABLOCK_EXPORT	0x25
+#define DATRA_IOC_DMABLOCK_IMPORT	0x26
+#define DATRA_IOC_DMABLOCK_USERPTR	0x27
+#define DATRA_IOC_FIFO_MMAP_LAYOUT	0x28
 
 #define DATRA_IOC_LICENSE_KEY	0x30
 #define DATRA_IOC_STATIC_ID	0x31
@@ -156,6 +291,11 @@ struct datra_dma_configuration_req {
  * tuning for low latency or reduced interrupt rate. */
 #define DATRA_IOCQTRESHOLD   _IO(DATRA_IOC_MAGIC, DATRA_IOC_TRESHOLD_QUERY)
 #define DATRA_IOCTTRESHOLD   _IO(DATRA_IOC_MAGIC, DATRA_IOC_TRESHOLD_TELL)
+/* Let the driver choose the thresholds, based on the measured data rate,
+ * aiming for one wakeup per "arg" microseconds. 0 switches back to the
+ * fixed threshold. Values that do not fit in 32 bits fail with EINVAL.
+ * DATRA_IOCQTRESHOLD then returns the threshold the driver chose last. */
+#define DATRA_IOCTTRESHOLD_ADAPTIVE   _IO(DATRA_IOC_MAGIC, DATRA_IOC_TRESHOLD_ADAPTIVE)
 /* Reset FIFO data (i.e. throw it away). Can be applied to config
  * nodes to reset its incoming fifos (argument is bitmask for queues to
  * reset), or to a CPU read/write fifo (argument ignored). */
@@ -165,6 +305,33 @@ struct datra_dma_configuration_req {
  * that aren't part of the actual data, but control the flow. */
 #define DATRA_IOCQUSERSIGNAL   _IO(DATRA_IOC_MAGIC, DATRA_IOC_USERSIGNAL_QUERY)
 #define DATRA_IOCTUSERSIGNAL   _IO(DATRA_IOC_MAGIC, DATRA_IOC_USERSIGNAL_TELL)
+/* Set or get the size in bytes of the kernel buffer that extends a CPU
+ * node fifo. The size is rounded up to a power of two, 0 disables the
+ * buffer. Can only be changed while the buffer is empty. */
+#define DATRA_IOCQRINGSIZE   _IO(DATRA_IOC_MAGIC, DATRA_IOC_RINGSIZE_QUERY)
+#define DATRA_IOCTRINGSIZE   _IO(DATRA_IOC_MAGIC, DATRA_IOC_RINGSIZE_TELL)
+/* On the config node of a CPU node (datracfg*): Get the levels of all its
+ * fifos at once, and read from or write to several fifos in one call.
+ * Batches return the total number of words transferred, and fail with
+ * EBUSY if an item refers to a fifo that is open as datrar or datraw. */
+#define DATRA_IOCGFIFO_LEVELS	_IOR(DATRA_IOC_MAGIC, DATRA_IOC_FIFO_LEVELS, struct datra_fifo_levels)
+#define DATRA_IOCFIFO_BATCH_READ	_IOWR(DATRA_IOC_MAGIC, DATRA_IOC_FIFO_BATCH_READ, struct datra_fifo_batch)
+#define DATRA_IOCFIFO_BATCH_WRITE	_IOWR(DATRA_IOC_MAGIC, DATRA_IOC_FIFO_BATCH_WRITE, struct datra_fifo_batch)
+/* Set or get the VMIN/VTIME-like read behaviour of a read fifo */
+#define DATRA_IOCSREAD_TIMING	_IOW(DATRA_IOC_MAGIC, DATRA_IOC_READ_TIMING, struct datra_fifo_read_timing)
+#define DATRA_IOCGREAD_TIMING	_IOR(DATRA_IOC_MAGIC, DATRA_IOC_READ_TIMING, struct datra_fifo_read_timing)
+/* Set or get the read format (DATRA_FIFO_READ_FORMAT_..) of a read fifo */
+#define DATRA_IOCQREAD_FORMAT	_IO(DATRA_IOC_MAGIC, DATRA_IOC_READ_FORMAT_QUERY)
+#define DATRA_IOCTREAD_FORMAT	_IO(DATRA_IOC_MAGIC, DATRA_IOC_READ_FORMAT_TELL)
+/* Byte mode (1) on datraw, datrar and datrad. Reads and writes then take
+ * any byte count: a partial last word is sent with user signal
+ * DATRA_USERSIGNAL_BYTES1..3, and a zero-length write sends a word with
+ * DATRA_USERSIGNAL_EOF, which makes read() return 0. The driver owns the
+ * user signal while in byte mode. */
+#define DATRA_IOCQBYTE_MODE	_IO(DATRA_IOC_MAGIC, DATRA_IOC_BYTE_MODE_QUERY)
+#define DATRA_IOCTBYTE_MODE	_IO(DATRA_IOC_MAGIC, DATRA_IOC_BYTE_MODE_TELL)
+/* Get the mmap layout of a datrar or datraw device */
+#define DATRA_IOCGFIFO_MMAP_LAYOUT	_IOR(DATRA_IOC_MAGIC, DATRA_IOC_FIFO_MMAP_LAYOUT, struct datra_fifo_mmap_layout)
 
 /* DMA configuration */
 #define DATRA_IOCDMA_RECONFIGURE _IOWR(DATRA_IOC_MAGIC, DATRA_IOC_DMA_RECONFIGURE, struct datra_dma_configuration_req)
@@ -175,6 +342,18 @@ struct datra_dma_configuration_req {
 #define DATRA_IOCDMABLOCK_QUERY	_IOWR(DATRA_IOC_MAGIC, DATRA_IOC_DMABLOCK_QUERY, struct datra_buffer_block)
 #define DATRA_IOCDMABLOCK_ENQUEUE	_IOWR(DATRA_IOC_MAGIC, DATRA_IOC_DMABLOCK_ENQUEUE, struct datra_buffer_block)
 #define DATRA_IOCDMABLOCK_DEQUEUE	_IOWR(DATRA_IOC_MAGIC, DATRA_IOC_DMABLOCK_DEQUEUE, struct datra_buffer_block)
+/* Same as DEQUEUE, but also returns the transfer timestamps */
+#define DATRA_IOCDMABLOCK_DEQUEUE_TS	_IOWR(DATRA_IOC_MAGIC, DATRA_IOC_DMABLOCK_DEQUEUE, struct datra_buffer_block_ts)
+/* Share blocks with other processes or drivers. The blocks cannot be freed
+ * or reconfigured until all dma-buf references are gone. */
+#define DATRA_IOCDMABLOCK_EXPORT	_IOWR(DATRA_IOC_MAGIC, DATRA_IOC_DMABLOCK_EXPORT, struct datra_buffer_block_export_req)
+/* Add a block backed by an external dma-buf. Only possible when no blocks
+ * were allocated, or all existing blocks were imported as well. The buffer
+ * must be contiguous in the device's address space. */
+#define DATRA_IOCDMABLOCK_IMPORT	_IOWR(DATRA_IOC_MAGIC, DATRA_IOC_DMABLOCK_IMPORT, struct datra_buffer_block_import_req)
+/* Replace the block set with blocks in user memory. Blocks remain pinned
+ * until freed or the device is closed. */
+#define DATRA_IOCDMABLOCK_USERPTR	_IOWR(DATRA_IOC_MAGIC, DATRA_IOC_DMABLOCK_USERPTR, struct datra_buffer_block_userptr_req)
 
 /* Read or write a 64-bit license key */
 #define DATRA_IOCSLICENSE_KEY   _IOW(DATRA_IOC_MAGIC, DATRA_IOC_LICENSE_KEY, unsigned long long)
@@ -0,0 +1,170 @@
+/*
+ * datra-memcpy.c
+ *
+ * Datra loadable kernel module.
+ *
+ * (C) Copyright 2013-2015 Topic Embedded Products B.V. (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of kernel-module-datra.
+ * kernel-module-datra is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kernel-module-datra is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include "datra-memcpy.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+#include <linux/dma-map-ops.h>
+#endif
+
+/*
+ * Coherent DMA memory on a non-coherent system is mapped uncached. Every
+ * load the generic copy routines issue then becomes a separate bus
+ * transaction. Loading a whole burst into the NEON registers lets the
+ * interconnect merge it, which is several times faster on Zynq. Since
+ * NEON registers cannot be used while faulting on a user page, data
+ * destined for userspace goes through a small cached bounce buffer.
+ */
+#if IS_ENABLED(CONFIG_KERNEL_MODE_NEON)
+#include <asm/neon.h>
+#include <asm/simd.h>
+#define DATRA_HAVE_NEON_COPY
+#endif
+
+/* Bytes moved per loop iteration of the burst copy */
+#define DATRA_MEMCPY_BURST	128
+/* Bytes copied per kernel_neon_begin/end section, this bounds the time
+ * spent with preemption disabled on older kernels. */
+#define DATRA_MEMCPY_KERNEL_CHUNK	4096
+/* Size of the on-stack bounce buffer for copies to userspace */
+#define DATRA_MEMCPY_USER_CHUNK	512
+
+bool datra_memcpy_source_is_uncached(struct device *device)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+	return !dev_is_dma_coherent(device);
+#else
+	/* Cannot tell, use the generic routines */
+	return false;
+#endif
+}
+
+#ifdef DATRA_HAVE_NEON_COPY
+static bool datra_memcpy_neon_usable(void)
+{
+#ifdef CONFIG_ARM64
+	if (!system_supports_fpsimd())
+		return false;
+#else
+	if (!cpu_has_neon())
+		return false;
+#endif
+	return may_use_simd();
+}
+
+/* The kernel is compiled without use of FP/SIMD registers, so the
+ * compiler keeps nothing in the registers that are trashed here and
+ * they need not be listed as clobbers. */
+static void datra_memcpy_neon_bursts(void *dst, const void *src, size_t bursts)
+{
+#ifdef CONFIG_ARM64
+	asm volatile(
+		"1:	ld1	{v0.16b-v3.16b}, [%1], #64\n"
+		"	ld1	{v4.16b-v7.16b}, [%1], #64\n"
+		"	st1	{v0.16b-v3.16b}, [%0], #64\n"
+		"	st1	{v4.16b-v7.16b}, [%0], #64\n"
+		"	subs	%2, %2, #1\n"
+		"	b.ne	1b\n"
+		: "+r" (dst), "+r" (src), "+r" (bursts)
+		:
+		: "cc", "memory");
+#else
+	asm volatile(
+		"	.fpu	neon\n"
+		"1:	vld1.8	{d0-d3}, [%1]!\n"
+		"	vld1.8	{d4-d7}, [%1]!\n"
+		"	vld1.8	{d8-d11}, [%1]!\n"
+		"	vld1.8	{d12-d15}, [%1]!\n"
+		"	vst1.8	{d0-d3}, [%0]!\n"
+		"	vst1.8	{d4-d7}, [%0]!\n"
+		"	vst1.8	{d8-d11}, [%0]!\n"
+		"	vst1.8	{d12-d15}, [%0]!\n"
+		"	subs	%2, %2, #1\n"
+		"	bne	1b\n"
+		: "+r" (dst), "+r" (src), "+r" (bursts)
+		:
+		: "cc", "memory");
+#endif
+}
+
+/* Copies as many whole bursts of "size" as possible, returns the number
+ * of bytes copied. */
+static size_t datra_memcpy_neon(void *dst, const void *src, size_t size)
+{
+	size_t bursts = size / DATRA_MEMCPY_BURST;
+
+	if (!bursts)
+		return 0;
+	kernel_neon_begin();
+	datra_memcpy_neon_bursts(dst, src, bursts);
+	kernel_neon_end();
+	return bursts * DATRA_MEMCPY_BURST;
+}
+#endif
+
+void datra_memcpy_from_uncached(void *dst, const void *src, size_t size)
+{
+#ifdef DATRA_HAVE_NEON_COPY
+	if (size >= DATRA_MEMCPY_BURST && datra_memcpy_neon_usable()) {
+		while (size >= DATRA_MEMCPY_BURST) {
+			size_t done = datra_memcpy_neon(dst, src,
+				min_t(size_t, size, DATRA_MEMCPY_KERNEL_CHUNK));
+			dst += done;
+			src += done;
+			size -= done;
+		}
+	}
+#endif
+	memcpy(dst, src, size);
+}
+
+unsigned long datra_copy_to_user_from_uncached(void __user *dst,
+	const void *src, unsigned long size)
+{
+#ifdef DATRA_HAVE_NEON_COPY
+	if (size >= DATRA_MEMCPY_BURST && datra_memcpy_neon_usable()) {
+		u8 bounce[DATRA_MEMCPY_USER_CHUNK] __aligned(16);
+
+		while (size >= DATRA_MEMCPY_BURST) {
+			size_t done = datra_memcpy_neon(bounce, src,
+				min_t(size_t, size, DATRA_MEMCPY_USER_CHUNK));
+			unsigned long left = copy_to_user(dst, bounce, done);
+
+			if (unlikely(left))
+				return size - done + left;
+			dst += done;
+			src += done;
+			size -= done;
+		}
+	}
+#endif
+	return copy_to_user(dst, src, size);
+}
@@ -0,0 +1,44 @@
+/*
+ * datra-memcpy.h
+ *
+ * Datra loadable kernel module.
+ *
+ * (C) Copyright 2013-2015 Topic Embedded Products B.V. (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of kernel-module-datra.
+ * kernel-module-datra is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kernel-module-datra is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+
+#include <linux/types.h>
+#include <linux/compiler.h>
+
+struct device;
+
+/* Returns true when coherent allocations for this device are not cached
+ * by the CPU, so reading them benefits from the routines below. */
+bool datra_memcpy_source_is_uncached(struct device *device);
+
+/* Copy from uncached (coherent DMA) memory into cached kernel memory */
+void datra_memcpy_from_uncached(void *dst, const void *src, size_t size);
+
+/* Copy from uncached memory to userspace. Returns the number of bytes
+ * that could not be copied, like copy_to_user. */
+unsigned long datra_copy_to_user_from_uncached(void __user *dst,
+	const void *src, unsigned long size);
@@ -31,6 +31,7 @@
 #include <linux/platform_device.h>
 #include <linux/init.h>
 #include <linux/nvmem-consumer.h>
+#include <linux/of_reserved_mem.h>
 #include <linux/slab.h>
 #include "datra-core.h"
 #include "datra.h"
@@ -70,6 +71,7 @@ static int datra_probe(struct platform_device *pdev)
 {
 	struct device *device = &pdev->dev;
 	struct datra_dev *dev;
+	int ret;
 
 	dev = devm_kzalloc(device, sizeof(*dev), GFP_KERNEL);
 	if (!dev)
@@ -91,19 +93,35 @@ static int datra_probe(struct platform_device *pdev)
 
 	datra_of_nvmem_license(dev, device->of_node);
 
-	return datra_core_probe(device, dev);
+	/* Use the "memory-region" (shared-dma-pool or CMA) when specified,
+	 * so that all DMA buffers are carved out of that region */
+	ret = of_reserved_mem_device_init(device);
+	if (ret && ret != -ENODEV) {
+		dev_err(device, "Failed to initialize memory-region: %d\n", ret);
+		return ret;
+	}
+
+	ret = datra_core_probe(device, dev);
+	if (ret)
+		of_reserved_mem_device_release(device);
+
+	return ret;
 }
 
 static int datra_remove(struct platform_device *pdev)
 {
 	struct device *device = &pdev->dev;
 	struct datra_dev *dev;
-	
+	int ret;
+
 	dev = dev_get_drvdata(device);
 	if (!dev)
 		return -ENODEV;
 
-	return datra_core_remove(device, dev);
+	ret = datra_core_remove(device, dev);
+	of_reserved_mem_device_release(device);
+
+	return ret;
 }
 
 
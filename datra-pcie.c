@@ -80,7 +80,8 @@ static void datra_pci_bar_initialize(struct device *device, void __iomem *regs)
 		1 << ((reg >> 1) & 0x03),	/* BIT1..2 = number of lanes (1, 2, 4, 8) */
 		(reg & BIT(11)) ? "UP" : "DOWN"); /* Uh, I don't really expect to see "down" here */
 
-	/* We use a very simple translation: All 32-bits to address 0 */
+	/* We use a very simple translation: the AXI BAR maps to PCIe bus
+	 * address 0, so DMA addresses below 4GB are passed as-is */
 	datra_pci_write_bar_reg(regs, AXIBAR2PCIEBAR_0U, 0);
 	datra_pci_write_bar_reg(regs, AXIBAR2PCIEBAR_0L, 0);
 }
@@ -141,19 +142,11 @@ static int datra_pci_probe(struct pci_dev *pdev,
 	}
 	dev->irq = pdev->irq;
 
-	/* pci_set_dma_mask removed in 5.17 */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
-	rc = dma_set_mask_and_coherent(device, DMA_BIT_MASK(32));
-	if (rc) {
-		dev_err(device, "Failed to set DMA mask. Aborting.\n");
-		return rc;
-	}
-#else
-	if (pci_set_dma_mask(pdev, DMA_BIT_MASK(32))) {
-		dev_err(device, "Failed to set DMA mask. Aborting.\n");
-		return -ENODEV;
-	}
-#endif
+	/* The bridge replaces the AXI address bits above its AXI BAR with
+	 * AXIBAR2PCIEBAR. The aperture is a bitstream parameter that can't
+	 * be read back, only 4GB is known to be covered. The core sets the
+	 * DMA mask. */
+	dev->dma_addr_bits_max = 32;
 
 	return datra_core_probe(device, dev);
 }
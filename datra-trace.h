@@ -0,0 +1,193 @@
+/*
+ * datra-trace.h
+ *
+ * Datra loadable kernel module.
+ *
+ * (C) Copyright 2013-2015 Topic Embedded Products B.V. (http://www.topic.nl).
+ * All rights reserved.
+ *
+ * This file is part of kernel-module-datra.
+ * kernel-module-datra is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kernel-module-datra is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with <product name>.  If not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA or see <http://www.gnu.org/licenses/>.
+ *
+ * You can contact Topic by electronic mail via info@topic.nl or via
+ * paper mail at the following address: Postbus 440, 5680 AK Best, The Netherlands.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM datra
+
+#if !defined(_DATRA_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DATRA_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* "node" is the 0-based index of the config node, like in /proc/datra */
+
+DECLARE_EVENT_CLASS(datra_dma_transfer,
+	TP_PROTO(unsigned int node, bool to_logic, u64 addr, u32 size,
+		u32 user_signal, unsigned int depth),
+	TP_ARGS(node, to_logic, addr, size, user_signal, depth),
+	TP_STRUCT__entry(
+		__field(unsigned int, node)
+		__field(bool, to_logic)
+		__field(u64, addr)
+		__field(u32, size)
+		__field(u32, user_signal)
+		__field(unsigned int, depth)
+	),
+	TP_fast_assign(
+		__entry->node = node;
+		__entry->to_logic = to_logic;
+		__entry->addr = addr;
+		__entry->size = size;
+		__entry->user_signal = user_signal;
+		__entry->depth = depth;
+	),
+	TP_printk("node=%u %s addr=0x%llx size=%u user_signal=%#x depth=%u",
+		__entry->node, __entry->to_logic ? "to_logic" : "from_logic",
+		__entry->addr, __entry->size, __entry->user_signal,
+		__entry->depth)
+);
+
+/* Command written to the DMA engine, depth is the number of commands in
+ * flight afterwards */
+DEFINE_EVENT(datra_dma_transfer, datra_dma_submit,
+	TP_PROTO(unsigned int node, bool to_logic, u64 addr, u32 size,
+		u32 user_signal, unsigned int depth),
+	TP_ARGS(node, to_logic, addr, size, user_signal, depth));
+
+/* Result taken from the DMA engine, depth is the number of results that
+ * remain */
+DEFINE_EVENT(datra_dma_transfer, datra_dma_complete,
+	TP_PROTO(unsigned int node, bool to_logic, u64 addr, u32 size,
+		u32 user_signal, unsigned int depth),
+	TP_ARGS(node, to_logic, addr, size, user_signal, depth));
+
+TRACE_EVENT(datra_dma_pump,
+	TP_PROTO(unsigned int node, unsigned int free_commands,
+		unsigned int results),
+	TP_ARGS(node, free_commands, results),
+	TP_STRUCT__entry(
+		__field(unsigned int, node)
+		__field(unsigned int, free_commands)
+		__field(unsigned int, results)
+	),
+	TP_fast_assign(
+		__entry->node = node;
+		__entry->free_commands = free_commands;
+		__entry->results = results;
+	),
+	TP_printk("node=%u free_commands=%u results=%u",
+		__entry->node, __entry->free_commands, __entry->results)
+);
+
+DECLARE_EVENT_CLASS(datra_dma_block,
+	TP_PROTO(unsigned int node, bool to_logic, u32 id, u32 bytes_used),
+	TP_ARGS(node, to_logic, id, bytes_used),
+	TP_STRUCT__entry(
+		__field(unsigned int, node)
+		__field(bool, to_logic)
+		__field(u32, id)
+		__field(u32, bytes_used)
+	),
+	TP_fast_assign(
+		__entry->node = node;
+		__entry->to_logic = to_logic;
+		__entry->id = id;
+		__entry->bytes_used = bytes_used;
+	),
+	TP_printk("node=%u %s id=%u bytes_used=%u",
+		__entry->node, __entry->to_logic ? "to_logic" : "from_logic",
+		__entry->id, __entry->bytes_used)
+);
+
+DEFINE_EVENT(datra_dma_block, datra_dma_block_enqueue,
+	TP_PROTO(unsigned int node, bool to_logic, u32 id, u32 bytes_used),
+	TP_ARGS(node, to_logic, id, bytes_used));
+
+DEFINE_EVENT(datra_dma_block, datra_dma_block_dequeue,
+	TP_PROTO(unsigned int node, bool to_logic, u32 id, u32 bytes_used),
+	TP_ARGS(node, to_logic, id, bytes_used));
+
+/* read() and write() calls. For fifos, "level" is the number of words
+ * in (read) or the room left in (write) the fifo or its ring after the
+ * call. For DMA, it is the number of bytes left in the current transfer
+ * (read) or the number of transfers in flight (write). */
+DECLARE_EVENT_CLASS(datra_rw,
+	TP_PROTO(unsigned int node, unsigned int index, size_t count,
+		ssize_t result, unsigned int level),
+	TP_ARGS(node, index, count, result, level),
+	TP_STRUCT__entry(
+		__field(unsigned int, node)
+		__field(unsigned int, index)
+		__field(size_t, count)
+		__field(ssize_t, result)
+		__field(unsigned int, level)
+	),
+	TP_fast_assign(
+		__entry->node = node;
+		__entry->index = index;
+		__entry->count = count;
+		__entry->result = result;
+		__entry->level = level;
+	),
+	TP_printk("node=%u index=%u count=%zu result=%zd level=%u",
+		__entry->node, __entry->index, __entry->count,
+		__entry->result, __entry->level)
+);
+
+DEFINE_EVENT(datra_rw, datra_dma_read,
+	TP_PROTO(unsigned int node, unsigned int index, size_t count,
+		ssize_t result, unsigned int level),
+	TP_ARGS(node, index, count, result, level));
+
+DEFINE_EVENT(datra_rw, datra_dma_write,
+	TP_PROTO(unsigned int node, unsigned int index, size_t count,
+		ssize_t result, unsigned int level),
+	TP_ARGS(node, index, count, result, level));
+
+DEFINE_EVENT(datra_rw, datra_fifo_read,
+	TP_PROTO(unsigned int node, unsigned int index, size_t count,
+		ssize_t result, unsigned int level),
+	TP_ARGS(node, index, count, result, level));
+
+DEFINE_EVENT(datra_rw, datra_fifo_write,
+	TP_PROTO(unsigned int node, unsigned int index, size_t count,
+		ssize_t result, unsigned int level),
+	TP_ARGS(node, index, count, result, level));
+
+TRACE_EVENT(datra_isr,
+	TP_PROTO(unsigned int node, u32 status),
+	TP_ARGS(node, status),
+	TP_STRUCT__entry(
+		__field(unsigned int, node)
+		__field(u32, status)
+	),
+	TP_fast_assign(
+		__entry->node = node;
+		__entry->status = status;
+	),
+	TP_printk("node=%u status=%#x", __entry->node, __entry->status)
+);
+
+#endif /* _DATRA_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE datra-trace
+#include <trace/define_trace.h>